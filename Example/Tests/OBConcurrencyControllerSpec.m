@@ -0,0 +1,109 @@
+//
+//  OBConcurrencyControllerSpec.m
+//  OBFileTransferTests
+//
+//  Created by etcetc on 10/17/26.
+//
+//  Simulation harness: the controller is driven by a fake clock against a simulated link, so every run gives the same
+//  limits.  There is always a backlog of transfers, each connection moves at most connectionRate and together they
+//  share linkRate.  Above timeoutAbove transfers in flight, one times out every tick.
+//
+
+#import "OBConcurrencyController.h"
+
+#define SIMULATION_TICK 0.1
+#define SIMULATED_TRANSFER_SIZE 2e6
+
+typedef struct
+{
+    double linkRate;
+    double connectionRate;
+    NSUInteger timeoutAbove;
+} OBSimulatedLink;
+
+// The limit after each tick
+static NSArray *simulate(OBConcurrencyController *controller, OBSimulatedLink link, NSTimeInterval duration)
+{
+    NSMutableArray *limits = [NSMutableArray new];
+    // Bytes left of each transfer in flight
+    NSMutableArray *remaining = [NSMutableArray new];
+    for (NSTimeInterval now = 0; now < duration; now += SIMULATION_TICK)
+    {
+        while (remaining.count < controller.limit)
+        {
+            [remaining addObject:@(SIMULATED_TRANSFER_SIZE)];
+        }
+        NSUInteger inFlight = remaining.count;
+        if (link.timeoutAbove > 0 && inFlight > link.timeoutAbove)
+        {
+            [remaining removeLastObject];
+            [controller transferFailed:YES];
+        }
+
+        double rate = MIN(link.connectionRate, link.linkRate / remaining.count);
+        for (NSUInteger i = 0; i < remaining.count;)
+        {
+            double left = [remaining[i] doubleValue];
+            double moved = MIN(left, rate * SIMULATION_TICK);
+            [controller transferredBytes:(int64_t)moved];
+            if (left - moved <= 0)
+            {
+                [remaining removeObjectAtIndex:i];
+                [controller transferSucceeded];
+            }
+            else
+            {
+                remaining[i++] = @(left - moved);
+            }
+        }
+        [controller updateAt:now inFlight:inFlight];
+        [limits addObject:@(controller.limit)];
+    }
+    return limits;
+}
+
+SpecBegin(OBConcurrencyController)
+
+describe(@"on a simulated link", ^{
+
+    __block OBConcurrencyController *controller;
+
+    beforeEach(^{
+        controller = [[OBConcurrencyController alloc] initWithLimit:1 minimum:1 maximum:16];
+    });
+
+    it(@"climbs to where the link is full and stays there", ^{
+        OBSimulatedLink link = {4e6, 1e6, 0};
+        NSArray *limits = simulate(controller, link, 300);
+
+        // 4 connections fill the link, the 5th is tried and shows no gain
+        expect([limits.lastObject unsignedIntegerValue]).to.beGreaterThanOrEqualTo(4);
+        expect([limits.lastObject unsignedIntegerValue]).to.beLessThanOrEqualTo(5);
+        expect([[limits valueForKeyPath:@"@max.unsignedIntegerValue"] unsignedIntegerValue]).to.beLessThanOrEqualTo(5);
+    });
+
+    it(@"halves on timeouts and climbs back", ^{
+        OBSimulatedLink link = {16e6, 1e6, 6};
+        NSArray *limits = simulate(controller, link, 600);
+
+        NSUInteger halvings = 0;
+        for (NSUInteger i = 1; i < limits.count; i++)
+        {
+            if ([limits[i] unsignedIntegerValue] < [limits[i - 1] unsignedIntegerValue])
+                halvings++;
+        }
+        expect(halvings).to.beGreaterThan(2);
+        expect([[limits valueForKeyPath:@"@max.unsignedIntegerValue"] unsignedIntegerValue]).to.beLessThanOrEqualTo(7);
+        NSArray *lastMinute = [limits subarrayWithRange:NSMakeRange(limits.count - 600, 600)];
+        expect([[lastMinute valueForKeyPath:@"@max.unsignedIntegerValue"] unsignedIntegerValue]).to.beGreaterThanOrEqualTo(6);
+    });
+
+    it(@"gives the same limits for the same link", ^{
+        OBSimulatedLink link = {4e6, 1e6, 0};
+        NSArray *first = simulate(controller, link, 120);
+        NSArray *second = simulate([[OBConcurrencyController alloc] initWithLimit:1 minimum:1 maximum:16], link, 120);
+        expect(second).to.equal(first);
+    });
+});
+
+SpecEnd
@@ -0,0 +1,81 @@
+//
+//  OBFileClonerSpec.m
+//  OBFileTransferTests
+//
+//  Created by etcetc on 10/17/26.
+//
+//  Before an upload can send its first byte the file is staged in the temporary directory.  Staging clones the file
+//  where the volume can, and copies it in chunks where it can't; either way the staged file has to be a copy of its
+//  own.
+//
+
+#import "OBFileCloner.h"
+
+// Not a multiple of the chunk size, so the last chunk of a chunked copy is a short one
+#define STAGED_FILE_SIZE (1024 * 1024 + 4321)
+
+static NSString *stagingPath(NSString *name)
+{
+    return [NSTemporaryDirectory() stringByAppendingPathComponent:name];
+}
+
+static BOOL volumeSupportsCloning(NSString *path)
+{
+    NSNumber *supportsCloning;
+    if (![[NSURL fileURLWithPath:path] getResourceValue:&supportsCloning forKey:NSURLVolumeSupportsFileCloningKey error:nil])
+        return NO;
+    return supportsCloning.boolValue;
+}
+
+SpecBegin(OBFileCloner)
+
+describe(@"staging an upload", ^{
+
+    __block NSString *original;
+    __block NSString *staged;
+    __block NSData *contents;
+
+    beforeAll(^{
+        original = stagingPath(@"clone-spec-original");
+        staged = stagingPath(@"clone-spec-staged");
+        NSMutableData *data = [NSMutableData dataWithLength:STAGED_FILE_SIZE];
+        arc4random_buf(data.mutableBytes, data.length);
+        contents = data;
+        [contents writeToFile:original atomically:NO];
+    });
+
+    beforeEach(^{
+        [[NSFileManager defaultManager] removeItemAtPath:staged error:nil];
+    });
+
+    afterAll(^{
+        [[NSFileManager defaultManager] removeItemAtPath:original error:nil];
+        [[NSFileManager defaultManager] removeItemAtPath:staged error:nil];
+    });
+
+    it(@"clones where the volume can and copies in chunks where it can't", ^{
+        OBFileCloneMethod method = [OBFileCloner cloneFileAtPath:original toPath:staged error:nil];
+
+        expect(method).to.equal(volumeSupportsCloning(NSTemporaryDirectory()) ? OBFileCloneCopyOnWrite : OBFileCloneChunkedCopy);
+        expect([NSData dataWithContentsOfFile:staged]).to.equal(contents);
+    });
+
+    it(@"copies every byte in chunks", ^{
+        expect([OBFileCloner copyRangeOfFile:original offset:0 length:STAGED_FILE_SIZE toPath:staged error:nil]).to.beTruthy();
+
+        expect([NSData dataWithContentsOfFile:staged]).to.equal(contents);
+    });
+
+    it(@"leaves the original alone when the staged file is written to", ^{
+        expect([OBFileCloner cloneFileAtPath:original toPath:staged error:nil]).notTo.equal(OBFileCloneFailed);
+
+        NSFileHandle *handle = [NSFileHandle fileHandleForWritingAtPath:staged];
+        [handle writeData:[NSMutableData dataWithLength:4096]];
+        [handle closeFile];
+
+        expect([NSData dataWithContentsOfFile:original]).to.equal(contents);
+        expect([[[NSFileManager defaultManager] attributesOfItemAtPath:staged error:nil] fileSize]).to.equal(STAGED_FILE_SIZE);
+    });
+});
+
+SpecEnd
@@ -0,0 +1,132 @@
+//
+//  OBFileTransferTaskManagerSpec.m
+//  OBFileTransferTests
+//
+//  Created by etcetc on 10/17/26.
+//
+//  Contention benchmark: a large batch of queued transfers is drained the way the scheduler does it while other
+//  threads keep looking tasks up, as the delegate callbacks do.  Lookups read the published snapshot, so they have to
+//  keep going while the drain changes the tasks, and always find the task they ask for or nothing.
+//
+
+#import <stdatomic.h>
+#import "OBFileTransferTaskManager.h"
+
+static NSArray *trackBatch(OBFileTransferTaskManager *manager, NSUInteger count)
+{
+    NSMutableArray *transfers = [NSMutableArray arrayWithCapacity:count];
+    for (NSUInteger i = 0; i < count; i++)
+    {
+        [transfers addObject:@{MarkerKey : [NSString stringWithFormat:@"bench-%lu", (unsigned long)i],
+                RemoteUrlKey : [NSString stringWithFormat:@"https://host%lu.example.com/file%lu", (unsigned long)(i % 4), (unsigned long)i],
+                LocalFilePathKey : [NSString stringWithFormat:@"/tmp/file%lu", (unsigned long)i]}];
+    }
+    return [manager trackTransfers:transfers upload:YES];
+}
+
+typedef struct
+{
+    NSUInteger lookupsDuringDrain;
+    NSUInteger wrongLookups;
+} OBDrainCounts;
+
+// Takes every task from Queued to InProgress to done, with four readers going at it meanwhile
+static OBDrainCounts drain(OBFileTransferTaskManager *manager, NSArray *tasks)
+{
+    // On the stack, the readers are done before we return
+    atomic_bool draining = true;
+    atomic_uint_fast64_t lookupCount = 0;
+    atomic_uint_fast64_t wrongLookupCount = 0;
+    atomic_bool *drainingRef = &draining;
+    atomic_uint_fast64_t *lookupCountRef = &lookupCount;
+    atomic_uint_fast64_t *wrongLookupCountRef = &wrongLookupCount;
+    dispatch_group_t readers = dispatch_group_create();
+    for (int reader = 0; reader < 4; reader++)
+    {
+        dispatch_group_async(readers, dispatch_get_global_queue(DISPATCH_QUEUE_PRIORITY_DEFAULT, 0), ^{
+            while (atomic_load(drainingRef))
+            {
+                OBFileTransferTask *task = tasks[arc4random_uniform((uint32_t)tasks.count)];
+                OBFileTransferTask *found = [manager transferTaskWithMarker:task.marker];
+                if (found != nil && found != task)
+                    atomic_fetch_add(wrongLookupCountRef, 1);
+                [manager countOfTasksWithStatus:FileTransferQueued upload:YES];
+                atomic_fetch_add(lookupCountRef, 1);
+            }
+        });
+    }
+
+    // Don't start before the readers are all going
+    while (atomic_load(&lookupCount) < 4)
+    {
+        usleep(100);
+    }
+    uint_fast64_t lookupsBefore = atomic_load(&lookupCount);
+    CFAbsoluteTime start = CFAbsoluteTimeGetCurrent();
+    for (OBFileTransferTask *task in tasks)
+    {
+        [manager update:task withStatus:FileTransferInProgress];
+        [manager removeTaskWithMarker:task.marker];
+    }
+    NSTimeInterval elapsed = CFAbsoluteTimeGetCurrent() - start;
+    uint_fast64_t lookupsAfter = atomic_load(&lookupCount);
+    atomic_store(&draining, false);
+    dispatch_group_wait(readers, DISPATCH_TIME_FOREVER);
+
+    OBDrainCounts counts;
+    counts.lookupsDuringDrain = (NSUInteger)(lookupsAfter - lookupsBefore);
+    counts.wrongLookups = (NSUInteger)atomic_load(&wrongLookupCount);
+    NSLog(@"Drained %lu tasks in %.3fs, %lu lookups meanwhile", (unsigned long)tasks.count, elapsed, (unsigned long)counts.lookupsDuringDrain);
+    return counts;
+}
+
+SpecBegin(OBFileTransferTaskManager)
+
+describe(@"under contention", ^{
+
+    __block OBFileTransferTaskManager *manager;
+    __block NSString *basePath;
+
+    beforeEach(^{
+        basePath = [NSTemporaryDirectory() stringByAppendingPathComponent:[[NSUUID UUID] UUIDString]];
+        manager = [[OBFileTransferTaskManager alloc] initWithStateBasePath:basePath];
+    });
+
+    afterEach(^{
+        [manager reset];
+        [manager flush];
+        NSString *directory = [basePath stringByDeletingLastPathComponent];
+        NSString *prefix = [basePath lastPathComponent];
+        for (NSString *file in [[NSFileManager defaultManager] contentsOfDirectoryAtPath:directory error:nil])
+        {
+            if ([file hasPrefix:prefix])
+                [[NSFileManager defaultManager] removeItemAtPath:[directory stringByAppendingPathComponent:file] error:nil];
+        }
+    });
+
+    it(@"keeps lookups going while a queued batch is drained", ^{
+        NSArray *tasks = trackBatch(manager, 10000);
+        OBDrainCounts counts = drain(manager, tasks);
+
+        expect(counts.lookupsDuringDrain).to.beGreaterThan(0);
+        expect(counts.wrongLookups).to.equal(0);
+        expect([manager allTasks].count).to.equal(0);
+        expect([manager countOfTasksWithStatus:FileTransferQueued upload:YES]).to.equal(0);
+        expect([manager countOfTasksWithStatus:FileTransferInProgress upload:YES]).to.equal(0);
+    });
+
+    it(@"keeps whole collection reads consistent with the lookups", ^{
+        NSArray *tasks = trackBatch(manager, 1000);
+        for (NSUInteger i = 0; i < 500; i++)
+        {
+            [manager update:tasks[i] withStatus:FileTransferInProgress];
+        }
+        expect([manager tasksWithStatus:FileTransferQueued].count).to.equal(500);
+        expect([manager processingTasks].count).to.equal(500);
+        expect([manager countOfTasksWithStatus:FileTransferInProgress upload:YES]).to.equal(500);
+        expect([manager transferTaskWithMarker:@"bench-999"]).to.equal(tasks[999]);
+        expect([manager allTasks].count).to.equal(1000);
+    });
+});
+
+SpecEnd
@@ -0,0 +1,225 @@
+//
+//  OBRetryDecisionSpec.m
+//  OBFileTransferTests
+//
+//  Created by etcetc on 10/17/26.
+//
+//  What the agents make of a failed request.  The decision only goes by the response, its body and the error, so
+//  each case is a canned response.
+//
+
+#import "OBFileTransferAgent.h"
+#import "OBS3FileTransferAgent.h"
+#import "OBGoogleCloudStorageFileTransferAgent.h"
+#import "OBRetryDecision.h"
+
+static NSHTTPURLResponse *responseWithStatus(NSInteger statusCode, NSDictionary *headers)
+{
+    return [[NSHTTPURLResponse alloc] initWithURL:[NSURL URLWithString:@"https://example.com/file"]
+                                       statusCode:statusCode
+                                      HTTPVersion:@"HTTP/1.1"
+                                     headerFields:headers];
+}
+
+static NSString *httpDate(NSDate *date)
+{
+    NSDateFormatter *formatter = [NSDateFormatter new];
+    formatter.locale = [NSLocale localeWithLocaleIdentifier:@"en_US_POSIX"];
+    formatter.timeZone = [NSTimeZone timeZoneWithAbbreviation:@"GMT"];
+    formatter.dateFormat = @"EEE',' dd MMM yyyy HH':'mm':'ss 'GMT'";
+    return [formatter stringFromDate:date];
+}
+
+static NSData *s3ErrorBody(NSString *code)
+{
+    NSString *xml = [NSString stringWithFormat:@"<?xml version=\"1.0\" encoding=\"UTF-8\"?>\n"
+                     "<Error><Code>%@</Code><Message>Canned</Message><RequestId>4442587FB7D0A2F9</RequestId></Error>", code];
+    return [xml dataUsingEncoding:NSUTF8StringEncoding];
+}
+
+static NSData *gcsErrorBody(NSInteger statusCode, NSString *reason)
+{
+    NSDictionary *json = @{@"error" : @{@"code" : @(statusCode),
+                                        @"message" : @"Canned",
+                                        @"errors" : @[@{@"domain" : @"usageLimits", @"reason" : reason}]}};
+    return [NSJSONSerialization dataWithJSONObject:json options:0 error:nil];
+}
+
+static NSError *statusError(NSInteger statusCode)
+{
+    return [NSError errorWithDomain:NSURLErrorDomain code:statusCode userInfo:nil];
+}
+
+SpecBegin(OBRetryDecision)
+
+describe(@"any agent", ^{
+
+    __block OBFileTransferAgent *agent;
+
+    beforeEach(^{
+        agent = [[OBFileTransferAgent alloc] initWithConfig:@{}];
+    });
+
+    it(@"waits as long as a Retry-After in seconds says", ^{
+        OBRetryDecision *decision = [agent retryDecisionForResponse:responseWithStatus(503, @{@"Retry-After" : @"120"})
+                                                               body:nil
+                                                              error:statusError(503)];
+
+        expect(decision.action).to.equal(OBRetryActionBackoff);
+        expect(decision.delay).to.equal(120);
+        expect(decision.reason).to.equal(@"HTTP 503");
+    });
+
+    it(@"waits until the date of a Retry-After", ^{
+        NSString *date = httpDate([NSDate dateWithTimeIntervalSinceNow:60]);
+        OBRetryDecision *decision = [agent retryDecisionForResponse:responseWithStatus(503, @{@"Retry-After" : date})
+                                                               body:nil
+                                                              error:statusError(503)];
+
+        expect(decision.action).to.equal(OBRetryActionBackoff);
+        // The date has whole seconds only
+        expect(decision.delay).to.beGreaterThan(55);
+        expect(decision.delay).to.beLessThanOrEqualTo(60);
+    });
+
+    it(@"doesn't wait for a Retry-After date gone by", ^{
+        NSString *date = httpDate([NSDate dateWithTimeIntervalSinceNow:-60]);
+        OBRetryDecision *decision = [agent retryDecisionForResponse:responseWithStatus(503, @{@"Retry-After" : date})
+                                                               body:nil
+                                                              error:statusError(503)];
+
+        expect(decision.action).to.equal(OBRetryActionBackoff);
+        expect(decision.delay).to.equal(0);
+    });
+
+    it(@"backs off from a timeout or throttling", ^{
+        for (NSNumber *statusCode in @[@408, @429])
+        {
+            OBRetryDecision *decision = [agent retryDecisionForResponse:responseWithStatus(statusCode.integerValue, nil)
+                                                                   body:nil
+                                                                  error:statusError(statusCode.integerValue)];
+
+            expect(decision.action).to.equal(OBRetryActionBackoff);
+            expect(decision.delay).to.equal(0);
+        }
+    });
+
+    it(@"backs off from a server error", ^{
+        OBRetryDecision *decision = [agent retryDecisionForResponse:responseWithStatus(500, nil) body:nil error:statusError(500)];
+
+        expect(decision.action).to.equal(OBRetryActionBackoff);
+    });
+
+    it(@"fails on other client errors, Not Implemented and Moved Permanently", ^{
+        for (NSNumber *statusCode in @[@400, @403, @404, @501, @301])
+        {
+            OBRetryDecision *decision = [agent retryDecisionForResponse:responseWithStatus(statusCode.integerValue, nil)
+                                                                   body:nil
+                                                                  error:statusError(statusCode.integerValue)];
+
+            expect(decision.action).to.equal(OBRetryActionFail);
+            expect(decision.reason).to.equal([NSString stringWithFormat:@"HTTP %@", statusCode]);
+        }
+    });
+
+    it(@"goes by the NSURLError when there is no response", ^{
+        NSError *lostConnection = [NSError errorWithDomain:NSURLErrorDomain code:NSURLErrorNetworkConnectionLost userInfo:nil];
+        NSError *noFile = [NSError errorWithDomain:NSURLErrorDomain code:NSURLErrorFileDoesNotExist userInfo:nil];
+
+        expect([agent retryDecisionForResponse:nil body:nil error:lostConnection].action).to.equal(OBRetryActionBackoff);
+        expect([agent retryDecisionForResponse:nil body:nil error:noFile].action).to.equal(OBRetryActionFail);
+    });
+});
+
+describe(@"the S3 agent", ^{
+
+    __block OBS3FileTransferAgent *agent;
+    __block OBS3FileTransferAgent *tvmAgent;
+
+    beforeEach(^{
+        agent = [[OBS3FileTransferAgent alloc] initWithConfig:@{}];
+        tvmAgent = [[OBS3FileTransferAgent alloc] initWithConfig:@{OBS3TvmServerUrlParam : @"https://tvm.example.com"}];
+    });
+
+    it(@"tries again right away when the clock was off", ^{
+        OBRetryDecision *decision = [agent retryDecisionForResponse:responseWithStatus(403, nil)
+                                                               body:s3ErrorBody(@"RequestTimeTooSkewed")
+                                                              error:statusError(403)];
+
+        expect(decision.action).to.equal(OBRetryActionNow);
+        expect(decision.reason).to.equal(@"RequestTimeTooSkewed");
+    });
+
+    it(@"refreshes an expired token from the token vending machine", ^{
+        OBRetryDecision *decision = [tvmAgent retryDecisionForResponse:responseWithStatus(400, nil)
+                                                                  body:s3ErrorBody(@"ExpiredToken")
+                                                                 error:statusError(400)];
+
+        expect(decision.action).to.equal(OBRetryActionRefreshCredentials);
+        expect(decision.reason).to.equal(@"ExpiredToken");
+    });
+
+    it(@"fails on an expired token without a token vending machine", ^{
+        OBRetryDecision *decision = [agent retryDecisionForResponse:responseWithStatus(400, nil)
+                                                               body:s3ErrorBody(@"ExpiredToken")
+                                                              error:statusError(400)];
+
+        expect(decision.action).to.equal(OBRetryActionFail);
+        expect(decision.reason).to.equal(@"ExpiredToken");
+    });
+
+    it(@"backs off when told to slow down", ^{
+        OBRetryDecision *decision = [agent retryDecisionForResponse:responseWithStatus(503, @{@"Retry-After" : @"5"})
+                                                               body:s3ErrorBody(@"SlowDown")
+                                                              error:statusError(503)];
+
+        expect(decision.action).to.equal(OBRetryActionBackoff);
+        expect(decision.delay).to.equal(5);
+        expect(decision.reason).to.equal(@"SlowDown");
+    });
+
+    it(@"goes by the status of other codes", ^{
+        OBRetryDecision *decision = [agent retryDecisionForResponse:responseWithStatus(404, nil)
+                                                               body:s3ErrorBody(@"NoSuchKey")
+                                                              error:statusError(404)];
+
+        expect(decision.action).to.equal(OBRetryActionFail);
+        expect(decision.reason).to.equal(@"NoSuchKey");
+    });
+
+    it(@"goes by the status without an error body", ^{
+        OBRetryDecision *decision = [agent retryDecisionForResponse:responseWithStatus(500, nil) body:nil error:statusError(500)];
+
+        expect(decision.action).to.equal(OBRetryActionBackoff);
+        expect(decision.reason).to.equal(@"HTTP 500");
+    });
+});
+
+describe(@"the Google Cloud Storage agent", ^{
+
+    __block OBGoogleCloudStorageFileTransferAgent *agent;
+
+    beforeEach(^{
+        agent = [[OBGoogleCloudStorageFileTransferAgent alloc] initWithConfig:@{}];
+    });
+
+    it(@"backs off from a 403 that is throttling", ^{
+        OBRetryDecision *decision = [agent retryDecisionForResponse:responseWithStatus(403, nil)
+                                                               body:gcsErrorBody(403, @"rateLimitExceeded")
+                                                              error:statusError(403)];
+
+        expect(decision.action).to.equal(OBRetryActionBackoff);
+        expect(decision.reason).to.equal(@"rateLimitExceeded");
+    });
+
+    it(@"fails on a 403 that is not", ^{
+        OBRetryDecision *decision = [agent retryDecisionForResponse:responseWithStatus(403, nil)
+                                                               body:gcsErrorBody(403, @"forbidden")
+                                                              error:statusError(403)];
+
+        expect(decision.action).to.equal(OBRetryActionFail);
+        expect(decision.reason).to.equal(@"HTTP 403");
+    });
+});
+
+SpecEnd
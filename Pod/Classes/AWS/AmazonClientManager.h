@@ -34,6 +34,9 @@
 
 + (void)setRegion:(AmazonRegion)region;
 
+// Use this endpoint instead of the one for the region, e.g. for an S3 compatible test server.  nil to go back to the region's.
++ (void)setEndpoint:(NSString *)endpoint;
+
 + (void)setTimeOffset:(NSTimeInterval)offset;
 
 + (Response *)validateCredentials;
@@ -23,6 +23,7 @@ static AmazonS3Client *s3 = nil;
 static AmazonTVMClient *_tvm = nil;
 static AmazonRegion _awsRegion;
 static AmazonCredentials *_noTvmCredentials = nil;
+static NSString *_endpoint = nil;
 
 NSString *const kAmazonTokenHeader = @"x-amz-security-token";
 
@@ -81,6 +82,12 @@ NSString *const kAmazonTokenHeader = @"x-amz-security-token";
     _awsRegion = region;
 }
 
++ (void)setEndpoint:(NSString *)endpoint
+{
+    _endpoint = endpoint;
+    s3.endpoint = endpoint != nil ? endpoint : [AmazonEndpoints s3Endpoint:_awsRegion];
+}
+
 + (void)setTimeOffset:(NSTimeInterval)offset
 {
     [AmazonSDKUtil setRuntimeClockSkew:offset];
@@ -150,7 +157,7 @@ NSString *const kAmazonTokenHeader = @"x-amz-security-token";
     }
 
     // If _awsRegion is not set the AwsRegion enum defaults to US_EAST_1.
-    s3.endpoint = [AmazonEndpoints s3Endpoint:_awsRegion];
+    s3.endpoint = _endpoint != nil ? _endpoint : [AmazonEndpoints s3Endpoint:_awsRegion];
 }
 
 + (NSString *)securityToken
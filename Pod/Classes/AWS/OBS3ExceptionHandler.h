@@ -14,6 +14,4 @@
 
 - (void)removeResponseForTask:(NSURLSessionTask *)task;
 
-- (BOOL)isRetryableExceptionFromTask:(NSURLSessionTask *)task;
-
 @end
@@ -72,23 +72,6 @@ static NSString *MIMEApplicationXML = @"application/xml";
     [self.exceptions removeObjectForKey:task];
 }
 
-- (BOOL)isRetryableExceptionFromTask:(NSURLSessionTask *)task;
-{
-    AmazonServiceException *exception = self.exceptions[task];
-
-    if (!exception)
-    {
-        return NO;
-    }
-
-    if ([exception.errorCode isEqualToString:RequestTimeTooSkewedErrorCode])
-    {
-        return YES;
-    }
-
-    return NO;
-}
-
 - (void)_handleExceptionForTask:(NSURLSessionTask *)task
 {
     AmazonServiceException *exception = self.exceptions[task];
@@ -0,0 +1,88 @@
+//
+//  OBChunkedUploadAgentProtocol.h
+//  Pods
+//
+//  Created by etcetc on 10/17/26.
+//
+//
+
+#import <Foundation/Foundation.h>
+
+/**
+ * Agents that can upload a large file as a series of chunks, each sent as its own background upload task.
+ * A failed chunk is sent again on its own instead of the whole file.
+ * Chunks are numbered from 1, chunk n covering the bytes starting at (n - 1) * chunkSize.  The last one may be shorter.
+ * The synchronous methods are never called on the main thread.
+ */
+@protocol OBChunkedUploadAgent <NSObject>
+
+// Whether this upload should go in chunks, typically depending on the size of the file
+- (BOOL)shouldUploadInChunks:(NSString *)filePath withParams:(NSDictionary *)params;
+
+- (long long)chunkSize;
+
+// How many chunks of a file may be in flight at once.  1 means the chunks are sent one after the other, in order.
+- (NSUInteger)maxConcurrentChunks;
+
+/**
+ * Sets up the upload on the server and returns its id (e.g. the S3 upload ID), or nil with the error.  Synchronous.
+ */
+- (NSString *)startChunkedUploadOf:(NSString *)filePath
+                                to:(NSString *)targetUrl
+                        withParams:(NSDictionary *)params
+                             error:(NSError **)error;
+
+// filePath and params are always the ones the upload was started with
+
+// The request for one chunk.  The body is sent from a file holding just the bytes of the chunk.
+- (NSMutableURLRequest *)chunkRequest:(NSInteger)chunkNumber
+                               offset:(long long)offset
+                               length:(long long)length
+                          totalLength:(long long)totalLength
+                             uploadId:(NSString *)uploadId
+                                   of:(NSString *)filePath
+                                   to:(NSString *)targetUrl
+                           withParams:(NSDictionary *)params;
+
+// What needs to be remembered about a chunk that was sent successfully, e.g. its ETag.  nil if the response
+// doesn't have it, the chunk then counts as failed and is sent again.
+- (NSString *)receiptForChunkResponse:(NSHTTPURLResponse *)response;
+
+/**
+ * Puts the file together on the server once every chunk has been sent.  receipts maps each chunk number to its receipt.
+ * Synchronous, returns nil on success.
+ */
+- (NSError *)finishChunkedUpload:(NSString *)uploadId
+                              of:(NSString *)filePath
+                              to:(NSString *)targetUrl
+                      withParams:(NSDictionary *)params
+                        receipts:(NSDictionary *)receipts;
+
+// Discard whatever the server has of the upload.  Synchronous.
+- (void)abortChunkedUpload:(NSString *)uploadId
+                        of:(NSString *)filePath
+                        to:(NSString *)targetUrl
+                withParams:(NSDictionary *)params;
+
+@optional
+
+/**
+ * Whether a response that is not a 2xx still means the chunk made it, e.g. a 308 Resume Incomplete from a server that
+ * takes chunks of a resumable upload session.  request is the one the chunk was sent with.
+ */
+- (BOOL)isCompletedChunkResponse:(NSHTTPURLResponse *)response forRequest:(NSURLRequest *)request;
+
+/**
+ * The receipts of the chunks the server has, used to reconcile what we remember with the server before resuming.
+ * Returns nil with the error if the server could not be asked, and nil without an error if the server no longer
+ * knows the upload, in which case it is started over.  chunkSize is the one the upload was started with, which
+ * the configuration may have changed since.  Synchronous.
+ */
+- (NSDictionary *)receiptsForChunkedUpload:(NSString *)uploadId
+                                        of:(NSString *)filePath
+                                        to:(NSString *)targetUrl
+                                withParams:(NSDictionary *)params
+                                 chunkSize:(long long)chunkSize
+                                     error:(NSError **)error;
+
+@end
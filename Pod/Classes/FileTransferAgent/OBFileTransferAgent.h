@@ -9,6 +9,7 @@
 #import <Foundation/Foundation.h>
 #import <OBLogger/OBLogger.h>
 #import "OBFileTransferAgentProtocol.h"
+#import "OBMultipartBodyWriter.h"
 
 // These are special parameters that are used in the construction of the POST request
 //  FilenameParamKey: contains the uploaded filename. Default: it is pulled from the input filename
@@ -17,6 +18,8 @@
 extern NSString *const FilenameParamKey;
 extern NSString *const ContentTypeParamKey;
 extern NSString *const kOBFileTransferMetadataKey;
+// Key in the metadata (kOBFileTransferMetadataKey) under which a deduplicated upload gives the SHA-256 of its content
+extern NSString *const OBFileTransferContentHashMetadataKey;
 
 
 @interface OBFileTransferAgent : NSObject <OBFileTransferAgentProtocol>
@@ -35,4 +38,30 @@ extern NSString *const kOBFileTransferMetadataKey;
 
 - (NSString *)serializeParams:(NSDictionary *)params;
 
+// Helpers for the requests agents make themselves, e.g. to set up a chunked upload.  Never call on the main thread.
+// Returns nil with the error if there was no HTTP response at all.
+- (NSHTTPURLResponse *)sendSynchronousRequest:(NSURLRequest *)request error:(NSError **)error;
+
+// Same, also returning the body of the response
+- (NSHTTPURLResponse *)sendSynchronousRequest:(NSURLRequest *)request data:(NSData **)data error:(NSError **)error;
+
+// Case insensitive, e.g. for the manager to read the headers of a response
++ (NSString *)headerNamed:(NSString *)name ofResponse:(NSHTTPURLResponse *)response;
+
+// NSURLErrorDomain error with the status code, the way the manager reports server errors
+- (NSError *)errorForResponse:(NSHTTPURLResponse *)response;
+
+// Seconds the Retry-After header of the response asks us to wait, 0 if there is none
++ (NSTimeInterval)retryAfterOfResponse:(NSHTTPURLResponse *)response;
+
+// Upload deduplication: whether what uploading filePath to remoteUrl would create is already on the server with the
+// content of the given SHA-256 (lowercase hex).  knownUploaded is YES if we uploaded that very content there before,
+// which a store that can't tell the hash of what it has may settle for as long as the object is still there.
+// Synchronous, never call on the main thread.  The default can't tell and returns NO, so the file is uploaded.
+- (BOOL)hasUploadOf:(NSString *)filePath
+                 to:(NSString *)remoteUrl
+         withParams:(NSDictionary *)params
+        contentHash:(NSString *)contentHash
+      knownUploaded:(BOOL)knownUploaded;
+
 @end
@@ -13,6 +13,7 @@
 NSString *const FilenameParamKey = @"_filename";
 NSString *const ContentTypeParamKey = @"_contentType";
 NSString *const kOBFileTransferMetadataKey = @"_metadata";
+NSString *const OBFileTransferContentHashMetadataKey = @"content-sha256";
 
 - (instancetype)initWithConfig:(NSDictionary *)configParams
 {
@@ -54,12 +55,29 @@ NSString *const kOBFileTransferMetadataKey = @"_metadata";
     return NO;
 }
 
+// By default the body is in the request
+- (OBMultipartBodyWriter *)uploadBodyForFile:(NSString *)filePath withParams:(NSDictionary *)params
+{
+    return nil;
+}
+
+// By default we can't tell, so the file is uploaded
+- (BOOL)hasUploadOf:(NSString *)filePath
+                 to:(NSString *)remoteUrl
+         withParams:(NSDictionary *)params
+        contentHash:(NSString *)contentHash
+      knownUploaded:(BOOL)knownUploaded
+{
+    return NO;
+}
+
 
 - (NSDictionary *)removeSpecialParams:(NSDictionary *)params
 {
     NSMutableDictionary *p = [NSMutableDictionary dictionaryWithDictionary:params];
     [p removeObjectForKey:FilenameParamKey];
     [p removeObjectForKey:ContentTypeParamKey];
+    [p removeObjectForKey:kOBFileTransferMetadataKey];
     return p;
 }
 
@@ -146,4 +164,117 @@ NSString *const kOBFileTransferMetadataKey = @"_metadata";
             NULL, (CFStringRef)@"!*'();:@&=+$,/?%#[]", kCFStringEncodingUTF8);
 }
 
+#pragma mark - Synchronous requests
+
+- (NSHTTPURLResponse *)sendSynchronousRequest:(NSURLRequest *)request error:(NSError **)error
+{
+    return [self sendSynchronousRequest:request data:NULL error:error];
+}
+
+- (NSHTTPURLResponse *)sendSynchronousRequest:(NSURLRequest *)request data:(NSData **)data error:(NSError **)error
+{
+    NSURLResponse *response;
+    NSError *requestError;
+    NSData *responseData = [NSURLConnection sendSynchronousRequest:request returningResponse:&response error:&requestError];
+    if (data != NULL)
+        *data = responseData;
+    if (![response isKindOfClass:[NSHTTPURLResponse class]])
+    {
+        if (error != NULL)
+            *error = requestError ? requestError : [NSError errorWithDomain:NSURLErrorDomain code:NSURLErrorBadServerResponse userInfo:nil];
+        return nil;
+    }
+    return (NSHTTPURLResponse *)response;
+}
+
++ (NSString *)headerNamed:(NSString *)name ofResponse:(NSHTTPURLResponse *)response
+{
+    NSDictionary *headers = response.allHeaderFields;
+    for (NSString *header in headers)
+    {
+        if ([header caseInsensitiveCompare:name] == NSOrderedSame)
+            return headers[header];
+    }
+    return nil;
+}
+
+- (NSError *)errorForResponse:(NSHTTPURLResponse *)response
+{
+    return [NSError errorWithDomain:NSURLErrorDomain
+                               code:response.statusCode
+                           userInfo:@{NSLocalizedDescriptionKey : [NSHTTPURLResponse localizedStringForStatusCode:response.statusCode]}];
+}
+
+#pragma mark - Retry classification
+
+// Generic HTTP: client errors mostly come and go, and of the status codes only throttling, timeouts and server errors
+// are worth another try.  Agents with more to go on, e.g. an error body they understand, override this and fall back
+// on it.
+- (OBRetryDecision *)retryDecisionForResponse:(NSHTTPURLResponse *)response body:(NSData *)body error:(NSError *)error
+{
+    BOOL isNSURLError = [error.domain isEqualToString:NSURLErrorDomain];
+    // NSURLError codes are negative, status codes positive
+    NSInteger statusCode = response != nil ? response.statusCode : (isNSURLError && error.code > 0 ? error.code : 0);
+    if (isNSURLError && error.code < 0)
+        return [self retryDecisionForClientError:error];
+
+    NSString *reason = [NSString stringWithFormat:@"HTTP %ld", (long)statusCode];
+    NSTimeInterval retryAfter = [[self class] retryAfterOfResponse:response];
+    if (retryAfter > 0 || statusCode == 408 || statusCode == 429)
+        return [OBRetryDecision decisionWithAction:OBRetryActionBackoff delay:retryAfter reason:reason];
+    if (statusCode / 100 == 4 || statusCode == 501 || statusCode == 301)
+        return [OBRetryDecision decisionWithAction:OBRetryActionFail delay:0 reason:reason];
+    return [OBRetryDecision decisionWithAction:OBRetryActionBackoff delay:0 reason:error != nil ? reason : @"unknown"];
+}
+
+- (OBRetryDecision *)retryDecisionForClientError:(NSError *)error
+{
+    OBRetryAction action;
+    switch (error.code)
+    {
+        // Dont Retry these
+        case NSURLErrorResourceUnavailable:
+        case NSURLErrorFileDoesNotExist:
+        case NSURLErrorFileIsDirectory:
+            action = OBRetryActionFail;
+            break;
+
+        default:
+            action = OBRetryActionBackoff;
+            break;
+    }
+    return [OBRetryDecision decisionWithAction:action delay:0 reason:error.localizedDescription];
+}
+
+// Nothing to refresh by default
+- (void)refreshCredentials
+{
+}
+
++ (NSTimeInterval)retryAfterOfResponse:(NSHTTPURLResponse *)response
+{
+    NSString *retryAfter = [self headerNamed:@"Retry-After" ofResponse:response];
+    if (retryAfter.length == 0)
+        return 0;
+
+    // Either delta-seconds or an HTTP date
+    NSScanner *scanner = [NSScanner scannerWithString:retryAfter];
+    NSInteger seconds;
+    if ([scanner scanInteger:&seconds] && scanner.isAtEnd)
+        return MAX(seconds, 0);
+
+    static NSDateFormatter *httpDateFormatter;
+    static dispatch_once_t onceToken;
+    dispatch_once(&onceToken, ^{
+        httpDateFormatter = [NSDateFormatter new];
+        httpDateFormatter.locale = [NSLocale localeWithLocaleIdentifier:@"en_US_POSIX"];
+        httpDateFormatter.timeZone = [NSTimeZone timeZoneWithAbbreviation:@"GMT"];
+        httpDateFormatter.dateFormat = @"EEE',' dd MMM yyyy HH':'mm':'ss 'GMT'";
+    });
+    @synchronized (httpDateFormatter)
+    {
+        return MAX([[httpDateFormatter dateFromString:retryAfter] timeIntervalSinceNow], 0);
+    }
+}
+
 @end
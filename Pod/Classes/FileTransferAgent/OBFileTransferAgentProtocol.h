@@ -7,6 +7,9 @@
 //
 
 #import <Foundation/Foundation.h>
+#import "OBRetryDecision.h"
+
+@class OBMultipartBodyWriter;
 
 @protocol OBFileTransferAgentProtocol <NSObject>
 - (instancetype)initWithConfig:(NSDictionary *)configParams;
@@ -23,4 +26,24 @@
 - (NSError *)deleteFile:(NSString *)targetFileUrl;
 
 - (BOOL)hasMultipartBody;
+
+/**
+ * For agents with a multipart body: the body to upload filePath with.  The request returned by
+ * uploadFileRequest:to:withParams: then only carries the headers.  Agents that return nil are expected to
+ * put the body in the request.
+ */
+- (OBMultipartBodyWriter *)uploadBodyForFile:(NSString *)filePath withParams:(NSDictionary *)params;
+
+/**
+ * What to do after a request of this agent failed.  response is nil if there was none, body is the body of the error
+ * response if we have it (nil for requests the agent sent itself), and error is either the NSURLError of the request
+ * or an NSURLErrorDomain error with the HTTP status code.  Whether attempts are left is up to the manager.
+ */
+- (OBRetryDecision *)retryDecisionForResponse:(NSHTTPURLResponse *)response body:(NSData *)body error:(NSError *)error;
+
+/**
+ * Called before retrying after an OBRetryActionRefreshCredentials decision.  Synchronous, on a background queue:
+ * the transfer is retried once it returns.
+ */
+- (void)refreshCredentials;
 @end
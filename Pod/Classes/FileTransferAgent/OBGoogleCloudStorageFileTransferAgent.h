@@ -7,11 +7,30 @@
 //
 
 #import "OBFileTransferAgent.h"
+#import "OBChunkedUploadAgentProtocol.h"
 
 extern NSString *const OBGoogleCloudStorageApiKey;
 extern NSString *const OBGoogleCloudStorageProjectId;
 extern NSString *const OBGoogleCloudStorageProtocol;
+extern NSString *const OBGoogleCloudStorageBaseUrlParam;
+extern NSString *const OBGoogleCloudStorageResumableThresholdParam;
+extern NSString *const OBGoogleCloudStorageChunkSizeParam;
 
-@interface OBGoogleCloudStorageFileTransferAgent : OBFileTransferAgent
+/** TransferAgent for use with Google Cloud Storage
+ * configParams:
+ *
+ * OBGoogleCloudStorageApiKey, OBGoogleCloudStorageProjectId
+ *
+ * OBGoogleCloudStorageBaseUrlParam:
+ *      Replaces https://www.googleapis.com, e.g. to test against a local stub such as the one in TestServer.
+ *
+ * OBGoogleCloudStorageResumableThresholdParam:
+ *      Files of at least this many bytes are sent with a resumable upload session, one chunk after the other, so
+ * that after a failure only what the server has not committed yet is sent again. 0 turns them off. Default: 8MB.
+ *
+ * OBGoogleCloudStorageChunkSizeParam:
+ *      Size of each chunk of a resumable upload, rounded down to a multiple of 256KB as GCS requires. Default: 8MB.
+ */
+@interface OBGoogleCloudStorageFileTransferAgent : OBFileTransferAgent <OBChunkedUploadAgent>
 
 @end
@@ -18,10 +18,26 @@
 NSString *const OBGoogleCloudStorageApiKey = @"GoogleCloudStorageApiKey";
 NSString *const OBGoogleCloudStorageProjectId = @"GoogleCloudStorageProjectId";
 NSString *const OBGoogleCloudStorageProtocol = @"gs";
+NSString *const OBGoogleCloudStorageBaseUrlParam = @"GoogleCloudStorageBaseUrlParam";
+NSString *const OBGoogleCloudStorageResumableThresholdParam = @"GoogleCloudStorageResumableThresholdParam";
+NSString *const OBGoogleCloudStorageChunkSizeParam = @"GoogleCloudStorageChunkSizeParam";
+
+#define DEFAULT_RESUMABLE_THRESHOLD (8 * 1024 * 1024)
+#define DEFAULT_RESUMABLE_CHUNK_SIZE (8 * 1024 * 1024)
+#define RESUMABLE_CHUNK_GRANULARITY (256 * 1024)
+
+// GCS answers a chunk that does not complete the upload with 308 Resume Incomplete
+#define HTTP_RESUME_INCOMPLETE 308
+
+// The receipt of the chunk that completed the upload
+static NSString *const OBGSFTAUploadCompleteReceipt = @"complete";
 
 @interface OBGoogleCloudStorageFileTransferAgent ()
 @property (nonatomic, strong) NSString *apiKey;
 @property (nonatomic, strong) NSString *projectId;
+@property (nonatomic, strong) NSString *baseUrl;
+@property (nonatomic) long long resumableThreshold;
+@property (nonatomic) long long resumableChunkSize;
 @end
 
 @implementation OBGoogleCloudStorageFileTransferAgent
@@ -35,6 +51,12 @@ NSString *const OBGSFTAHttpFormBoundary = @"some_unlikely_string";
     {
         self.apiKey = configParams[OBGoogleCloudStorageApiKey];
         self.projectId = configParams[OBGoogleCloudStorageProjectId];
+        self.baseUrl = configParams[OBGoogleCloudStorageBaseUrlParam] ? configParams[OBGoogleCloudStorageBaseUrlParam] : kBaseCloudUrl;
+        self.resumableThreshold = configParams[OBGoogleCloudStorageResumableThresholdParam] ?
+                [configParams[OBGoogleCloudStorageResumableThresholdParam] longLongValue] : DEFAULT_RESUMABLE_THRESHOLD;
+        long long chunkSize = configParams[OBGoogleCloudStorageChunkSizeParam] ?
+                [configParams[OBGoogleCloudStorageChunkSizeParam] longLongValue] : DEFAULT_RESUMABLE_CHUNK_SIZE;
+        self.resumableChunkSize = MAX(chunkSize / RESUMABLE_CHUNK_GRANULARITY, 1) * RESUMABLE_CHUNK_GRANULARITY;
     }
     [self validateSetup];
     return self;
@@ -66,13 +88,7 @@ NSString *const OBGSFTAHttpFormBoundary = @"some_unlikely_string";
                                 withParams:(NSDictionary *)params
 {
     NSString *fullTargetUrl = [self createUploadUrl:targetUrl];
-    NSString *filename = params[FilenameParamKey];
-    if (filename == nil || filename.length == 0)
-    {
-        filename = [self filenameFromFilepath:filePath];
-    }
-
-    NSString *queryString = [NSString stringWithFormat:@"&name=%@", filename];
+    NSString *queryString = [NSString stringWithFormat:@"&name=%@", [self objectName:filePath withParams:params]];
     fullTargetUrl = [fullTargetUrl stringByAppendingString:queryString];
     OB_INFO(@"Setting up Google Cloud Storage upload to %@", fullTargetUrl);
     NSMutableURLRequest *request = [[NSMutableURLRequest alloc] initWithURL:[NSURL URLWithString:fullTargetUrl]];
@@ -83,40 +99,48 @@ NSString *const OBGSFTAHttpFormBoundary = @"some_unlikely_string";
     [request setValue:@"no-cache" forHTTPHeaderField:@"Cache-Control"];
     [request setValue:@"926360415491" forHTTPHeaderField:@"x-goog-project-id"];
 
-    NSMutableData *body = [[NSMutableData alloc] init];
-
 #if SIMPLE_UPLOAD
 
     NSString *contentType =params[ContentTypeParamKey] ? params[ContentTypeParamKey] : [self mimeTypeFromFilename:filePath];
     [request setValue: contentType forHTTPHeaderField:@"Content-Type"];
 
-    [body appendData:[NSData dataWithContentsOfFile:filePath]];
-
 #else
+    // The multipart/related body comes from uploadBodyForFile:withParams:
     [request setValue:[NSString stringWithFormat:@"multipart/related;boundary=%@", OBGSFTAHttpFormBoundary]
    forHTTPHeaderField:@"Content-Type"];
+#endif
 
-    NSMutableDictionary *coreParams = [NSMutableDictionary dictionaryWithDictionary:[self removeSpecialParams:params]];
+//    Now add the content length to the header
+//    [request setValue:[NSString stringWithFormat:@"%lu",(unsigned long)body.length] forKey:@"Content-Length"];
 
-    coreParams[@"name"] = params[FilenameParamKey];
+    return request;
+}
 
-    NSError *error;
-    NSString *coreParamsJson = [GTLJSONParser stringWithObject:coreParams
-                                                 humanReadable:YES
-                                                         error:&error];
-    if (error)
-    {
-        OB_ERROR(@"OBGoogleCloudStorageFileTransferAgent Unable to convert params to JSON");
-    }
+#if SIMPLE_UPLOAD
+
+// The file is uploaded as is
+- (OBMultipartBodyWriter *)uploadBodyForFile:(NSString *)filePath withParams:(NSDictionary *)params
+{
+    return nil;
+}
+
+#else
+
+// The JSON metadata part followed by the file part.  The file is only read when the body is written to disk.
+- (OBMultipartBodyWriter *)uploadBodyForFile:(NSString *)filePath withParams:(NSDictionary *)params
+{
+    OBMultipartBodyWriter *body = [[OBMultipartBodyWriter alloc] initWithBoundary:OBGSFTAHttpFormBoundary];
+
+    NSString *coreParamsJson = [self metadataJson:params];
 
     NSMutableString *paramsString = [NSMutableString new];
-    [paramsString appendString:[NSString stringWithFormat:@"--%@\r\n", OBGSFTAHttpFormBoundary]];
     [paramsString appendString:[NSString stringWithFormat:@"Content-Type: application/json;\r\n"]];
     [paramsString appendString:@"\r\n"];
     [paramsString appendString:coreParamsJson];
     [paramsString appendString:@"\r\n"];
 
-    [body appendData:[paramsString dataUsingEncoding:NSUTF8StringEncoding]];
+    [body appendBoundary];
+    [body appendString:paramsString];
 
     if (filePath != nil)
     {
@@ -125,26 +149,41 @@ NSString *const OBGSFTAHttpFormBoundary = @"some_unlikely_string";
         NSString *contentType = params[ContentTypeParamKey] ? params[ContentTypeParamKey] : [self mimeTypeFromFilename:filePath];
 
         NSMutableString *preString = [[NSMutableString alloc] init];
-        [preString appendString:[NSString stringWithFormat:@"\r\n--%@\r\n", OBGSFTAHttpFormBoundary]];
         [preString appendString:[NSString stringWithFormat:@"Content-Type: %@\r\n", contentType]];
         [preString appendString:@"\r\n"];
 
 
-        [body appendData:[preString dataUsingEncoding:NSUTF8StringEncoding]];
-        [body appendData:[NSData dataWithContentsOfFile:filePath]];
-        [body appendData:[@"\r\n" dataUsingEncoding:NSUTF8StringEncoding]];
+        [body appendString:@"\r\n"];
+        [body appendBoundary];
+        [body appendString:preString];
+        [body appendFileAtPath:filePath];
+        [body appendString:@"\r\n"];
     }
 
-    NSString *postString = [NSString stringWithFormat:@"--%@--\r\n", OBGSFTAHttpFormBoundary];
-    [body appendData:[postString dataUsingEncoding:NSUTF8StringEncoding]];
+    [body appendClosingBoundary];
+    return body;
+}
 #endif
 
-//    Now add the content length to the header
-//    [request setValue:[NSString stringWithFormat:@"%lu",(unsigned long)body.length] forKey:@"Content-Length"];
+// The object metadata, i.e. the params other than our own
+- (NSString *)metadataJson:(NSDictionary *)params
+{
+    NSMutableDictionary *coreParams = [NSMutableDictionary dictionaryWithDictionary:[self removeSpecialParams:params]];
 
-    [request setHTTPBody:body];
+    coreParams[@"name"] = params[FilenameParamKey];
+    // Custom metadata of the object
+    if (params[kOBFileTransferMetadataKey] != nil)
+        coreParams[@"metadata"] = params[kOBFileTransferMetadataKey];
 
-    return request;
+    NSError *error;
+    NSString *coreParamsJson = [GTLJSONParser stringWithObject:coreParams
+                                                 humanReadable:YES
+                                                         error:&error];
+    if (error)
+    {
+        OB_ERROR(@"OBGoogleCloudStorageFileTransferAgent Unable to convert params to JSON");
+    }
+    return coreParamsJson;
 }
 
 - (BOOL)hasMultipartBody
@@ -156,6 +195,38 @@ NSString *const OBGSFTAHttpFormBoundary = @"some_unlikely_string";
 #endif
 }
 
+#pragma mark - Retry classification
+
+// GCS puts the reason in its JSON error body, and throttles with a 403 as well as a 429
+- (OBRetryDecision *)retryDecisionForResponse:(NSHTTPURLResponse *)response body:(NSData *)body error:(NSError *)error
+{
+    NSString *errorReason = [self gcsErrorReasonOfBody:body];
+    if ([@[@"rateLimitExceeded", @"userRateLimitExceeded", @"backendError", @"internalError"] containsObject:errorReason])
+        return [OBRetryDecision decisionWithAction:OBRetryActionBackoff
+                                             delay:[[self class] retryAfterOfResponse:response]
+                                            reason:errorReason];
+    return [super retryDecisionForResponse:response body:body error:error];
+}
+
+// Body looks like {"error": {"code": 403, "message": "...", "errors": [{"reason": "rateLimitExceeded", ...}]}}
+- (NSString *)gcsErrorReasonOfBody:(NSData *)body
+{
+    if (body.length == 0)
+        return nil;
+    id json = [NSJSONSerialization JSONObjectWithData:body options:0 error:nil];
+    if (![json isKindOfClass:[NSDictionary class]] || ![json[@"error"] isKindOfClass:[NSDictionary class]])
+        return nil;
+    NSArray *errors = json[@"error"][@"errors"];
+    if (![errors isKindOfClass:[NSArray class]])
+        return nil;
+    for (NSDictionary *error in errors)
+    {
+        if ([error isKindOfClass:[NSDictionary class]] && [error[@"reason"] isKindOfClass:[NSString class]])
+            return error[@"reason"];
+    }
+    return nil;
+}
+
 // Returns an NSDictionary with the following keys:
 // bucketName: the name of the bucket
 // filePath: the file path in the bucket
@@ -176,6 +247,24 @@ NSString *const OBGSFTAHttpFormBoundary = @"some_unlikely_string";
     return @{@"bucketName" : [path substringToIndex:firstSlash], @"filePath" : [path substringFromIndex:firstSlash + 1]};
 }
 
+- (NSString *)objectName:(NSString *)filePath withParams:(NSDictionary *)params
+{
+    NSString *filename = params[FilenameParamKey];
+    if (filename == nil || filename.length == 0)
+    {
+        filename = [self filenameFromFilepath:filePath];
+    }
+    return filename;
+}
+
+// For the object name in a path segment or a query parameter
+- (NSString *)encodedObjectName:(NSString *)filePath withParams:(NSDictionary *)params
+{
+    NSMutableCharacterSet *allowed = [NSMutableCharacterSet alphanumericCharacterSet];
+    [allowed addCharactersInString:@"-._~"];
+    return [[self objectName:filePath withParams:params] stringByAddingPercentEncodingWithAllowedCharacters:allowed];
+}
+
 - (NSString *)createUploadUrl:(NSString *)url
 {
     NSDictionary *urlComponents = [self urlToComponents:url];
@@ -186,7 +275,7 @@ NSString *const OBGSFTAHttpFormBoundary = @"some_unlikely_string";
     uploadType = @"uploadType=multipart&";
 #endif
     return [NSString stringWithFormat:@"%@/upload/storage/v1/b/%@/o?%@key=%@",
-                                      kBaseCloudUrl,
+                                      self.baseUrl,
                                       urlComponents[@"bucketName"],
                                       uploadType,
                                       self.apiKey];
@@ -196,12 +285,226 @@ NSString *const OBGSFTAHttpFormBoundary = @"some_unlikely_string";
 {
     NSDictionary *urlComponents = [self urlToComponents:url];
     return [NSString stringWithFormat:@"%@/download/storage/v1/b/%@/o/%@?key=%@&alt=media",
-                                      kBaseCloudUrl,
+                                      self.baseUrl,
                                       urlComponents[@"bucketName"],
                                       urlComponents[@"filePath"],
                                       self.apiKey];
 }
 
+// Gets the object resource, whose custom metadata has the hash if we uploaded it with one
+- (BOOL)hasUploadOf:(NSString *)filePath
+                 to:(NSString *)targetUrl
+         withParams:(NSDictionary *)params
+        contentHash:(NSString *)contentHash
+      knownUploaded:(BOOL)knownUploaded
+{
+    NSString *objectName = [self encodedObjectName:filePath withParams:params];
+    NSString *objectUrl = [NSString stringWithFormat:@"%@/storage/v1/b/%@/o/%@?key=%@",
+                                                     self.baseUrl,
+                                                     [self urlToComponents:targetUrl][@"bucketName"],
+                                                     objectName,
+                                                     self.apiKey];
+    NSMutableURLRequest *request = [[NSMutableURLRequest alloc] initWithURL:[NSURL URLWithString:objectUrl]];
+    [request setHTTPMethod:@"GET"];
+
+    NSData *data;
+    NSHTTPURLResponse *response = [self sendSynchronousRequest:request data:&data error:nil];
+    if (response.statusCode != 200)
+    {
+        if (response != nil && response.statusCode != 404)
+            OB_WARN(@"Unable to check for Google Cloud Storage object %@: %ld", objectName, (long)response.statusCode);
+        return NO;
+    }
+
+    NSDictionary *object = [NSJSONSerialization JSONObjectWithData:data options:0 error:nil];
+    NSString *storedHash = [object isKindOfClass:[NSDictionary class]] ? object[@"metadata"][OBFileTransferContentHashMetadataKey] : nil;
+    return storedHash != nil ? [storedHash isEqualToString:contentHash] : knownUploaded;
+}
+
+#pragma mark - Resumable upload
+
+// The session URI is the upload id and the receipt of a chunk is the number of bytes GCS had committed after it.
+// Chunks go one at a time because GCS only takes the bytes right after what it has committed.
+
+- (BOOL)shouldUploadInChunks:(NSString *)filePath withParams:(NSDictionary *)params
+{
+    if (self.resumableThreshold <= 0)
+        return NO;
+    long long fileSize = (long long)[[[NSFileManager defaultManager] attributesOfItemAtPath:filePath error:nil] fileSize];
+    return fileSize >= self.resumableThreshold;
+}
+
+- (long long)chunkSize
+{
+    return self.resumableChunkSize;
+}
+
+- (NSUInteger)maxConcurrentChunks
+{
+    return 1;
+}
+
+- (NSString *)startChunkedUploadOf:(NSString *)filePath
+                                to:(NSString *)targetUrl
+                        withParams:(NSDictionary *)params
+                             error:(NSError **)error
+{
+    NSDictionary *urlComponents = [self urlToComponents:targetUrl];
+    NSString *sessionUrl = [NSString stringWithFormat:@"%@/upload/storage/v1/b/%@/o?uploadType=resumable&name=%@&key=%@",
+                                                      self.baseUrl,
+                                                      urlComponents[@"bucketName"],
+                                                      [self encodedObjectName:filePath withParams:params],
+                                                      self.apiKey];
+    OB_INFO(@"Starting Google Cloud Storage resumable upload of %@ to %@", filePath, sessionUrl);
+
+    long long fileSize = (long long)[[[NSFileManager defaultManager] attributesOfItemAtPath:filePath error:nil] fileSize];
+    NSString *contentType = params[ContentTypeParamKey] ? params[ContentTypeParamKey] : [self mimeTypeFromFilename:filePath];
+
+    NSMutableURLRequest *request = [[NSMutableURLRequest alloc] initWithURL:[NSURL URLWithString:sessionUrl]];
+    [request setHTTPMethod:@"POST"];
+    [request setValue:@"application/json; charset=UTF-8" forHTTPHeaderField:@"Content-Type"];
+    [request setValue:contentType forHTTPHeaderField:@"X-Upload-Content-Type"];
+    [request setValue:[NSString stringWithFormat:@"%lld", fileSize] forHTTPHeaderField:@"X-Upload-Content-Length"];
+    [request setHTTPBody:[[self metadataJson:params] dataUsingEncoding:NSUTF8StringEncoding]];
+
+    NSHTTPURLResponse *response = [self sendSynchronousRequest:request error:error];
+    if (response == nil)
+        return nil;
+    if (response.statusCode / 100 != 2)
+    {
+        if (error != NULL)
+            *error = [self errorForResponse:response];
+        return nil;
+    }
+
+    NSString *sessionUri = [[self class] headerNamed:@"Location" ofResponse:response];
+    if (sessionUri == nil && error != NULL)
+        *error = [NSError errorWithDomain:NSURLErrorDomain code:NSURLErrorBadServerResponse userInfo:nil];
+    return sessionUri;
+}
+
+- (NSMutableURLRequest *)chunkRequest:(NSInteger)chunkNumber
+                               offset:(long long)offset
+                               length:(long long)length
+                          totalLength:(long long)totalLength
+                             uploadId:(NSString *)sessionUri
+                                   of:(NSString *)filePath
+                                   to:(NSString *)targetUrl
+                           withParams:(NSDictionary *)params
+{
+    NSMutableURLRequest *request = [[NSMutableURLRequest alloc] initWithURL:[NSURL URLWithString:sessionUri]];
+    [request setHTTPMethod:@"PUT"];
+    [request setValue:[NSString stringWithFormat:@"%lld", length] forHTTPHeaderField:@"Content-Length"];
+    [request setValue:[NSString stringWithFormat:@"bytes %lld-%lld/%lld", offset, offset + length - 1, totalLength]
+   forHTTPHeaderField:@"Content-Range"];
+    return request;
+}
+
+// A 308 only means the chunk made it if GCS committed all of it
+- (BOOL)isCompletedChunkResponse:(NSHTTPURLResponse *)response forRequest:(NSURLRequest *)request
+{
+    if (response.statusCode != HTTP_RESUME_INCOMPLETE)
+        return NO;
+
+    long long chunkEnd = -1;
+    NSString *contentRange = [request valueForHTTPHeaderField:@"Content-Range"];
+    NSRange dash = [contentRange rangeOfString:@"-"];
+    if (dash.location != NSNotFound)
+        chunkEnd = [[contentRange substringFromIndex:dash.location + 1] longLongValue] + 1;
+    return chunkEnd > 0 && [self committedLengthOfResponse:response] >= chunkEnd;
+}
+
+- (NSString *)receiptForChunkResponse:(NSHTTPURLResponse *)response
+{
+    if (response.statusCode == HTTP_RESUME_INCOMPLETE)
+        return [NSString stringWithFormat:@"%lld", [self committedLengthOfResponse:response]];
+    return OBGSFTAUploadCompleteReceipt;
+}
+
+// The last chunk completes the object, nothing left to do
+- (NSError *)finishChunkedUpload:(NSString *)sessionUri
+                              of:(NSString *)filePath
+                              to:(NSString *)targetUrl
+                      withParams:(NSDictionary *)params
+                        receipts:(NSDictionary *)receipts
+{
+    return nil;
+}
+
+- (void)abortChunkedUpload:(NSString *)sessionUri
+                        of:(NSString *)filePath
+                        to:(NSString *)targetUrl
+                withParams:(NSDictionary *)params
+{
+    NSMutableURLRequest *request = [[NSMutableURLRequest alloc] initWithURL:[NSURL URLWithString:sessionUri]];
+    [request setHTTPMethod:@"DELETE"];
+    NSError *error;
+    if ([self sendSynchronousRequest:request error:&error] == nil)
+        OB_WARN(@"Unable to cancel Google Cloud Storage upload session %@: %@", sessionUri, error);
+}
+
+// Asks GCS for the committed offset with an empty PUT.  Every chunk ending at or before it is done.  A chunk GCS only
+// has part of is sent again as a whole: GCS ignores the bytes it had already committed.
+- (NSDictionary *)receiptsForChunkedUpload:(NSString *)sessionUri
+                                        of:(NSString *)filePath
+                                        to:(NSString *)targetUrl
+                                withParams:(NSDictionary *)params
+                                 chunkSize:(long long)chunkSize
+                                     error:(NSError **)error
+{
+    long long fileSize = (long long)[[[NSFileManager defaultManager] attributesOfItemAtPath:filePath error:nil] fileSize];
+    NSMutableURLRequest *request = [[NSMutableURLRequest alloc] initWithURL:[NSURL URLWithString:sessionUri]];
+    [request setHTTPMethod:@"PUT"];
+    [request setValue:@"0" forHTTPHeaderField:@"Content-Length"];
+    [request setValue:[NSString stringWithFormat:@"bytes */%lld", fileSize] forHTTPHeaderField:@"Content-Range"];
+
+    NSHTTPURLResponse *response = [self sendSynchronousRequest:request error:error];
+    if (response == nil)
+        return nil;
+
+    long long committed;
+    if (response.statusCode / 100 == 2)
+    {
+        committed = fileSize;
+    }
+    else if (response.statusCode == HTTP_RESUME_INCOMPLETE)
+    {
+        committed = [self committedLengthOfResponse:response];
+    }
+    else if (response.statusCode == 404 || response.statusCode == 410)
+    {
+        OB_WARN(@"Google Cloud Storage no longer has upload session %@", sessionUri);
+        return nil;
+    }
+    else
+    {
+        if (error != NULL)
+            *error = [self errorForResponse:response];
+        return nil;
+    }
+
+    NSMutableDictionary *receipts = [NSMutableDictionary new];
+    NSString *receipt = committed == fileSize ? OBGSFTAUploadCompleteReceipt : [NSString stringWithFormat:@"%lld", committed];
+    for (NSInteger chunkNumber = 1; chunkNumber * chunkSize <= committed; chunkNumber++)
+    {
+        receipts[@(chunkNumber)] = receipt;
+    }
+    if (committed == fileSize && fileSize % chunkSize != 0)
+        receipts[@(fileSize / chunkSize + 1)] = receipt;
+    OB_DEBUG(@"Google Cloud Storage has committed %lld of %lld bytes of %@", committed, fileSize, sessionUri);
+    return receipts;
+}
+
+// The Range header of a 308 is bytes=0-<last committed byte>, and missing if nothing was committed
+- (long long)committedLengthOfResponse:(NSHTTPURLResponse *)response
+{
+    NSString *range = [[self class] headerNamed:@"Range" ofResponse:response];
+    NSRange dash = [range rangeOfString:@"-"];
+    if (dash.location == NSNotFound)
+        return 0;
+    return [[range substringFromIndex:dash.location + 1] longLongValue] + 1;
+}
+
 - (void)validateSetup
 {
     NSAssert(self.apiKey != nil, @"API Key not specified for Google Cloud Storage");
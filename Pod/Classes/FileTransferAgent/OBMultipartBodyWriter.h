@@ -0,0 +1,41 @@
+//
+//  OBMultipartBodyWriter.h
+//  Pods
+//
+//  Created by etcetc on 10/17/26.
+//
+//
+
+#import <Foundation/Foundation.h>
+
+// Composes a request body out of in-memory pieces (boundaries, part headers, parameters) and files, and streams it
+// to a file.  The files are copied through a single buffer of chunkSize bytes, so memory use does not depend on the
+// size of the files.  Used by the agents that upload a multipart body.
+@interface OBMultipartBodyWriter : NSObject
+
+@property (nonatomic, strong, readonly) NSString *boundary;
+
+// Size of the copy buffer.  Default: 64KB
+@property (nonatomic) NSUInteger chunkSize;
+
+- (instancetype)initWithBoundary:(NSString *)boundary;
+
+- (void)appendString:(NSString *)string;
+
+- (void)appendData:(NSData *)data;
+
+// The file is only read when the body is written
+- (void)appendFileAtPath:(NSString *)filePath;
+
+// Convenience for the common pieces.  These don't add a line break in front of the boundary.
+- (void)appendBoundary;
+
+- (void)appendClosingBoundary;
+
+// Total size of the body, or -1 if one of the files can't be read
+- (long long)contentLength;
+
+// Write the body to filePath, replacing whatever is there
+- (BOOL)writeToFile:(NSString *)filePath error:(NSError **)error;
+
+@end
@@ -0,0 +1,171 @@
+//
+//  OBMultipartBodyWriter.m
+//  Pods
+//
+//  Created by etcetc on 10/17/26.
+//
+//
+
+#import "OBMultipartBodyWriter.h"
+#import <OBLogger/OBLogger.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#define DEFAULT_CHUNK_SIZE (64 * 1024)
+
+@interface OBMultipartBodyWriter ()
+// Each element is either an NSData or an NSString file path
+@property (nonatomic, strong) NSMutableArray *parts;
+@end
+
+@implementation OBMultipartBodyWriter
+
+- (instancetype)initWithBoundary:(NSString *)boundary
+{
+    self = [super init];
+    if (self)
+    {
+        _boundary = boundary;
+        _chunkSize = DEFAULT_CHUNK_SIZE;
+        _parts = [NSMutableArray new];
+    }
+    return self;
+}
+
+#pragma mark - Composing
+
+- (void)appendString:(NSString *)string
+{
+    [self appendData:[string dataUsingEncoding:NSUTF8StringEncoding]];
+}
+
+- (void)appendData:(NSData *)data
+{
+    if (data.length == 0)
+        return;
+    // Merge adjacent pieces of data so writing doesn't turn into lots of tiny writes
+    if ([[self.parts lastObject] isKindOfClass:[NSMutableData class]])
+        [[self.parts lastObject] appendData:data];
+    else
+        [self.parts addObject:[data mutableCopy]];
+}
+
+- (void)appendFileAtPath:(NSString *)filePath
+{
+    [self.parts addObject:[filePath copy]];
+}
+
+- (void)appendBoundary
+{
+    [self appendString:[NSString stringWithFormat:@"--%@\r\n", self.boundary]];
+}
+
+- (void)appendClosingBoundary
+{
+    [self appendString:[NSString stringWithFormat:@"--%@--\r\n", self.boundary]];
+}
+
+- (long long)contentLength
+{
+    long long length = 0;
+    for (id part in self.parts)
+    {
+        if ([part isKindOfClass:[NSData class]])
+        {
+            length += [part length];
+        }
+        else
+        {
+            NSDictionary *attributes = [[NSFileManager defaultManager] attributesOfItemAtPath:part error:nil];
+            if (attributes == nil)
+                return -1;
+            length += [attributes fileSize];
+        }
+    }
+    return length;
+}
+
+#pragma mark - Writing
+
+- (BOOL)writeToFile:(NSString *)filePath error:(NSError **)error
+{
+    int fd = open([filePath fileSystemRepresentation], O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0)
+        return [self failWithErrno:error path:filePath];
+
+    uint8_t *buffer = malloc(self.chunkSize);
+    BOOL ok = YES;
+    for (id part in self.parts)
+    {
+        if ([part isKindOfClass:[NSData class]])
+            ok = [self write:[part bytes] length:[part length] to:fd];
+        else
+            ok = [self copyFile:part to:fd buffer:buffer];
+
+        if (!ok)
+            break;
+    }
+    free(buffer);
+
+    if (!ok)
+    {
+        [self failWithErrno:error path:filePath];
+        close(fd);
+        unlink([filePath fileSystemRepresentation]);
+        return NO;
+    }
+    if (close(fd) != 0)
+        return [self failWithErrno:error path:filePath];
+    return YES;
+}
+
+- (BOOL)copyFile:(NSString *)sourcePath to:(int)fd buffer:(uint8_t *)buffer
+{
+    int sourceFd = open([sourcePath fileSystemRepresentation], O_RDONLY);
+    if (sourceFd < 0)
+    {
+        OB_ERROR(@"Unable to open %@ to add it to the request body", sourcePath);
+        return NO;
+    }
+
+    BOOL ok = YES;
+    ssize_t bytesRead;
+    while ((bytesRead = read(sourceFd, buffer, self.chunkSize)) != 0)
+    {
+        if (bytesRead < 0)
+        {
+            ok = NO;
+            break;
+        }
+        if (![self write:buffer length:(NSUInteger)bytesRead to:fd])
+        {
+            ok = NO;
+            break;
+        }
+    }
+    close(sourceFd);
+    return ok;
+}
+
+- (BOOL)write:(const uint8_t *)bytes length:(NSUInteger)length to:(int)fd
+{
+    while (length > 0)
+    {
+        ssize_t written = write(fd, bytes, length);
+        if (written < 0)
+            return NO;
+        bytes += written;
+        length -= (NSUInteger)written;
+    }
+    return YES;
+}
+
+- (BOOL)failWithErrno:(NSError **)error path:(NSString *)filePath
+{
+    OB_ERROR(@"Unable to write request body to %@: %s", filePath, strerror(errno));
+    if (error != NULL)
+        *error = [NSError errorWithDomain:NSPOSIXErrorDomain code:errno userInfo:@{NSFilePathErrorKey : filePath}];
+    return NO;
+}
+
+@end
@@ -0,0 +1,35 @@
+//
+//  OBRetryDecision.h
+//  Pods
+//
+//  Created by etcetc on 10/17/26.
+//
+//
+
+#import <Foundation/Foundation.h>
+
+typedef NS_ENUM(NSInteger, OBRetryAction)
+{
+    // Nothing to wait for, e.g. the clock was off and has been adjusted
+    OBRetryActionNow,
+    // The usual progressive backoff, unless there is a delay
+    OBRetryActionBackoff,
+    // The credentials were refused: the agent is asked to refresh them, then we try again right away.
+    // Either way only one retry in a row goes without a backoff.
+    OBRetryActionRefreshCredentials,
+    // Trying again would fail the same way
+    OBRetryActionFail
+};
+
+// What an agent makes of a failed request, see OBFileTransferAgentProtocol
+@interface OBRetryDecision : NSObject
+
+@property (nonatomic, readonly) OBRetryAction action;
+// Seconds to wait before trying again, e.g. from a Retry-After header.  0 to go by the action.
+@property (nonatomic, readonly) NSTimeInterval delay;
+// For the logs
+@property (nonatomic, readonly) NSString *reason;
+
++ (instancetype)decisionWithAction:(OBRetryAction)action delay:(NSTimeInterval)delay reason:(NSString *)reason;
+
+@end
@@ -0,0 +1,35 @@
+//
+//  OBRetryDecision.m
+//  Pods
+//
+//  Created by etcetc on 10/17/26.
+//
+//
+
+#import "OBRetryDecision.h"
+
+@interface OBRetryDecision ()
+@property (nonatomic) OBRetryAction action;
+@property (nonatomic) NSTimeInterval delay;
+@property (nonatomic, strong) NSString *reason;
+@end
+
+@implementation OBRetryDecision
+
++ (instancetype)decisionWithAction:(OBRetryAction)action delay:(NSTimeInterval)delay reason:(NSString *)reason
+{
+    OBRetryDecision *decision = [self new];
+    decision.action = action;
+    decision.delay = MAX(delay, 0);
+    decision.reason = reason;
+    return decision;
+}
+
+- (NSString *)description
+{
+    static NSString *const actions[] = {@"retry now", @"retry with backoff", @"refresh credentials and retry", @"fail"};
+    NSString *description = [NSString stringWithFormat:@"%@ (%@)", actions[self.action], self.reason];
+    return self.delay > 0 ? [description stringByAppendingFormat:@" in %.0f seconds", self.delay] : description;
+}
+
+@end
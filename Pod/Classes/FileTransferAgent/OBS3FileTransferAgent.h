@@ -8,6 +8,7 @@
 
 #import <Foundation/Foundation.h>
 #import "OBFileTransferAgent.h"
+#import "OBChunkedUploadAgentProtocol.h"
 
 extern NSString *const OBS3StorageProtocol;
 extern NSString *const OBS3TvmServerUrlParam;
@@ -15,6 +16,10 @@ extern NSString *const OBS3RegionParam;
 extern NSString *const OBS3NoTvmAccessKeyParam;
 extern NSString *const OBS3NoTvmSecretKeyParam;
 extern NSString *const OBS3NoTvmSecurityTokenParam;
+extern NSString *const OBS3EndpointParam;
+extern NSString *const OBS3MultipartThresholdParam;
+extern NSString *const OBS3MultipartPartSizeParam;
+extern NSString *const OBS3MultipartConcurrencyParam;
 
 /** TransferAgent for use with Amazon S3
  * configParams:
@@ -30,7 +35,20 @@ extern NSString *const OBS3NoTvmSecurityTokenParam;
  * 
  * OBS3RegionParam:
  *      The endpoint for the region of the S3 bucket. If nil then US_EAST_1 region is used.
+ *
+ * OBS3EndpointParam:
+ *      Overrides the endpoint derived from the region, e.g. http://localhost:9000 to test against a local
+ * S3 compatible server.
+ *
+ * OBS3MultipartThresholdParam:
+ *      Files of at least this many bytes are sent as a multipart upload. 0 turns multipart uploads off. Default: 16MB.
+ *
+ * OBS3MultipartPartSizeParam:
+ *      Size of each part of a multipart upload. S3 requires at least 5MB. Default: 8MB.
+ *
+ * OBS3MultipartConcurrencyParam:
+ *      How many parts of one file are sent at the same time. Default: 4.
  */
-@interface OBS3FileTransferAgent : OBFileTransferAgent
+@interface OBS3FileTransferAgent : OBFileTransferAgent <OBChunkedUploadAgent>
 
 @end
@@ -9,6 +9,7 @@
 #import "OBS3FileTransferAgent.h"
 #import <AWSS3/AWSS3.h>
 #import "AmazonClientManager.h"
+#import "S3ErrorResponseHandler.h"
 
 NSString *const OBS3StorageProtocol = @"s3";
 NSString *const OBS3TvmServerUrlParam = @"S3TvmServerUrlParam";
@@ -16,10 +17,22 @@ NSString *const OBS3RegionParam = @"S3RegionParam";
 NSString *const OBS3NoTvmAccessKeyParam = @"S3NoTvmAccessKeyParam";
 NSString *const OBS3NoTvmSecretKeyParam = @"S3NoTvmSecretKeyParam";
 NSString *const OBS3NoTvmSecurityTokenParam = @"S3NoTvmSecurityTokenParam";
+NSString *const OBS3EndpointParam = @"S3EndpointParam";
+NSString *const OBS3MultipartThresholdParam = @"S3MultipartThresholdParam";
+NSString *const OBS3MultipartPartSizeParam = @"S3MultipartPartSizeParam";
+NSString *const OBS3MultipartConcurrencyParam = @"S3MultipartConcurrencyParam";
+
+#define DEFAULT_MULTIPART_THRESHOLD (16 * 1024 * 1024)
+#define DEFAULT_MULTIPART_PART_SIZE (8 * 1024 * 1024)
+#define MIN_MULTIPART_PART_SIZE (5 * 1024 * 1024)
+#define DEFAULT_MULTIPART_CONCURRENCY 4
 
 @interface OBS3FileTransferAgent ()
 @property (nonatomic, strong) NSString *tvmUrl;
 @property (nonatomic) AmazonRegion awsRegion;
+@property (nonatomic) long long multipartThreshold;
+@property (nonatomic) long long multipartPartSize;
+@property (nonatomic) NSUInteger multipartConcurrency;
 @end
 
 @implementation OBS3FileTransferAgent
@@ -34,6 +47,14 @@ NSString *const OBS3NoTvmSecurityTokenParam = @"S3NoTvmSecurityTokenParam";
         [AmazonClientManager setTvmServerUrl:self.tvmUrl];
         [AmazonClientManager setNoTvmCredentials:[self noTvmCredentials:configParams]];
         [AmazonClientManager setRegion:self.awsRegion];
+        [AmazonClientManager setEndpoint:configParams[OBS3EndpointParam]];
+
+        self.multipartThreshold = configParams[OBS3MultipartThresholdParam] ?
+                [configParams[OBS3MultipartThresholdParam] longLongValue] : DEFAULT_MULTIPART_THRESHOLD;
+        self.multipartPartSize = configParams[OBS3MultipartPartSizeParam] ?
+                MAX([configParams[OBS3MultipartPartSizeParam] longLongValue], MIN_MULTIPART_PART_SIZE) : DEFAULT_MULTIPART_PART_SIZE;
+        self.multipartConcurrency = configParams[OBS3MultipartConcurrencyParam] ?
+                MAX([configParams[OBS3MultipartConcurrencyParam] unsignedIntegerValue], 1) : DEFAULT_MULTIPART_CONCURRENCY;
     }
     return self;
 }
@@ -86,14 +107,7 @@ NSString *const OBS3NoTvmSecurityTokenParam = @"S3NoTvmSecurityTokenParam";
     if (s3Url == nil) s3Url = @""; // Not sure what special case this is here for.
 
     NSDictionary *urlComponents = [self urlToComponents:s3Url];
-
-    NSString *filename;
-    if (params[FilenameParamKey] != nil)
-        filename = params[FilenameParamKey];
-    else if (urlComponents[@"filename"] != nil)
-        filename = urlComponents[@"filename"];
-    else
-        filename = [[filePath pathComponents] lastObject];
+    NSString *filename = [self keyForUpload:filePath to:s3Url withParams:params];
 
     S3PutObjectRequest *putRequest = [[S3PutObjectRequest alloc] initWithKey:filename
                                                                     inBucket:urlComponents[@"bucketName"]];
@@ -120,6 +134,251 @@ NSString *const OBS3NoTvmSecurityTokenParam = @"S3NoTvmSecurityTokenParam";
     return request2;
 }
 
+- (NSString *)keyForUpload:(NSString *)filePath to:(NSString *)s3Url withParams:(NSDictionary *)params
+{
+    NSDictionary *urlComponents = [self urlToComponents:s3Url == nil ? @"" : s3Url];
+    if (params[FilenameParamKey] != nil)
+        return params[FilenameParamKey];
+    else if (urlComponents[@"filename"] != nil)
+        return urlComponents[@"filename"];
+    else
+        return [[filePath pathComponents] lastObject];
+}
+
+// HEAD the object.  We put the hash in the metadata of what we upload, so if the object has one it decides.
+- (BOOL)hasUploadOf:(NSString *)filePath
+                 to:(NSString *)s3Url
+         withParams:(NSDictionary *)params
+        contentHash:(NSString *)contentHash
+      knownUploaded:(BOOL)knownUploaded
+{
+    S3GetObjectMetadataRequest *headRequest = [[S3GetObjectMetadataRequest alloc] initWithKey:[self keyForUpload:filePath to:s3Url withParams:params]
+                                                                                   withBucket:[self urlToComponents:s3Url][@"bucketName"]];
+    headRequest.endpoint = [AmazonClientManager s3].endpoint;
+    headRequest.securityToken = [AmazonClientManager securityToken];
+
+    S3GetObjectMetadataResponse *response;
+    @try
+    {
+        response = [[AmazonClientManager s3] getObjectMetadata:headRequest];
+    }
+    @catch (AmazonServiceException *e)
+    {
+        if (e.statusCode != 404)
+            OB_WARN(@"Unable to check for S3 object %@: %@", headRequest.key, e.message);
+        return NO;
+    }
+    @catch (AmazonClientException *e)
+    {
+        OB_WARN(@"Unable to check for S3 object %@: %@", headRequest.key, e.message);
+        return NO;
+    }
+
+    NSString *storedHash = [response getMetadataForKey:OBFileTransferContentHashMetadataKey];
+    return storedHash != nil ? [storedHash isEqualToString:contentHash] : knownUploaded;
+}
+
+#pragma mark - Multipart upload
+
+- (BOOL)shouldUploadInChunks:(NSString *)filePath withParams:(NSDictionary *)params
+{
+    if (self.multipartThreshold <= 0)
+        return NO;
+    long long fileSize = (long long)[[[NSFileManager defaultManager] attributesOfItemAtPath:filePath error:nil] fileSize];
+    return fileSize >= self.multipartThreshold;
+}
+
+- (long long)chunkSize
+{
+    return self.multipartPartSize;
+}
+
+- (NSUInteger)maxConcurrentChunks
+{
+    return self.multipartConcurrency;
+}
+
+// The content type and metadata go with the initiate request, the parts only carry bytes
+- (NSString *)startChunkedUploadOf:(NSString *)filePath
+                                to:(NSString *)s3Url
+                        withParams:(NSDictionary *)params
+                             error:(NSError **)error
+{
+    NSString *key = [self keyForUpload:filePath to:s3Url withParams:params];
+    NSString *bucket = [self urlToComponents:s3Url][@"bucketName"];
+    OB_INFO(@"Initiating S3 multipart upload of %@ to bucket: %@, key: %@", filePath, bucket, key);
+
+    S3InitiateMultipartUploadRequest *initiateRequest = [[S3InitiateMultipartUploadRequest alloc] initWithKey:key
+                                                                                                     inBucket:bucket];
+    initiateRequest.endpoint = [AmazonClientManager s3].endpoint;
+    initiateRequest.securityToken = [AmazonClientManager securityToken];
+    initiateRequest.contentType = params[ContentTypeParamKey] ? params[ContentTypeParamKey] : [self mimeTypeFromFilename:filePath];
+    [self addMetadataToS3PutObjectRequest:initiateRequest params:params];
+
+    @try
+    {
+        S3InitiateMultipartUploadResponse *response = [[AmazonClientManager s3] initiateMultipartUpload:initiateRequest];
+        return response.multipartUpload.uploadId;
+    }
+    @catch (AmazonClientException *e)
+    {
+        if (error != NULL)
+            *error = [self errorFromException:e];
+    }
+    return nil;
+}
+
+- (NSMutableURLRequest *)chunkRequest:(NSInteger)chunkNumber
+                               offset:(long long)offset
+                               length:(long long)length
+                          totalLength:(long long)totalLength
+                             uploadId:(NSString *)uploadId
+                                   of:(NSString *)filePath
+                                   to:(NSString *)s3Url
+                           withParams:(NSDictionary *)params
+{
+    S3UploadPartRequest *partRequest = [[S3UploadPartRequest alloc] init];
+    partRequest.key = [self keyForUpload:filePath to:s3Url withParams:params];
+    partRequest.bucket = [self urlToComponents:s3Url][@"bucketName"];
+    partRequest.uploadId = uploadId;
+    partRequest.partNumber = (int32_t)chunkNumber;
+    partRequest.contentLength = length;
+    partRequest.endpoint = [AmazonClientManager s3].endpoint;
+    partRequest.securityToken = [AmazonClientManager securityToken];
+
+    NSMutableURLRequest *request = [[AmazonClientManager s3] signS3Request:partRequest];
+
+    // Same as for the single upload, copy it over into a plain request
+    NSMutableURLRequest *request2 = [[NSMutableURLRequest alloc] initWithURL:request.URL];
+    [request2 setHTTPMethod:request.HTTPMethod];
+    [request2 setAllHTTPHeaderFields:[request allHTTPHeaderFields]];
+    return request2;
+}
+
+- (NSString *)receiptForChunkResponse:(NSHTTPURLResponse *)response
+{
+    NSString *etag = [[self class] headerNamed:@"ETag" ofResponse:response];
+    if (etag == nil)
+    {
+        OB_WARN(@"S3 part upload response without an ETag");
+        return nil;
+    }
+    return etag;
+}
+
+- (NSError *)finishChunkedUpload:(NSString *)uploadId
+                              of:(NSString *)filePath
+                              to:(NSString *)s3Url
+                      withParams:(NSDictionary *)params
+                        receipts:(NSDictionary *)receipts
+{
+    S3CompleteMultipartUploadRequest *completeRequest = [[S3CompleteMultipartUploadRequest alloc] init];
+    completeRequest.key = [self keyForUpload:filePath to:s3Url withParams:params];
+    completeRequest.bucket = [self urlToComponents:s3Url][@"bucketName"];
+    completeRequest.uploadId = uploadId;
+    completeRequest.endpoint = [AmazonClientManager s3].endpoint;
+    completeRequest.securityToken = [AmazonClientManager securityToken];
+    for (NSNumber *partNumber in [[receipts allKeys] sortedArrayUsingSelector:@selector(compare:)])
+    {
+        [completeRequest addPartWithPartNumber:partNumber.intValue withETag:receipts[partNumber]];
+    }
+
+    OB_INFO(@"Completing S3 multipart upload %@ of %lu parts", uploadId, (unsigned long)receipts.count);
+    @try
+    {
+        [[AmazonClientManager s3] completeMultipartUpload:completeRequest];
+    }
+    @catch (AmazonClientException *e)
+    {
+        return [self errorFromException:e];
+    }
+    return nil;
+}
+
+// Goes through all the pages of ListParts
+- (NSDictionary *)receiptsForChunkedUpload:(NSString *)uploadId
+                                        of:(NSString *)filePath
+                                        to:(NSString *)s3Url
+                                withParams:(NSDictionary *)params
+                                 chunkSize:(long long)chunkSize
+                                     error:(NSError **)error
+{
+    NSMutableDictionary *receipts = [NSMutableDictionary new];
+    S3ListPartsRequest *listRequest = [[S3ListPartsRequest alloc] init];
+    listRequest.key = [self keyForUpload:filePath to:s3Url withParams:params];
+    listRequest.bucket = [self urlToComponents:s3Url][@"bucketName"];
+    listRequest.uploadId = uploadId;
+    listRequest.endpoint = [AmazonClientManager s3].endpoint;
+    listRequest.securityToken = [AmazonClientManager securityToken];
+
+    @try
+    {
+        S3ListPartsResult *result;
+        do
+        {
+            result = [[AmazonClientManager s3] listParts:listRequest].listPartsResult;
+            for (S3Part *part in result.parts)
+            {
+                receipts[@(part.partNumber)] = part.etag;
+            }
+            listRequest.partNumberMarker = result.nextPartNumberMarker;
+        } while (result.isTruncated);
+    }
+    @catch (AmazonServiceException *e)
+    {
+        if ([e.errorCode isEqualToString:@"NoSuchUpload"])
+        {
+            OB_WARN(@"S3 no longer has multipart upload %@", uploadId);
+            return nil;
+        }
+        if (error != NULL)
+            *error = [self errorFromException:e];
+        return nil;
+    }
+    @catch (AmazonClientException *e)
+    {
+        if (error != NULL)
+            *error = [self errorFromException:e];
+        return nil;
+    }
+    return receipts;
+}
+
+- (void)abortChunkedUpload:(NSString *)uploadId
+                        of:(NSString *)filePath
+                        to:(NSString *)s3Url
+                withParams:(NSDictionary *)params
+{
+    S3AbortMultipartUploadRequest *abortRequest = [[S3AbortMultipartUploadRequest alloc] init];
+    abortRequest.key = [self keyForUpload:filePath to:s3Url withParams:params];
+    abortRequest.bucket = [self urlToComponents:s3Url][@"bucketName"];
+    abortRequest.uploadId = uploadId;
+    abortRequest.endpoint = [AmazonClientManager s3].endpoint;
+    abortRequest.securityToken = [AmazonClientManager securityToken];
+    @try
+    {
+        [[AmazonClientManager s3] abortMultipartUpload:abortRequest];
+    }
+    @catch (AmazonClientException *e)
+    {
+        OB_WARN(@"Unable to abort S3 multipart upload %@: %@", uploadId, e.message);
+    }
+}
+
+// Service exceptions carry the http status, the others are network problems
+- (NSError *)errorFromException:(AmazonClientException *)e
+{
+    if ([e isKindOfClass:[AmazonServiceException class]])
+        return [NSError errorWithDomain:NSURLErrorDomain
+                                   code:((AmazonServiceException *)e).statusCode
+                               userInfo:@{NSLocalizedDescriptionKey : e.message ? e.message : @"", @"exception" : e}];
+    if (e.error != nil)
+        return e.error;
+    return [NSError errorWithDomain:NSURLErrorDomain
+                               code:NSURLErrorNetworkConnectionLost
+                           userInfo:@{NSLocalizedDescriptionKey : e.message ? e.message : @""}];
+}
+
 - (NSError *)deleteFile:(NSString *)s3Url
 {
     NSDictionary *urlComponents = [self urlToComponents:s3Url];
@@ -172,6 +431,55 @@ NSString *const OBS3NoTvmSecurityTokenParam = @"S3NoTvmSecurityTokenParam";
     return NO;
 }
 
+#pragma mark - Retry classification
+
+// S3 says what went wrong in the Code of its XML error body, or in the exception of the SDK call
+- (OBRetryDecision *)retryDecisionForResponse:(NSHTTPURLResponse *)response body:(NSData *)body error:(NSError *)error
+{
+    NSString *errorCode = [self s3ErrorCodeOfResponse:response body:body error:error];
+    if (errorCode == nil)
+        return [super retryDecisionForResponse:response body:body error:error];
+
+    NSTimeInterval retryAfter = [[self class] retryAfterOfResponse:response];
+    // The exception handler of the manager has adjusted the clock by now
+    if ([errorCode isEqualToString:@"RequestTimeTooSkewed"])
+        return [OBRetryDecision decisionWithAction:OBRetryActionNow delay:0 reason:errorCode];
+
+    // Temporary credentials from the token vending machine run out, fixed ones don't get any better
+    if ([@[@"ExpiredToken", @"InvalidToken", @"TokenRefreshRequired", @"InvalidAccessKeyId"] containsObject:errorCode])
+        return [OBRetryDecision decisionWithAction:self.tvmUrl != nil ? OBRetryActionRefreshCredentials : OBRetryActionFail
+                                             delay:0
+                                            reason:errorCode];
+
+    if ([@[@"SlowDown", @"InternalError", @"ServiceUnavailable", @"RequestTimeout"] containsObject:errorCode])
+        return [OBRetryDecision decisionWithAction:OBRetryActionBackoff delay:retryAfter reason:errorCode];
+
+    OBRetryDecision *decision = [super retryDecisionForResponse:response body:body error:error];
+    return [OBRetryDecision decisionWithAction:decision.action delay:decision.delay reason:errorCode];
+}
+
+- (NSString *)s3ErrorCodeOfResponse:(NSHTTPURLResponse *)response body:(NSData *)body error:(NSError *)error
+{
+    id exception = error.userInfo[@"exception"];
+    if ([exception isKindOfClass:[AmazonServiceException class]])
+        return ((AmazonServiceException *)exception).errorCode;
+
+    if (body.length == 0 || response.statusCode < 300)
+        return nil;
+    NSXMLParser *parser = [[NSXMLParser alloc] initWithData:body];
+    S3ErrorResponseHandler *errorHandler = [[S3ErrorResponseHandler alloc] initWithStatusCode:(int32_t)response.statusCode];
+    [parser setDelegate:errorHandler];
+    [parser parse];
+    return errorHandler.exception.errorCode;
+}
+
+- (void)refreshCredentials
+{
+    OB_INFO(@"Getting new S3 credentials");
+    [AmazonClientManager wipeAllCredentials];
+    [AmazonClientManager validateCredentials];
+}
+
 - (void)validateSetup
 {
 }
@@ -207,7 +515,7 @@ NSString *const OBS3NoTvmSecurityTokenParam = @"S3NoTvmSecurityTokenParam";
     return awsRegion;
 }
 
-- (void)addMetadataToS3PutObjectRequest:(S3PutObjectRequest *)request params:(NSDictionary *)params
+- (void)addMetadataToS3PutObjectRequest:(S3AbstractPutRequest *)request params:(NSDictionary *)params
 {
     NSDictionary *metadataDictionary = params[kOBFileTransferMetadataKey];
     for (NSString *key in metadataDictionary)
@@ -8,9 +8,32 @@
 
 #import <Foundation/Foundation.h>
 #import "OBFileTransferAgent.h"
+#import "OBChunkedUploadAgentProtocol.h"
 
 // Special parameter key
 extern NSString *const OBFormFileFieldNameParamKey;
 
-@interface OBServerFileTransferAgent : OBFileTransferAgent
+extern NSString *const OBServerChunkedUploadThresholdParam;
+extern NSString *const OBServerChunkSizeParam;
+
+/** TransferAgent for a standard http(s) server
+ * configParams:
+ *
+ * OBServerChunkedUploadThresholdParam:
+ *      Files of at least this many bytes are sent in chunks so that an interrupted upload goes on from the last chunk
+ * the server acknowledged. The server has to implement the protocol below, so this is off by default (0).
+ *
+ * OBServerChunkSizeParam:
+ *      Size of each chunk. Default: 4MB.
+ */
+// Chunked upload protocol (TestServer/server.js has a reference implementation):
+//  - POST <target url>?uploadType=chunked with X-Upload-Content-Length, X-Upload-Content-Type and the params, including
+//    the filename, as a form-urlencoded body.  The server answers 201 with the upload url in the Location header.
+//  - PUT <upload url> with Content-Range: bytes first-last/total for each chunk, in order.  The server answers 200 with
+//    X-Upload-Offset, the number of bytes it has, and stores the file once it has all of them.
+//  - PUT <upload url> with no body and Content-Range: bytes */total asks for X-Upload-Offset.  404 if it is unknown.
+//  - DELETE <upload url> cancels the upload.
+// Upload deduplication asks HEAD <target url>?filename=<filename> with X-Content-SHA256, the lowercase hex SHA-256 of
+// the file.  The server answers 200 if it has that file with that content, 404 if not.
+@interface OBServerFileTransferAgent : OBFileTransferAgent <OBChunkedUploadAgent>
 @end
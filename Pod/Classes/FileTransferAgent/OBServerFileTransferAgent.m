@@ -8,6 +8,16 @@
 
 #import "OBServerFileTransferAgent.h"
 
+NSString *const OBServerChunkedUploadThresholdParam = @"ServerChunkedUploadThresholdParam";
+NSString *const OBServerChunkSizeParam = @"ServerChunkSizeParam";
+
+#define DEFAULT_CHUNK_SIZE (4 * 1024 * 1024)
+
+@interface OBServerFileTransferAgent ()
+@property (nonatomic) long long chunkedUploadThreshold;
+@property (nonatomic) long long uploadChunkSize;
+@end
+
 @implementation OBServerFileTransferAgent
 
 NSString *const OBHttpFormBoundary = @"the!-boundary!-marker!";
@@ -15,6 +25,17 @@ NSString *const OBHttpFormBoundary = @"the!-boundary!-marker!";
 // Parameter to use to determine the field name for the multipart file metadata
 NSString *const OBFormFileFieldNameParamKey = @"_fileFieldName";
 
+- (instancetype)initWithConfig:(NSDictionary *)configParams
+{
+    if ([self init])
+    {
+        self.chunkedUploadThreshold = [configParams[OBServerChunkedUploadThresholdParam] longLongValue];
+        self.uploadChunkSize = configParams[OBServerChunkSizeParam] ?
+                MAX([configParams[OBServerChunkSizeParam] longLongValue], 1) : DEFAULT_CHUNK_SIZE;
+    }
+    return self;
+}
+
 // Create a GET request to a standard URL.  Note that any parameters may be passed in the params
 // structure or else be in the sourceFileUrl
 - (NSMutableURLRequest *)downloadFileRequest:(NSString *)sourcefileUrl withParams:(NSDictionary *)params
@@ -34,7 +55,7 @@ NSString *const OBFormFileFieldNameParamKey = @"_fileFieldName";
 }
 
 // Create a multipart/form-data POST request to upload the file to the indicated URL
-// Special internal parameters as well as other passed-on params can be added.  See OBFileTransferAgent.h/m
+// The body is built by uploadBodyForFile:withParams: and streamed to disk, so the request only has the headers
 - (NSMutableURLRequest *)uploadFileRequest:(NSString *)filePath
                                         to:(NSString *)targetUrl
                                 withParams:(NSDictionary *)params
@@ -48,8 +69,14 @@ NSString *const OBFormFileFieldNameParamKey = @"_fileFieldName";
     [request setValue:[NSString stringWithFormat:@"multipart/form-data;boundary=%@", OBHttpFormBoundary]
    forHTTPHeaderField:@"Content-Type"];
 
+    return request;
+}
 
-    NSMutableData *body = [[NSMutableData alloc] init];
+// The multipart/form-data body: the file first, then the params.
+// Special internal parameters as well as other passed-on params can be added.  See OBFileTransferAgent.h/m
+- (OBMultipartBodyWriter *)uploadBodyForFile:(NSString *)filePath withParams:(NSDictionary *)params
+{
+    OBMultipartBodyWriter *body = [[OBMultipartBodyWriter alloc] initWithBoundary:OBHttpFormBoundary];
 
     if (filePath != nil)
     {
@@ -59,7 +86,6 @@ NSString *const OBFormFileFieldNameParamKey = @"_fileFieldName";
         NSString *contentType = params[ContentTypeParamKey] ? params[ContentTypeParamKey] : [self mimeTypeFromFilename:filePath];
 
         NSMutableString *preString = [[NSMutableString alloc] init];
-        [preString appendString:[NSString stringWithFormat:@"--%@\r\n", OBHttpFormBoundary]];
         [preString appendString:[NSString stringWithFormat:@"Content-Disposition: form-data; name=\"%@\"; filename=\"%@\"\r\n",
                                                            formFileInputName,
                                                            filename]];
@@ -68,9 +94,10 @@ NSString *const OBFormFileFieldNameParamKey = @"_fileFieldName";
         [preString appendString:@"\r\n"];
 
 
-        [body appendData:[preString dataUsingEncoding:NSUTF8StringEncoding]];
-        [body appendData:[NSData dataWithContentsOfFile:filePath]];
-        [body appendData:[@"\r\n" dataUsingEncoding:NSUTF8StringEncoding]];
+        [body appendBoundary];
+        [body appendString:preString];
+        [body appendFileAtPath:filePath];
+        [body appendString:@"\r\n"];
     }
 
     NSDictionary *coreParams = [self removeSpecialParams:params];
@@ -87,15 +114,11 @@ NSString *const OBFormFileFieldNameParamKey = @"_fileFieldName";
             [paramsString appendString:[NSString stringWithFormat:@"%@\r\n", coreParams[param]]];
         }
 
-        [body appendData:[paramsString dataUsingEncoding:NSUTF8StringEncoding]];
+        [body appendString:paramsString];
     }
 
-    NSString *postString = [NSString stringWithFormat:@"--%@--\r\n", OBHttpFormBoundary];
-
-    [body appendData:[postString dataUsingEncoding:NSUTF8StringEncoding]];
-
-    [request setHTTPBody:body];
-    return request;
+    [body appendClosingBoundary];
+    return body;
 }
 
 - (NSDictionary *)removeSpecialParams:(NSDictionary *)params
@@ -110,4 +133,175 @@ NSString *const OBFormFileFieldNameParamKey = @"_fileFieldName";
     return YES;
 }
 
+// The server computes the hash of what it has, see the header
+- (BOOL)hasUploadOf:(NSString *)filePath
+                 to:(NSString *)targetUrl
+         withParams:(NSDictionary *)params
+        contentHash:(NSString *)contentHash
+      knownUploaded:(BOOL)knownUploaded
+{
+    NSString *filename = params[FilenameParamKey] == nil ? [[filePath pathComponents] lastObject] : params[FilenameParamKey];
+    NSString *separator = [targetUrl rangeOfString:@"?"].location == NSNotFound ? @"?" : @"&";
+    NSString *checkUrl = [NSString stringWithFormat:@"%@%@%@", targetUrl, separator, [self serializeParams:@{@"filename" : filename}]];
+
+    NSMutableURLRequest *request = [[NSMutableURLRequest alloc] initWithURL:[NSURL URLWithString:checkUrl]];
+    [request setHTTPMethod:@"HEAD"];
+    [request setValue:contentHash forHTTPHeaderField:@"X-Content-SHA256"];
+    NSHTTPURLResponse *response = [self sendSynchronousRequest:request error:nil];
+    return response.statusCode == 200;
+}
+
+#pragma mark - Chunked upload
+
+// The upload id is the upload url the server gave us and the receipt of a chunk is the offset it acknowledged
+
+- (BOOL)shouldUploadInChunks:(NSString *)filePath withParams:(NSDictionary *)params
+{
+    if (self.chunkedUploadThreshold <= 0)
+        return NO;
+    long long fileSize = (long long)[[[NSFileManager defaultManager] attributesOfItemAtPath:filePath error:nil] fileSize];
+    return fileSize >= self.chunkedUploadThreshold;
+}
+
+- (long long)chunkSize
+{
+    return self.uploadChunkSize;
+}
+
+// The server only takes the bytes right after the ones it has
+- (NSUInteger)maxConcurrentChunks
+{
+    return 1;
+}
+
+- (NSString *)startChunkedUploadOf:(NSString *)filePath
+                                to:(NSString *)targetUrl
+                        withParams:(NSDictionary *)params
+                             error:(NSError **)error
+{
+    NSString *separator = [targetUrl rangeOfString:@"?"].location == NSNotFound ? @"?" : @"&";
+    NSString *startUrl = [NSString stringWithFormat:@"%@%@uploadType=chunked", targetUrl, separator];
+    OB_INFO(@"Starting chunked upload of %@ to %@", filePath, startUrl);
+
+    long long fileSize = (long long)[[[NSFileManager defaultManager] attributesOfItemAtPath:filePath error:nil] fileSize];
+    NSString *contentType = params[ContentTypeParamKey] ? params[ContentTypeParamKey] : [self mimeTypeFromFilename:filePath];
+    NSMutableDictionary *formParams = [NSMutableDictionary dictionaryWithDictionary:[self removeSpecialParams:params]];
+    formParams[@"filename"] = params[FilenameParamKey] == nil ? [[filePath pathComponents] lastObject] : params[FilenameParamKey];
+
+    NSMutableURLRequest *request = [[NSMutableURLRequest alloc] initWithURL:[NSURL URLWithString:startUrl]];
+    [request setHTTPMethod:@"POST"];
+    [request setValue:@"application/x-www-form-urlencoded" forHTTPHeaderField:@"Content-Type"];
+    [request setValue:[NSString stringWithFormat:@"%lld", fileSize] forHTTPHeaderField:@"X-Upload-Content-Length"];
+    [request setValue:contentType forHTTPHeaderField:@"X-Upload-Content-Type"];
+    [request setHTTPBody:[[self serializeParams:formParams] dataUsingEncoding:NSUTF8StringEncoding]];
+
+    NSHTTPURLResponse *response = [self sendSynchronousRequest:request error:error];
+    if (response == nil)
+        return nil;
+    if (response.statusCode / 100 != 2)
+    {
+        if (error != NULL)
+            *error = [self errorForResponse:response];
+        return nil;
+    }
+
+    NSString *location = [[self class] headerNamed:@"Location" ofResponse:response];
+    if (location == nil)
+    {
+        if (error != NULL)
+            *error = [NSError errorWithDomain:NSURLErrorDomain code:NSURLErrorBadServerResponse userInfo:nil];
+        return nil;
+    }
+    // The server may give us a path only
+    return [[NSURL URLWithString:location relativeToURL:[NSURL URLWithString:startUrl]] absoluteString];
+}
+
+- (NSMutableURLRequest *)chunkRequest:(NSInteger)chunkNumber
+                               offset:(long long)offset
+                               length:(long long)length
+                          totalLength:(long long)totalLength
+                             uploadId:(NSString *)uploadUrl
+                                   of:(NSString *)filePath
+                                   to:(NSString *)targetUrl
+                           withParams:(NSDictionary *)params
+{
+    NSMutableURLRequest *request = [[NSMutableURLRequest alloc] initWithURL:[NSURL URLWithString:uploadUrl]];
+    [request setHTTPMethod:@"PUT"];
+    [request setValue:@"application/octet-stream" forHTTPHeaderField:@"Content-Type"];
+    [request setValue:[NSString stringWithFormat:@"%lld", length] forHTTPHeaderField:@"Content-Length"];
+    [request setValue:[NSString stringWithFormat:@"bytes %lld-%lld/%lld", offset, offset + length - 1, totalLength]
+   forHTTPHeaderField:@"Content-Range"];
+    return request;
+}
+
+// A server that took the chunk says how many bytes it has, without that we can't tell it did
+- (NSString *)receiptForChunkResponse:(NSHTTPURLResponse *)response
+{
+    return [[self class] headerNamed:@"X-Upload-Offset" ofResponse:response];
+}
+
+// The server puts the file together when the last chunk arrives
+- (NSError *)finishChunkedUpload:(NSString *)uploadUrl
+                              of:(NSString *)filePath
+                              to:(NSString *)targetUrl
+                      withParams:(NSDictionary *)params
+                        receipts:(NSDictionary *)receipts
+{
+    return nil;
+}
+
+- (void)abortChunkedUpload:(NSString *)uploadUrl
+                        of:(NSString *)filePath
+                        to:(NSString *)targetUrl
+                withParams:(NSDictionary *)params
+{
+    NSMutableURLRequest *request = [[NSMutableURLRequest alloc] initWithURL:[NSURL URLWithString:uploadUrl]];
+    [request setHTTPMethod:@"DELETE"];
+    NSError *error;
+    if ([self sendSynchronousRequest:request error:&error] == nil)
+        OB_WARN(@"Unable to cancel chunked upload %@: %@", uploadUrl, error);
+}
+
+// Every chunk that ends at or before the offset the server has is done
+- (NSDictionary *)receiptsForChunkedUpload:(NSString *)uploadUrl
+                                        of:(NSString *)filePath
+                                        to:(NSString *)targetUrl
+                                withParams:(NSDictionary *)params
+                                 chunkSize:(long long)chunkSize
+                                     error:(NSError **)error
+{
+    long long fileSize = (long long)[[[NSFileManager defaultManager] attributesOfItemAtPath:filePath error:nil] fileSize];
+    NSMutableURLRequest *request = [[NSMutableURLRequest alloc] initWithURL:[NSURL URLWithString:uploadUrl]];
+    [request setHTTPMethod:@"PUT"];
+    [request setValue:@"0" forHTTPHeaderField:@"Content-Length"];
+    [request setValue:[NSString stringWithFormat:@"bytes */%lld", fileSize] forHTTPHeaderField:@"Content-Range"];
+
+    NSHTTPURLResponse *response = [self sendSynchronousRequest:request error:error];
+    if (response == nil)
+        return nil;
+    if (response.statusCode == 404)
+    {
+        OB_WARN(@"Server no longer has chunked upload %@", uploadUrl);
+        return nil;
+    }
+    if (response.statusCode / 100 != 2)
+    {
+        if (error != NULL)
+            *error = [self errorForResponse:response];
+        return nil;
+    }
+
+    long long received = [[[self class] headerNamed:@"X-Upload-Offset" ofResponse:response] longLongValue];
+    NSMutableDictionary *receipts = [NSMutableDictionary new];
+    NSString *receipt = [NSString stringWithFormat:@"%lld", received];
+    for (NSInteger chunkNumber = 1; (chunkNumber - 1) * chunkSize < fileSize; chunkNumber++)
+    {
+        if (MIN(chunkNumber * chunkSize, fileSize) > received)
+            break;
+        receipts[@(chunkNumber)] = receipt;
+    }
+    OB_DEBUG(@"Server has %lld of %lld bytes of %@", received, fileSize, uploadUrl);
+    return receipts;
+}
+
 @end
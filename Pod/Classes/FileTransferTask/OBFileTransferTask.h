@@ -13,6 +13,15 @@ typedef NS_ENUM(NSUInteger, OBFileTransferTaskStatus)
     FileTransferInProgress,
     FileTransferDownloadFileReady,
     FileTransferPendingRetry,
+    FileTransferQueued
+};
+
+// Transfers with a higher priority are started first, any value goes
+typedef NS_ENUM(NSInteger, OBFileTransferPriority)
+{
+    OBFileTransferPriorityLow = -1,
+    OBFileTransferPriorityNormal = 0,
+    OBFileTransferPriorityHigh = 1
 };
 
 extern NSString *const CreatedOnKey;
@@ -28,6 +37,17 @@ extern NSString *const CountOfBytesExpectedToReceiveKey;
 extern NSString *const CountOfBytesReceivedKey;
 extern NSString *const CountOfBytesExpectedToSendKey;
 extern NSString *const CountOfBytesSentKey;
+extern NSString *const UploadIdKey;
+extern NSString *const ChunkedLengthKey;
+extern NSString *const ChunkSizeKey;
+extern NSString *const ChunkReceiptsKey;
+extern NSString *const DownloadValidatorKey;
+extern NSString *const ResumeDataKey;
+extern NSString *const ContentHashKey;
+extern NSString *const PriorityKey;
+extern NSString *const NextAttemptAtKey;
+extern NSString *const LeaderMarkerKey;
+extern NSString *const ActiveChunksKey;
 
 
 @interface OBFileTransferTask : NSObject <NSCoding>
@@ -39,8 +59,41 @@ extern NSString *const CountOfBytesSentKey;
 @property (nonatomic, strong) NSString *remoteUrl;
 @property (nonatomic, strong) NSString *localFilePath;
 @property (nonatomic) NSUInteger nsTaskIdentifier;
-@property (nonatomic, strong) NSDictionary *params;
+// Replaced, never mutated, once the task is tracked (see OBFileTransferTaskManager update:withContentHash:)
+@property (atomic, strong) NSDictionary *params;
 @property (nonatomic) OBFileTransferTaskStatus status;
+@property (nonatomic) NSInteger priority;
+// When a transfer pending retry is due to be tried again.  The backoff that led to it is attemptCount.
+@property (nonatomic, strong) NSDate *nextAttemptAt;
+// Whether the last retry went without a backoff.  Only one does in a row.  Not persisted.
+@property (nonatomic) BOOL retriedImmediately;
+
+// What NSURLSession gave us to resume an interrupted download with.  Used once, by the next attempt.
+@property (nonatomic, strong) NSData *resumeData;
+
+// SHA-256 of an upload checked for duplicates (see OBFTMDeduplicateUploadsParam), set once the check was done and
+// empty if the file could not be hashed
+@property (nonatomic, strong) NSString *contentHash;
+
+// Marker of the download of the same remote URL that this download is attached to and waits for, nil otherwise
+@property (nonatomic, strong) NSString *leaderMarker;
+
+// Chunked uploads (see OBChunkedUploadAgent) and segmented downloads, which are split in chunks of chunkSize bytes.
+// uploadId is set once a chunked upload was started on the server, chunkSize once a segmented download knows the size.
+// Access the dictionaries while synchronized on the task.  The upload id, sizes, receipts and chunks in flight are
+// persisted so a transfer can pick up where it left off after the app was killed, and the completions of the chunks
+// sent before can still be matched to it.
+@property (nonatomic, strong) NSString *uploadId;
+@property (nonatomic) long long chunkedLength;
+@property (nonatomic) long long chunkSize;
+// The ETag (or else Last-Modified) of a segmented download, so all segments come from the same version of the file
+@property (nonatomic, strong) NSString *downloadValidator;
+// chunk number -> receipt, for the chunks the server has or, for a download, the segments we have
+@property (nonatomic, strong) NSMutableDictionary *chunkReceipts;
+// NSURLSessionTask identifier -> chunk number, for the chunks in flight
+@property (nonatomic, strong) NSMutableDictionary *activeChunks;
+// chunk number -> bytes transferred so far, for the chunks in flight
+@property (nonatomic, strong) NSMutableDictionary *chunkBytesTransferred;
 
 // Return a request that would map to this transfer agent (NOT USED FOR NOW)
 //-(NSMutableURLRequest *) request;
@@ -51,6 +104,24 @@ extern NSString *const CountOfBytesSentKey;
 
 - (NSString *)transferDirection;
 
+// The host part of the remote url (for s3:// and gs:// urls this is the bucket)
+- (NSString *)remoteHost;
+
++ (NSString *)hostForRemoteUrl:(NSString *)remoteUrl;
+
+- (BOOL)isChunkedUpload;
+
+- (BOOL)isSegmentedDownload;
+
+- (NSInteger)chunkCount;
+
+- (long long)offsetOfChunk:(NSInteger)chunkNumber;
+
+- (long long)lengthOfChunk:(NSInteger)chunkNumber;
+
+// Bytes transferred of the whole file, counting the chunks in flight as far as they got
+- (long long)chunkedBytesTransferred;
+
 - (NSDictionary *)info;
 
 // these are for converting to a simple dictionary for serializing, etc.
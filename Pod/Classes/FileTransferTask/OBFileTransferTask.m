@@ -24,6 +24,17 @@ NSString *const CountOfBytesExpectedToReceiveKey = @"CountOfBytesExpectedToRecei
 NSString *const CountOfBytesReceivedKey = @"CountOfBytesReceivedKey";
 NSString *const CountOfBytesExpectedToSendKey = @"CountOfBytesExpectedToSendKey";
 NSString *const CountOfBytesSentKey = @"CountOfBytesSentKey";
+NSString *const UploadIdKey = @"uploadId";
+NSString *const ChunkedLengthKey = @"chunkedLength";
+NSString *const ChunkSizeKey = @"chunkSize";
+NSString *const ChunkReceiptsKey = @"chunkReceipts";
+NSString *const DownloadValidatorKey = @"downloadValidator";
+NSString *const ResumeDataKey = @"resumeData";
+NSString *const ContentHashKey = @"contentHash";
+NSString *const PriorityKey = @"priority";
+NSString *const NextAttemptAtKey = @"nextAttemptAt";
+NSString *const LeaderMarkerKey = @"leaderMarker";
+NSString *const ActiveChunksKey = @"activeChunks";
 
 @implementation OBFileTransferTask
 
@@ -33,6 +44,9 @@ NSString *const CountOfBytesSentKey = @"CountOfBytesSentKey";
     {
         self.createdOn = [NSDate date];
         self.attemptCount = 0;
+        self.chunkReceipts = [NSMutableDictionary new];
+        self.activeChunks = [NSMutableDictionary new];
+        self.chunkBytesTransferred = [NSMutableDictionary new];
     }
     return self;
 }
@@ -49,6 +63,9 @@ NSString *const CountOfBytesSentKey = @"CountOfBytesSentKey";
         case FileTransferPendingRetry:
             return @"Pending";
             break;
+        case FileTransferQueued:
+            return @"Queued";
+            break;
         case FileTransferDownloadFileReady:
             return @"Downloaded";
             break;
@@ -63,6 +80,64 @@ NSString *const CountOfBytesSentKey = @"CountOfBytesSentKey";
     return self.typeUpload ? @"Upload" : @"Download";
 }
 
+- (NSString *)remoteHost
+{
+    return [[self class] hostForRemoteUrl:self.remoteUrl];
+}
+
++ (NSString *)hostForRemoteUrl:(NSString *)remoteUrl
+{
+    if (remoteUrl == nil)
+        return nil;
+    return [[[NSURL URLWithString:remoteUrl] host] lowercaseString];
+}
+
+#pragma mark - Chunks
+
+- (BOOL)isChunkedUpload
+{
+    return self.uploadId != nil;
+}
+
+- (BOOL)isSegmentedDownload
+{
+    return !self.typeUpload && self.chunkSize > 0;
+}
+
+- (NSInteger)chunkCount
+{
+    if (self.chunkSize <= 0)
+        return 0;
+    return (NSInteger)((self.chunkedLength + self.chunkSize - 1) / self.chunkSize);
+}
+
+- (long long)offsetOfChunk:(NSInteger)chunkNumber
+{
+    return (chunkNumber - 1) * self.chunkSize;
+}
+
+- (long long)lengthOfChunk:(NSInteger)chunkNumber
+{
+    return MIN(self.chunkSize, self.chunkedLength - [self offsetOfChunk:chunkNumber]);
+}
+
+- (long long)chunkedBytesTransferred
+{
+    long long sent = 0;
+    @synchronized (self)
+    {
+        for (NSNumber *chunkNumber in self.chunkReceipts)
+        {
+            sent += [self lengthOfChunk:chunkNumber.integerValue];
+        }
+        for (NSNumber *chunkNumber in self.chunkBytesTransferred)
+        {
+            sent += [self.chunkBytesTransferred[chunkNumber] longLongValue];
+        }
+    }
+    return sent;
+}
+
 - (NSString *)description
 {
     return [NSString stringWithFormat:@"%@ %@ task '%@' id %lu remote:%@ local:%@ [%ld]",
@@ -130,6 +205,40 @@ NSString *const CountOfBytesSentKey = @"CountOfBytesSentKey";
     if (self.params != nil) dict[ParamsKey] = self.params;
     dict[AttemptsKey] = [NSNumber numberWithInteger:self.attemptCount];
     dict[StatusKey] = [NSNumber numberWithInteger:self.status];
+    dict[PriorityKey] = @(self.priority);
+    if (self.nextAttemptAt != nil)
+        dict[NextAttemptAtKey] = self.nextAttemptAt;
+    if (self.resumeData != nil)
+        dict[ResumeDataKey] = self.resumeData;
+    if (self.contentHash != nil)
+        dict[ContentHashKey] = self.contentHash;
+    if (self.leaderMarker != nil)
+        dict[LeaderMarkerKey] = self.leaderMarker;
+    if (self.chunkSize > 0)
+    {
+        if (self.uploadId != nil)
+            dict[UploadIdKey] = self.uploadId;
+        if (self.downloadValidator != nil)
+            dict[DownloadValidatorKey] = self.downloadValidator;
+        dict[ChunkedLengthKey] = @(self.chunkedLength);
+        dict[ChunkSizeKey] = @(self.chunkSize);
+        // plist keys have to be strings
+        NSMutableDictionary *receipts = [NSMutableDictionary new];
+        NSMutableDictionary *activeChunks = [NSMutableDictionary new];
+        @synchronized (self)
+        {
+            for (NSNumber *chunkNumber in self.chunkReceipts)
+            {
+                receipts[chunkNumber.stringValue] = self.chunkReceipts[chunkNumber];
+            }
+            for (NSNumber *nsTaskIdentifier in self.activeChunks)
+            {
+                activeChunks[nsTaskIdentifier.stringValue] = self.activeChunks[nsTaskIdentifier];
+            }
+        }
+        dict[ChunkReceiptsKey] = receipts;
+        dict[ActiveChunksKey] = activeChunks;
+    }
     return dict;
 }
 
@@ -146,6 +255,27 @@ NSString *const CountOfBytesSentKey = @"CountOfBytesSentKey";
         self.params = dict[ParamsKey];
         self.attemptCount = [dict[AttemptsKey] integerValue];
         self.status = [dict[StatusKey] integerValue];
+        self.priority = [dict[PriorityKey] integerValue];
+        self.nextAttemptAt = dict[NextAttemptAtKey];
+        self.uploadId = dict[UploadIdKey];
+        self.chunkedLength = [dict[ChunkedLengthKey] longLongValue];
+        self.chunkSize = [dict[ChunkSizeKey] longLongValue];
+        self.downloadValidator = dict[DownloadValidatorKey];
+        self.resumeData = dict[ResumeDataKey];
+        self.contentHash = dict[ContentHashKey];
+        self.leaderMarker = dict[LeaderMarkerKey];
+        NSDictionary *receipts = dict[ChunkReceiptsKey];
+        for (NSString *chunkNumber in receipts)
+        {
+            self.chunkReceipts[@(chunkNumber.integerValue)] = receipts[chunkNumber];
+        }
+        NSDictionary *activeChunks = dict[ActiveChunksKey];
+        for (NSString *nsTaskIdentifier in activeChunks)
+        {
+            NSNumber *chunkNumber = activeChunks[nsTaskIdentifier];
+            self.activeChunks[@((NSUInteger)nsTaskIdentifier.longLongValue)] = chunkNumber;
+            self.chunkBytesTransferred[chunkNumber] = @0;
+        }
     }
 
     return self;
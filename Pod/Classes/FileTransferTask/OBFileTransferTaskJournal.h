@@ -0,0 +1,29 @@
+//
+//  OBFileTransferTaskJournal.h
+//  Pods
+//
+//  Created by etcetc on 10/17/26.
+//
+//
+
+#import <Foundation/Foundation.h>
+#import "OBFileTransferTaskStore.h"
+
+// Write-ahead journal for the task manager state.
+// Each change to a task is appended as one small record to the journal file, so the cost of persisting an
+// event does not depend on the number of tracked tasks.  Once enough records have accumulated the journal is
+// compacted: the current state is written out as a snapshot plist and the journal is truncated.
+// Restoring reads the snapshot and then replays the journal on top of it.
+// The snapshot is basePath.plist, which is the format the task manager always used, and the journal is basePath.journal
+@interface OBFileTransferTaskJournal : NSObject <OBFileTransferTaskStore>
+
+// Number of journal records after which we compact.  We also never compact before the journal holds at
+// least twice as many records as there are live tasks, so compaction cost stays amortized O(1) per record.
+@property (nonatomic) NSUInteger compactionThreshold;
+
+- (instancetype)initWithSnapshotFile:(NSString *)snapshotFile journalFile:(NSString *)journalFile;
+
+// Write the snapshot and truncate the journal now
+- (void)compact;
+
+@end
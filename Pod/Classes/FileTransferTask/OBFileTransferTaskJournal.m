@@ -0,0 +1,290 @@
+//
+//  OBFileTransferTaskJournal.m
+//  Pods
+//
+//  Created by etcetc on 10/17/26.
+//
+//  Journal file format: a sequence of records, each a 4 byte big-endian length followed by a binary plist
+//  dictionary.  A record that was only partially written (e.g. because the app was killed) is dropped on restore.
+//
+
+#import "OBFileTransferTaskJournal.h"
+#import "OBFileTransferTask.h"
+#import <OBLogger/OBLogger.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+static NSString *const OBJournalOpKey = @"op";
+static NSString *const OBJournalOpPut = @"put";
+static NSString *const OBJournalOpRemove = @"remove";
+static NSString *const OBJournalOpResetRetries = @"resetRetries";
+static NSString *const OBJournalOpReset = @"reset";
+static NSString *const OBJournalTaskKey = @"task";
+static NSString *const OBJournalMarkerKey = @"marker";
+
+#define DEFAULT_COMPACTION_THRESHOLD 512
+
+@interface OBFileTransferTaskJournal ()
+{
+    int _journalFd;
+}
+@property (nonatomic, strong) NSString *snapshotFile;
+@property (nonatomic, strong) NSString *journalFile;
+@property (nonatomic, strong) NSMutableOrderedSet *markers;
+@property (nonatomic, strong) NSMutableDictionary *tasks;
+@property (nonatomic) NSUInteger recordCount;
+@end
+
+@implementation OBFileTransferTaskJournal
+
+- (instancetype)initWithBasePath:(NSString *)basePath
+{
+    return [self initWithSnapshotFile:[basePath stringByAppendingPathExtension:@"plist"]
+                          journalFile:[basePath stringByAppendingPathExtension:@"journal"]];
+}
+
+- (instancetype)initWithSnapshotFile:(NSString *)snapshotFile journalFile:(NSString *)journalFile
+{
+    self = [super init];
+    if (self)
+    {
+        _snapshotFile = snapshotFile;
+        _journalFile = journalFile;
+        _markers = [NSMutableOrderedSet new];
+        _tasks = [NSMutableDictionary new];
+        _compactionThreshold = DEFAULT_COMPACTION_THRESHOLD;
+        _journalFd = -1;
+    }
+    return self;
+}
+
+- (void)dealloc
+{
+    if (_journalFd >= 0)
+        close(_journalFd);
+}
+
+#pragma mark - Restore
+
+- (NSDictionary *)restoreState
+{
+    [self.markers removeAllObjects];
+    [self.tasks removeAllObjects];
+    self.recordCount = 0;
+
+    NSDictionary *snapshot = [NSDictionary dictionaryWithContentsOfFile:self.snapshotFile];
+    for (NSDictionary *taskInfo in snapshot[OBFileTransferStoreTasksKey])
+    {
+        [self putTask:taskInfo];
+    }
+
+    [self replayJournal];
+
+    return [self state];
+}
+
+- (void)replayJournal
+{
+    NSData *journal = [NSData dataWithContentsOfFile:self.journalFile options:NSDataReadingMappedIfSafe error:nil];
+    const uint8_t *bytes = journal.bytes;
+    NSUInteger offset = 0;
+
+    while (offset + sizeof(uint32_t) <= journal.length)
+    {
+        uint32_t length;
+        memcpy(&length, bytes + offset, sizeof(length));
+        length = CFSwapInt32BigToHost(length);
+        if (offset + sizeof(uint32_t) + length > journal.length)
+            break;
+
+        NSData *payload = [NSData dataWithBytesNoCopy:(void *)(bytes + offset + sizeof(uint32_t))
+                                               length:length
+                                         freeWhenDone:NO];
+        NSDictionary *record = [NSPropertyListSerialization propertyListWithData:payload
+                                                                         options:NSPropertyListImmutable
+                                                                          format:NULL
+                                                                           error:nil];
+        if (![record isKindOfClass:[NSDictionary class]])
+            break;
+
+        [self applyRecord:record];
+        self.recordCount++;
+        offset += sizeof(uint32_t) + length;
+    }
+
+    if (offset < journal.length)
+    {
+        OB_WARN(@"Dropping %lu bytes of incomplete records at the end of the tasks journal", (unsigned long)(journal.length - offset));
+        truncate([self.journalFile fileSystemRepresentation], (off_t)offset);
+    }
+    OB_DEBUG(@"Replayed %lu tasks journal records", (unsigned long)self.recordCount);
+}
+
+#pragma mark - Append
+
+- (void)saveTasks:(NSArray *)taskDictionaries
+{
+    for (NSDictionary *taskDictionary in taskDictionaries)
+    {
+        [self appendRecord:@{OBJournalOpKey : OBJournalOpPut, OBJournalTaskKey : taskDictionary}];
+    }
+}
+
+- (void)removeTasksWithMarkers:(NSArray *)markers
+{
+    for (NSString *marker in markers)
+    {
+        [self appendRecord:@{OBJournalOpKey : OBJournalOpRemove, OBJournalMarkerKey : marker}];
+    }
+}
+
+- (void)resetRetries
+{
+    [self appendRecord:@{OBJournalOpKey : OBJournalOpResetRetries}];
+}
+
+- (void)reset
+{
+    [self applyRecord:@{OBJournalOpKey : OBJournalOpReset}];
+    // Nothing before a reset is worth replaying so just start over with an empty snapshot
+    [self compact];
+}
+
+- (void)appendRecord:(NSDictionary *)record
+{
+    [self applyRecord:record];
+
+    NSError *error;
+    NSData *payload = [NSPropertyListSerialization dataWithPropertyList:record
+                                                                 format:NSPropertyListBinaryFormat_v1_0
+                                                                options:0
+                                                                  error:&error];
+    if (payload == nil)
+    {
+        OB_ERROR(@"Unable to serialize tasks journal record: %@", error.localizedDescription);
+        return;
+    }
+
+    uint32_t length = CFSwapInt32HostToBig((uint32_t)payload.length);
+    NSMutableData *frame = [NSMutableData dataWithCapacity:sizeof(length) + payload.length];
+    [frame appendBytes:&length length:sizeof(length)];
+    [frame appendData:payload];
+
+    if (![self writeToJournal:frame])
+    {
+        OB_ERROR(@"Could not append to tasks journal %@, compacting instead", self.journalFile);
+        [self compact];
+        return;
+    }
+
+    self.recordCount++;
+    if (self.recordCount >= MAX(self.compactionThreshold, 2 * self.markers.count))
+        [self compact];
+}
+
+- (BOOL)writeToJournal:(NSData *)data
+{
+    if (_journalFd < 0)
+    {
+        _journalFd = open([self.journalFile fileSystemRepresentation], O_WRONLY | O_APPEND | O_CREAT, 0644);
+        if (_journalFd < 0)
+            return NO;
+    }
+
+    const uint8_t *bytes = data.bytes;
+    NSUInteger remaining = data.length;
+    while (remaining > 0)
+    {
+        ssize_t written = write(_journalFd, bytes, remaining);
+        if (written < 0)
+        {
+            close(_journalFd);
+            _journalFd = -1;
+            return NO;
+        }
+        bytes += written;
+        remaining -= (NSUInteger)written;
+    }
+    return YES;
+}
+
+#pragma mark - Compaction
+
+- (void)compact
+{
+    NSDictionary *state = [self state];
+    if (![state writeToFile:self.snapshotFile atomically:YES])
+    {
+        OB_ERROR(@"Could not save tasks snapshot to %@", self.snapshotFile);
+        return;
+    }
+
+    // The snapshot now covers everything in the journal.  If we die before the truncate, replaying the
+    // journal on top of the snapshot is harmless because every record is idempotent.
+    if (_journalFd >= 0)
+    {
+        ftruncate(_journalFd, 0);
+    }
+    else
+    {
+        truncate([self.journalFile fileSystemRepresentation], 0);
+    }
+    OB_DEBUG(@"Compacted tasks journal of %lu records into snapshot of %lu tasks", (unsigned long)self.recordCount, (unsigned long)self.markers.count);
+    self.recordCount = 0;
+}
+
+#pragma mark - State
+
+- (void)applyRecord:(NSDictionary *)record
+{
+    NSString *op = record[OBJournalOpKey];
+    if ([op isEqualToString:OBJournalOpPut])
+    {
+        [self putTask:record[OBJournalTaskKey]];
+    }
+    else if ([op isEqualToString:OBJournalOpRemove])
+    {
+        [self.markers removeObject:record[OBJournalMarkerKey]];
+        [self.tasks removeObjectForKey:record[OBJournalMarkerKey]];
+    }
+    else if ([op isEqualToString:OBJournalOpResetRetries])
+    {
+        for (NSString *marker in self.markers)
+        {
+            NSMutableDictionary *taskInfo = [self.tasks[marker] mutableCopy];
+            taskInfo[AttemptsKey] = @0;
+            [taskInfo removeObjectForKey:NextAttemptAtKey];
+            self.tasks[marker] = taskInfo;
+        }
+    }
+    else if ([op isEqualToString:OBJournalOpReset])
+    {
+        [self.markers removeAllObjects];
+        [self.tasks removeAllObjects];
+    }
+    else
+    {
+        OB_WARN(@"Ignoring unknown tasks journal record %@", op);
+    }
+}
+
+- (void)putTask:(NSDictionary *)taskInfo
+{
+    NSString *marker = taskInfo[MarkerKey];
+    if (marker == nil)
+        return;
+    [self.markers addObject:marker];
+    self.tasks[marker] = taskInfo;
+}
+
+- (NSDictionary *)state
+{
+    NSMutableArray *tasks = [NSMutableArray arrayWithCapacity:self.markers.count];
+    for (NSString *marker in self.markers)
+    {
+        [tasks addObject:self.tasks[marker]];
+    }
+    return @{OBFileTransferStoreTasksKey : tasks};
+}
+
+@end
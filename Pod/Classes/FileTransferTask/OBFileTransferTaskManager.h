@@ -8,11 +8,19 @@
 
 #import <Foundation/Foundation.h>
 #import "OBFileTransferTask.h"
+#import "OBFileTransferTaskStore.h"
 
 @interface OBFileTransferTaskManager : NSObject
 
+// Select the persistence used for the tasks, e.g. [OBFileTransferTaskSQLiteStore class].  Must be called before the
+// first call to instance.  Default: OBFileTransferTaskJournal
++ (void)setStoreClass:(Class)storeClass;
+
 + (instancetype)instance;
 
+// A manager of its own, persisting under basePath rather than where instance does, e.g. for tests
+- (instancetype)initWithStateBasePath:(NSString *)basePath;
+
 - (OBFileTransferTask *)trackUploadTo:(NSString *)remoteUrl
                          fromFilePath:(NSString *)filePath
                            withMarker:(NSString *)marker
@@ -23,6 +31,11 @@
                                withMarker:(NSString *)marker
                                withParams:(NSDictionary *)params;
 
+// Track a batch of transfers at once, replacing those with the same markers.  Each entry has MarkerKey, RemoteUrlKey,
+// LocalFilePathKey and optionally ParamsKey and PriorityKey.  The tasks start out FileTransferQueued and are indexed,
+// published and persisted together.  Returns them in the order of the entries.
+- (NSArray *)trackTransfers:(NSArray *)transfers upload:(BOOL)upload;
+
 - (NSString *)markerForNSTask:(NSURLSessionTask *)task;
 
 - (OBFileTransferTask *)transferTaskForNSTask:(NSURLSessionTask *)task;
@@ -33,18 +46,41 @@
 
 - (void)removeTaskWithMarker:(NSString *)marker;
 
-- (void)updateRetryTimerCount;
-
-- (void)resetRetryTimerCount;
+// Stop tracking all of them at once
+- (void)removeTasks:(NSArray *)tasks;
 
 // Reset all the retry history for all pending tasks
 - (void)resetRetries;
 
-- (void)queueForRetry:(OBFileTransferTask *)obTask;
+- (void)queueForRetry:(OBFileTransferTask *)obTask at:(NSDate *)nextAttemptAt;
 
 // Change the task state
 - (void)processing:(OBFileTransferTask *)obTask withNsTask:(NSURLSessionTask *)nsTask;
 
+// nil once it was used
+- (void)update:(OBFileTransferTask *)obTask withResumeData:(NSData *)resumeData;
+
+- (void)update:(OBFileTransferTask *)obTask withPriority:(NSInteger)priority;
+
+// Unless it is empty, the hash also goes into the metadata in the params, which carry it along to the file store
+- (void)update:(OBFileTransferTask *)obTask withContentHash:(NSString *)contentHash;
+
+// nil once the download is no longer attached to another one
+- (void)update:(OBFileTransferTask *)obTask withLeaderMarker:(NSString *)leaderMarker;
+
+// Associate the nsTask with a task that is already in progress, without counting another attempt
+- (void)update:(OBFileTransferTask *)obTask withNsTask:(NSURLSessionTask *)nsTask;
+
+// A chunked upload or segmented download has an nsTask for each chunk in flight, which all map to the one task
+- (void)processing:(OBFileTransferTask *)obTask withChunkNsTask:(NSURLSessionTask *)nsTask chunk:(NSInteger)chunkNumber;
+
+- (void)finishedChunkNsTask:(NSUInteger)nsTaskIdentifier ofTask:(OBFileTransferTask *)obTask;
+
+// Persist the chunk receipts as well as the upload id, validator and sizes
+- (void)update:(OBFileTransferTask *)obTask withChunkReceipts:(NSDictionary *)receipts;
+
+- (void)update:(OBFileTransferTask *)obTask withReceipt:(NSString *)receipt forChunk:(NSInteger)chunkNumber;
+
 - (void)update:(OBFileTransferTask *)obTask withStatus:(OBFileTransferTaskStatus)status;
 
 - (void)update:(OBFileTransferTask *)obTask withLocalFilePath:(NSString *)localFilePath;
@@ -53,16 +89,32 @@
 
 - (void)restoreState;
 
+// Write any changes that have not been persisted yet.  Changes are otherwise persisted in batches.
+- (void)flush;
+
 - (NSArray *)currentState;
 
+// Waiting for a retry or for their turn
 - (NSArray *)pendingTasks;
 
 - (NSArray *)processingTasks;
 
+- (NSArray *)tasksWithStatus:(OBFileTransferTaskStatus)status;
+
+// These are maintained as tasks change status, so they are cheap
+- (NSUInteger)countOfTasksWithStatus:(OBFileTransferTaskStatus)status upload:(BOOL)upload;
+
+- (NSUInteger)pendingTaskCount;
+
 - (NSArray *)allTasks;
 
-//This is a bit of a hack, put here because it makes it easier to perist.  However, the task manager is not responsible
-//for the retry timer, so it's just storing this value for its client.
-@property (nonatomic) NSInteger retryTimerCount;
+// For callers that want e.g. the pending uploads to a given host.  A store that can answer the query itself (see
+// OBFileTransferTaskStore) is asked, so not every task is gone through.  A nil host matches all hosts.
+- (NSArray *)storedTasksWithStatus:(OBFileTransferTaskStatus)status upload:(BOOL)upload host:(NSString *)hostOrNil;
+
+// Changes are persisted at most persistDelay seconds after they are made, or as soon as persistBatchSize
+// tasks have changed.  Defaults: 1 second, 100 tasks.
+@property (nonatomic) NSTimeInterval persistDelay;
+@property (nonatomic) NSUInteger persistBatchSize;
 
 @end
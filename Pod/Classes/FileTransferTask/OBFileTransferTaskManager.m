@@ -7,17 +7,226 @@
 //
 
 #import "OBFileTransferTaskManager.h"
+#import "OBFileTransferTaskJournal.h"
+#import "OBFileTransferAgent.h"
 #import <OBLogger/OBLogger.h>
+#import <pthread.h>
+
+#define TASK_INDEX_SHARD_COUNT 64
+
+// Immutable view of an OBFileTransferTaskIndex, which is what readers get.  Consecutive views share the shards that
+// didn't change in between.
+@interface OBFileTransferTaskIndexView : NSObject
+@property (nonatomic, strong, readonly) NSArray *shards;
+@property (nonatomic, readonly) NSUInteger count;
+// Worked out on first use, the view never changes
+@property (atomic, strong) NSArray *sortedTasks;
+
+- (instancetype)initWithShards:(NSArray *)shards count:(NSUInteger)count;
+- (id)objectForKey:(id)key;
+// Oldest first
+- (NSArray *)tasks;
+@end
+
+@implementation OBFileTransferTaskIndexView
+
+- (instancetype)initWithShards:(NSArray *)shards count:(NSUInteger)count
+{
+    self = [super init];
+    if (self)
+    {
+        _shards = shards;
+        _count = count;
+    }
+    return self;
+}
+
+- (id)objectForKey:(id)key
+{
+    return self.shards[[key hash] % TASK_INDEX_SHARD_COUNT][key];
+}
+
+- (NSArray *)tasks
+{
+    NSArray *tasks = self.sortedTasks;
+    if (tasks == nil)
+    {
+        NSMutableArray *unsorted = [NSMutableArray arrayWithCapacity:self.count];
+        for (NSDictionary *shard in self.shards)
+        {
+            [unsorted addObjectsFromArray:[shard allValues]];
+        }
+        tasks = [unsorted sortedArrayWithOptions:NSSortStable usingComparator:^NSComparisonResult(OBFileTransferTask *a, OBFileTransferTask *b) {
+            return [a.createdOn compare:b.createdOn];
+        }];
+        self.sortedTasks = tasks;
+    }
+    return tasks;
+}
+
+@end
+
+// Tasks by some key, e.g. their marker.  Writers change the index under the tasks lock and take a view of it when
+// they are done.  The entries are spread over shards by the hash of their key, and a view only copies the shards that
+// changed since the last one, so a change costs a copy of a shard rather than of the whole index.
+@interface OBFileTransferTaskIndex : NSObject
+@property (nonatomic, readonly) NSUInteger count;
+
+- (id)objectForKey:(id)key;
+- (void)setObject:(OBFileTransferTask *)task forKey:(id)key;
+- (void)removeObjectForKey:(id)key;
+- (void)removeAllObjects;
+// The last view if nothing changed since
+- (OBFileTransferTaskIndexView *)view;
+@end
+
+@interface OBFileTransferTaskIndex ()
+@property (nonatomic, strong) NSArray *shards;
+@property (nonatomic, strong) NSMutableIndexSet *changedShards;
+@property (nonatomic, strong) OBFileTransferTaskIndexView *lastView;
+@property (nonatomic, readwrite) NSUInteger count;
+@end
+
+@implementation OBFileTransferTaskIndex
+
+- (instancetype)init
+{
+    self = [super init];
+    if (self)
+    {
+        NSMutableArray *shards = [NSMutableArray arrayWithCapacity:TASK_INDEX_SHARD_COUNT];
+        NSMutableArray *emptyShards = [NSMutableArray arrayWithCapacity:TASK_INDEX_SHARD_COUNT];
+        for (NSUInteger i = 0; i < TASK_INDEX_SHARD_COUNT; i++)
+        {
+            [shards addObject:[NSMutableDictionary new]];
+            [emptyShards addObject:@{}];
+        }
+        _shards = shards;
+        _changedShards = [NSMutableIndexSet new];
+        _lastView = [[OBFileTransferTaskIndexView alloc] initWithShards:emptyShards count:0];
+    }
+    return self;
+}
+
+- (NSUInteger)shardIndexForKey:(id)key
+{
+    return [key hash] % TASK_INDEX_SHARD_COUNT;
+}
+
+- (id)objectForKey:(id)key
+{
+    return self.shards[[self shardIndexForKey:key]][key];
+}
+
+- (void)setObject:(OBFileTransferTask *)task forKey:(id)key
+{
+    NSUInteger shardIndex = [self shardIndexForKey:key];
+    NSMutableDictionary *shard = self.shards[shardIndex];
+    if (shard[key] == task)
+        return;
+    if (shard[key] == nil)
+        self.count++;
+    shard[key] = task;
+    [self.changedShards addIndex:shardIndex];
+}
+
+- (void)removeObjectForKey:(id)key
+{
+    NSUInteger shardIndex = [self shardIndexForKey:key];
+    NSMutableDictionary *shard = self.shards[shardIndex];
+    if (shard[key] == nil)
+        return;
+    [shard removeObjectForKey:key];
+    self.count--;
+    [self.changedShards addIndex:shardIndex];
+}
+
+- (void)removeAllObjects
+{
+    [self.shards enumerateObjectsUsingBlock:^(NSMutableDictionary *shard, NSUInteger shardIndex, BOOL *stop) {
+        if (shard.count == 0)
+            return;
+        [shard removeAllObjects];
+        [self.changedShards addIndex:shardIndex];
+    }];
+    self.count = 0;
+}
+
+- (OBFileTransferTaskIndexView *)view
+{
+    if (self.changedShards.count == 0)
+        return self.lastView;
+    NSMutableArray *shards = [self.lastView.shards mutableCopy];
+    [self.changedShards enumerateIndexesUsingBlock:^(NSUInteger shardIndex, BOOL *stop) {
+        shards[shardIndex] = [self.shards[shardIndex] copy];
+    }];
+    [self.changedShards removeAllIndexes];
+    self.lastView = [[OBFileTransferTaskIndexView alloc] initWithShards:shards.copy count:self.count];
+    return self.lastView;
+}
+
+@end
+
+// What readers see of the tracked tasks.  Writers publish a new one as they release the tasks lock, and readers get the
+// current one without locking, as it never changes.
+@interface OBFileTransferTaskSnapshot : NSObject
+@property (nonatomic, strong, readonly) OBFileTransferTaskIndexView *tasksByMarker;
+@property (nonatomic, strong, readonly) OBFileTransferTaskIndexView *tasksByNsTaskIdentifier;
+// bucket key -> OBFileTransferTaskIndexView
+@property (nonatomic, strong, readonly) NSDictionary *tasksByStatus;
+
+- (instancetype)initWithTasksByMarker:(OBFileTransferTaskIndexView *)tasksByMarker
+              tasksByNsTaskIdentifier:(OBFileTransferTaskIndexView *)tasksByNsTaskIdentifier
+                        tasksByStatus:(NSDictionary *)tasksByStatus;
+@end
+
+@implementation OBFileTransferTaskSnapshot
+
+- (instancetype)initWithTasksByMarker:(OBFileTransferTaskIndexView *)tasksByMarker
+              tasksByNsTaskIdentifier:(OBFileTransferTaskIndexView *)tasksByNsTaskIdentifier
+                        tasksByStatus:(NSDictionary *)tasksByStatus
+{
+    self = [super init];
+    if (self)
+    {
+        _tasksByMarker = tasksByMarker;
+        _tasksByNsTaskIdentifier = tasksByNsTaskIdentifier;
+        _tasksByStatus = tasksByStatus;
+    }
+    return self;
+}
+
+@end
 
 @interface OBFileTransferTaskManager ()
-@property (nonatomic, strong) NSMutableArray *tasks;
-@property (strong) NSLock *arrayLock;
+{
+    // Only writers take it
+    pthread_mutex_t _tasksLock;
+}
+// The indexes below are only touched under tasksLock.  Tasks are tracked by marker, a task without one isn't tracked.
+@property (nonatomic, strong) OBFileTransferTaskIndex *tasksByMarker;
+@property (nonatomic, strong) OBFileTransferTaskIndex *tasksByNsTaskIdentifier;
+// Tasks bucketed by status and direction (see bucketKeyForStatus:upload:), each bucket an index by marker.  Tasks move
+// between buckets when their status changes, so the bucket sizes are the per status counts.
+@property (nonatomic, strong) NSMutableDictionary *tasksByStatus;
+// Atomic so a reader always gets a whole snapshot even while it is being replaced
+@property (atomic, strong) OBFileTransferTaskSnapshot *snapshot;
+@property (nonatomic, strong) NSString *customStateBasePath;
+@property (nonatomic, strong) id <OBFileTransferTaskStore> store;
+// These are only touched on myQueue
+@property (nonatomic, strong) NSMutableDictionary *dirtyTasks;
+@property (nonatomic, strong) NSMutableSet *removedMarkers;
+@property (nonatomic) BOOL flushScheduled;
 @end
 
+NSString *const OBFileTransferStoreTasksKey = @"tasks";
+
 @implementation OBFileTransferTaskManager
 static dispatch_queue_t myQueue;
+static Class storeClass;
 
-@synthesize arrayLock = _arrayLock;
+#define DEFAULT_PERSIST_DELAY 1.0
+#define DEFAULT_PERSIST_BATCH_SIZE 100
 
 + (instancetype)instance
 {
@@ -25,17 +234,49 @@ static dispatch_queue_t myQueue;
     static OBFileTransferTaskManager *instance = nil;
     dispatch_once(&obfttmOnceToken, ^{
         instance = [[self alloc] init];
-        myQueue = dispatch_queue_create("OBFileTransferTaskManagerQueue", NULL);
         [instance initialize];
     });
     return instance;
 }
 
+- (instancetype)initWithStateBasePath:(NSString *)basePath
+{
+    self = [super init];
+    if (self)
+    {
+        _customStateBasePath = basePath;
+        [self initialize];
+    }
+    return self;
+}
+
++ (void)setStoreClass:(Class)aStoreClass
+{
+    NSAssert([aStoreClass conformsToProtocol:@protocol(OBFileTransferTaskStore)], @"%@ is not an OBFileTransferTaskStore", aStoreClass);
+    storeClass = aStoreClass;
+}
+
 // Call this to initialize the state variables
 - (void)initialize
 {
-    _arrayLock = [NSLock new];
-    _tasks = [[NSMutableArray alloc] init];
+    static dispatch_once_t queueOnceToken;
+    dispatch_once(&queueOnceToken, ^{
+        myQueue = dispatch_queue_create("OBFileTransferTaskManagerQueue", NULL);
+    });
+    pthread_mutex_init(&_tasksLock, NULL);
+    _tasksByMarker = [OBFileTransferTaskIndex new];
+    _tasksByNsTaskIdentifier = [OBFileTransferTaskIndex new];
+    _tasksByStatus = [NSMutableDictionary new];
+    _snapshot = [[OBFileTransferTaskSnapshot alloc] initWithTasksByMarker:[_tasksByMarker view]
+                                                  tasksByNsTaskIdentifier:[_tasksByNsTaskIdentifier view]
+                                                            tasksByStatus:@{}];
+    _dirtyTasks = [NSMutableDictionary new];
+    _removedMarkers = [NSMutableSet new];
+    _persistDelay = DEFAULT_PERSIST_DELAY;
+    _persistBatchSize = DEFAULT_PERSIST_BATCH_SIZE;
+    Class aStoreClass = storeClass != nil ? storeClass : [OBFileTransferTaskJournal class];
+    _store = [[aStoreClass alloc] initWithBasePath:self.stateBasePath];
+    OB_INFO(@"Persisting transfer tasks with %@", NSStringFromClass(aStoreClass));
     [self restoreState];
 }
 
@@ -43,11 +284,12 @@ static dispatch_queue_t myQueue;
 - (void)reset
 {
     OB_DEBUG(@"Resetting OB Tasks state");
-    [_arrayLock lock];
-    [self.tasks removeAllObjects];
-    self.retryTimerCount = 0;
-    [_arrayLock unlock];
-    [self saveState];
+    [self removeAllTasks];
+    dispatch_async(myQueue, ^{
+        [self.dirtyTasks removeAllObjects];
+        [self.removedMarkers removeAllObjects];
+        [self.store reset];
+    });
 }
 
 // Warning: do not provide the same nsTask with a different marker, or vice versa
@@ -91,6 +333,43 @@ static dispatch_queue_t myQueue;
     return obTask;
 }
 
+- (NSArray *)trackTransfers:(NSArray *)transfers upload:(BOOL)upload
+{
+    NSMutableArray *obTasks = [NSMutableArray arrayWithCapacity:transfers.count];
+    for (NSDictionary *transfer in transfers)
+    {
+        OBFileTransferTask *obTask = [[OBFileTransferTask alloc] init];
+        obTask.marker = transfer[MarkerKey];
+        obTask.typeUpload = upload;
+        obTask.localFilePath = transfer[LocalFilePathKey];
+        obTask.remoteUrl = transfer[RemoteUrlKey];
+        obTask.status = FileTransferQueued;
+        obTask.params = transfer[ParamsKey];
+        obTask.priority = [transfer[PriorityKey] integerValue];
+        [obTasks addObject:obTask];
+    }
+
+    [self lockTasks];
+    for (OBFileTransferTask *obTask in obTasks)
+    {
+        OBFileTransferTask *replaced = [self.tasksByMarker objectForKey:obTask.marker];
+        if (replaced != nil)
+            [self deleteTask:replaced];
+        [self insertTask:obTask];
+    }
+    [self unlockTasks];
+
+    dispatch_async(myQueue, ^{
+        for (OBFileTransferTask *obTask in obTasks)
+        {
+            [self.removedMarkers removeObject:obTask.marker];
+            self.dirtyTasks[obTask.marker] = obTask;
+        }
+        [self flushDirty];
+    });
+    return obTasks;
+}
+
 - (NSArray *)currentState
 {
     NSMutableArray *taskStates = [NSMutableArray new];
@@ -115,6 +394,9 @@ static dispatch_queue_t myQueue;
             case FileTransferPendingRetry:
                 statusStr = @"W";
                 break;
+            case FileTransferQueued:
+                statusStr = @"Q";
+                break;
             case FileTransferDownloadFileReady:
                 statusStr = @"D";
                 break;
@@ -133,24 +415,39 @@ static dispatch_queue_t myQueue;
 
 - (NSArray *)processingTasks
 {
-    NSMutableArray *processing = [NSMutableArray new];
-    for (OBFileTransferTask *task in [self tasksCopy])
-    {
-        if (task.status == FileTransferInProgress)
-            [processing addObject:task];
-    }
-    return processing;
+    return [self tasksWithStatus:FileTransferInProgress];
 }
 
 - (NSArray *)pendingTasks
 {
-    NSMutableArray *pending = [NSMutableArray new];
-    for (OBFileTransferTask *task in [self tasksCopy])
-    {
-        if (task.status == FileTransferPendingRetry)
-            [pending addObject:task];
-    }
-    return pending;
+    return [[self tasksWithStatus:FileTransferPendingRetry] arrayByAddingObjectsFromArray:[self tasksWithStatus:FileTransferQueued]];
+}
+
+// Only goes through the tasks that have the status
+- (NSArray *)tasksWithStatus:(OBFileTransferTaskStatus)status
+{
+    NSDictionary *buckets = self.snapshot.tasksByStatus;
+    NSArray *uploads = [buckets[[self bucketKeyForStatus:status upload:YES]] tasks];
+    NSArray *downloads = [buckets[[self bucketKeyForStatus:status upload:NO]] tasks];
+    if (downloads == nil)
+        return uploads != nil ? uploads : @[];
+    if (uploads == nil)
+        return downloads;
+    return [uploads arrayByAddingObjectsFromArray:downloads];
+}
+
+- (NSUInteger)countOfTasksWithStatus:(OBFileTransferTaskStatus)status upload:(BOOL)upload
+{
+    return [self.snapshot.tasksByStatus[[self bucketKeyForStatus:status upload:upload]] count];
+}
+
+// Same tasks as pendingTasks
+- (NSUInteger)pendingTaskCount
+{
+    return [self countOfTasksWithStatus:FileTransferPendingRetry upload:YES] +
+            [self countOfTasksWithStatus:FileTransferPendingRetry upload:NO] +
+            [self countOfTasksWithStatus:FileTransferQueued upload:YES] +
+            [self countOfTasksWithStatus:FileTransferQueued upload:NO];
 }
 
 - (NSArray *)allTasks
@@ -158,33 +455,179 @@ static dispatch_queue_t myQueue;
     return [self tasksCopy];
 }
 
-- (void)queueForRetry:(OBFileTransferTask *)obTask
+// Asks the store when it can answer the query itself, so we don't have to go through every task
+- (NSArray *)storedTasksWithStatus:(OBFileTransferTaskStatus)status upload:(BOOL)upload host:(NSString *)hostOrNil
+{
+    NSMutableArray *matching = [NSMutableArray new];
+    if (![self.store respondsToSelector:@selector(tasksWithStatus:upload:host:)])
+    {
+        NSArray *bucket = [self.snapshot.tasksByStatus[[self bucketKeyForStatus:status upload:upload]] tasks];
+        for (OBFileTransferTask *task in bucket)
+        {
+            if (hostOrNil == nil || [[task remoteHost] isEqualToString:[hostOrNil lowercaseString]])
+                [matching addObject:task];
+        }
+        return matching;
+    }
+
+    __block NSArray *taskInfos;
+    dispatch_sync(myQueue, ^{
+        // The store has to know about the changes that are still waiting for their flush
+        [self flushDirty];
+        taskInfos = [self.store tasksWithStatus:status upload:upload host:hostOrNil];
+    });
+    for (NSDictionary *taskInfo in taskInfos)
+    {
+        OBFileTransferTask *task = [self transferTaskWithMarker:taskInfo[MarkerKey]];
+        if (task != nil)
+            [matching addObject:task];
+    }
+    return matching;
+}
+
+- (void)queueForRetry:(OBFileTransferTask *)obTask at:(NSDate *)nextAttemptAt
 {
-    obTask.status = FileTransferPendingRetry;
-    [self saveState];
+    obTask.nextAttemptAt = nextAttemptAt;
+    [self setStatus:FileTransferPendingRetry ofTask:obTask];
+    [self saveTask:obTask];
 }
 
 - (void)processing:(OBFileTransferTask *)obTask withNsTask:(NSURLSessionTask *)nsTask
 {
-    obTask.status = FileTransferInProgress;
     obTask.attemptCount++;
+    obTask.nextAttemptAt = nil;
+    [self lockTasks];
+    [self moveTask:obTask toStatus:FileTransferInProgress];
+    [self unindexNsTaskIdentifierOfTask:obTask];
     obTask.nsTaskIdentifier = nsTask.taskIdentifier;
+    [self indexNsTaskIdentifierOfTask:obTask];
+    [self unlockTasks];
     OB_INFO(@"%@", obTask.description);
-    [self saveState];
+    [self saveTask:obTask];
+}
+
+- (void)update:(OBFileTransferTask *)obTask withResumeData:(NSData *)resumeData
+{
+    if (obTask.resumeData == resumeData)
+        return;
+    obTask.resumeData = resumeData;
+    [self saveTask:obTask];
+}
+
+- (void)update:(OBFileTransferTask *)obTask withPriority:(NSInteger)priority
+{
+    obTask.priority = priority;
+    [self saveTask:obTask];
+}
+
+- (void)update:(OBFileTransferTask *)obTask withContentHash:(NSString *)contentHash
+{
+    @synchronized (obTask)
+    {
+        obTask.contentHash = contentHash;
+        if (contentHash.length > 0)
+        {
+            // Others may be reading the params meanwhile, so they get a new dictionary rather than a changed one
+            NSMutableDictionary *params = [NSMutableDictionary dictionaryWithDictionary:obTask.params];
+            NSMutableDictionary *metadata = [NSMutableDictionary dictionaryWithDictionary:params[kOBFileTransferMetadataKey]];
+            metadata[OBFileTransferContentHashMetadataKey] = contentHash;
+            params[kOBFileTransferMetadataKey] = metadata;
+            obTask.params = params;
+        }
+    }
+    [self saveTask:obTask];
+}
+
+- (void)update:(OBFileTransferTask *)obTask withLeaderMarker:(NSString *)leaderMarker
+{
+    obTask.leaderMarker = leaderMarker;
+    [self saveTask:obTask];
+}
+
+- (void)update:(OBFileTransferTask *)obTask withNsTask:(NSURLSessionTask *)nsTask
+{
+    [self lockTasks];
+    [self unindexNsTaskIdentifierOfTask:obTask];
+    obTask.nsTaskIdentifier = nsTask.taskIdentifier;
+    [self indexNsTaskIdentifierOfTask:obTask];
+    [self unlockTasks];
+    [self saveTask:obTask];
+}
+
+- (void)processing:(OBFileTransferTask *)obTask withChunkNsTask:(NSURLSessionTask *)nsTask chunk:(NSInteger)chunkNumber
+{
+    @synchronized (obTask)
+    {
+        obTask.activeChunks[@(nsTask.taskIdentifier)] = @(chunkNumber);
+        obTask.chunkBytesTransferred[@(chunkNumber)] = @0;
+    }
+    [self lockTasks];
+    [self.tasksByNsTaskIdentifier setObject:obTask forKey:@(nsTask.taskIdentifier)];
+    BOOL tracked = [self.tasksByMarker objectForKey:obTask.marker] == obTask;
+    [self unlockTasks];
+    OB_DEBUG(@"Sending chunk %ld of %@ with task %lu", (long)chunkNumber, obTask.marker, (unsigned long)nsTask.taskIdentifier);
+    if (tracked)
+        [self saveTask:obTask];
+}
+
+- (void)finishedChunkNsTask:(NSUInteger)nsTaskIdentifier ofTask:(OBFileTransferTask *)obTask
+{
+    @synchronized (obTask)
+    {
+        NSNumber *chunkNumber = obTask.activeChunks[@(nsTaskIdentifier)];
+        if (chunkNumber != nil)
+            [obTask.chunkBytesTransferred removeObjectForKey:chunkNumber];
+        [obTask.activeChunks removeObjectForKey:@(nsTaskIdentifier)];
+    }
+    [self lockTasks];
+    if ([self.tasksByNsTaskIdentifier objectForKey:@(nsTaskIdentifier)] == obTask)
+    {
+        [self.tasksByNsTaskIdentifier removeObjectForKey:@(nsTaskIdentifier)];
+    }
+    // Not to bring back a task that was just removed
+    BOOL tracked = [self.tasksByMarker objectForKey:obTask.marker] == obTask;
+    [self unlockTasks];
+    if (tracked)
+        [self saveTask:obTask];
+}
+
+- (void)update:(OBFileTransferTask *)obTask withChunkReceipts:(NSDictionary *)receipts
+{
+    @synchronized (obTask)
+    {
+        [obTask.chunkReceipts setDictionary:receipts];
+    }
+    [self saveTask:obTask];
+}
+
+- (void)update:(OBFileTransferTask *)obTask withReceipt:(NSString *)receipt forChunk:(NSInteger)chunkNumber
+{
+    @synchronized (obTask)
+    {
+        obTask.chunkReceipts[@(chunkNumber)] = receipt;
+    }
+    [self saveTask:obTask];
 }
 
 // TODO - replace with KVO at some point
 - (void)update:(OBFileTransferTask *)obTask withStatus:(OBFileTransferTaskStatus)status
 {
-    obTask.status = status;
-    [self saveState];
+    [self setStatus:status ofTask:obTask];
+    [self saveTask:obTask];
+}
+
+- (void)setStatus:(OBFileTransferTaskStatus)status ofTask:(OBFileTransferTask *)obTask
+{
+    [self lockTasks];
+    [self moveTask:obTask toStatus:status];
+    [self unlockTasks];
 }
 
 // TODO - replace with KVO at some point
 - (void)update:(OBFileTransferTask *)obTask withLocalFilePath:(NSString *)localFilePath
 {
     obTask.localFilePath = localFilePath;
-    [self saveState];
+    [self saveTask:obTask];
 }
 
 // Finds a task which has the nsTask provided in the argument and returns its marker
@@ -207,68 +650,131 @@ static dispatch_queue_t myQueue;
 }
 
 
+// These are called for every progress callback, so they look in the snapshot, without locking
 - (OBFileTransferTask *)transferTaskForNSTask:(NSURLSessionTask *)nsTask
 {
-    for (OBFileTransferTask *task in [self tasksCopy])
-    {
-        if (task.nsTaskIdentifier == nsTask.taskIdentifier)
-            return task;
-    }
-    OB_DEBUG(@"Unable to find OB Task for NS Task with identifier %lu", (unsigned long)nsTask.taskIdentifier);
-    return nil;
+    OBFileTransferTask *task = [self.snapshot.tasksByNsTaskIdentifier objectForKey:@(nsTask.taskIdentifier)];
+    if (task == nil)
+        OB_DEBUG(@"Unable to find OB Task for NS Task with identifier %lu", (unsigned long)nsTask.taskIdentifier);
+    return task;
 }
 
 - (OBFileTransferTask *)transferTaskWithMarker:(NSString *)marker
 {
-    for (OBFileTransferTask *task in [self tasksCopy])
-    {
-        if ([task.marker isEqualToString:marker])
-            return task;
-    }
-//    OB_DEBUG(@"Unable to find OB Task for marker %@",marker);
-    return nil;
+    if (marker == nil)
+        return nil;
+    return [self.snapshot.tasksByMarker objectForKey:marker];
 }
 
 - (void)addTask:(OBFileTransferTask *)task
 {
-    [self.arrayLock lock];
-    [self.tasks addObject:task];
-    [self.arrayLock unlock];
-    [self saveState];
+    [self lockTasks];
+    [self insertTask:task];
+    [self unlockTasks];
+    [self saveTask:task];
 }
 
 - (void)removeTask:(OBFileTransferTask *)task
 {
     if (task != nil)
     {
-        [self.arrayLock lock];
-        [[self tasks] removeObject:task];
-        [self.arrayLock unlock];
-        [self saveState];
+        [self lockTasks];
+        [self deleteTask:task];
+        [self unlockTasks];
+        NSString *marker = task.marker;
+        dispatch_async(myQueue, ^{
+            if (marker == nil)
+                return;
+            [self.dirtyTasks removeObjectForKey:marker];
+            [self.removedMarkers addObject:marker];
+            [self scheduleFlush];
+        });
     }
 }
 
-// Save and restore the current state of the tasks in a thread-safe manner by using a serial queue
-// We want to make sure that saves occur chronologically, that a later thread doesnt save before a first thread
-- (void)saveState
+- (void)removeTasks:(NSArray *)tasks
 {
+    if (tasks.count == 0)
+        return;
+    NSMutableArray *markers = [NSMutableArray arrayWithCapacity:tasks.count];
+    [self lockTasks];
+    for (OBFileTransferTask *task in tasks)
+    {
+        [self deleteTask:task];
+        if (task.marker != nil && [self.tasksByMarker objectForKey:task.marker] == nil)
+            [markers addObject:task.marker];
+    }
+    [self unlockTasks];
     dispatch_async(myQueue, ^{
-        //    OB_DEBUG(@"Starting to save OBTasks state");
-        NSMutableArray *tasksToSave = [[NSMutableArray alloc] init];
-        for (OBFileTransferTask *task in [self tasksCopy])
-        {
-            [tasksToSave addObject:[task asDictionary]];
-        }
-        NSDictionary *stateDictionary = @{@"tasks" : tasksToSave, @"retryTimerCount" : [NSNumber numberWithInteger:self.retryTimerCount]};
-        BOOL wroteToFile = [stateDictionary writeToFile:self.statePlistFile atomically:YES];
-        if (!wroteToFile)
-        {
-            OB_ERROR(@"Could not save tasks to %@", self.statePlistFile);
-        }
-        else
+        for (NSString *marker in markers)
         {
-            OB_DEBUG(@"Saved %lu tracked tasks: %@", (unsigned long)tasksToSave.count, [self tasksSummary]);
+            [self.dirtyTasks removeObjectForKey:marker];
+            [self.removedMarkers addObject:marker];
         }
+        [self scheduleFlush];
+    });
+}
+
+// Save and restore the current state of the tasks in a thread-safe manner by using a serial queue
+// We want to make sure that saves occur chronologically, that a later thread doesnt save before a first thread
+// A change only marks the task dirty.  The dirty tasks are written to the store together once persistDelay has
+// elapsed or persistBatchSize tasks are dirty, whichever comes first, so a burst of changes costs a single write.
+- (void)saveTask:(OBFileTransferTask *)task
+{
+    dispatch_async(myQueue, ^{
+        if (task.marker == nil)
+            return;
+        [self.removedMarkers removeObject:task.marker];
+        self.dirtyTasks[task.marker] = task;
+        [self scheduleFlush];
+    });
+}
+
+// Only call on myQueue
+- (void)scheduleFlush
+{
+    if (self.dirtyTasks.count + self.removedMarkers.count >= self.persistBatchSize)
+    {
+        [self flushDirty];
+        return;
+    }
+    if (self.flushScheduled)
+        return;
+    self.flushScheduled = YES;
+    dispatch_after(dispatch_time(DISPATCH_TIME_NOW, (int64_t)(self.persistDelay * NSEC_PER_SEC)), myQueue, ^{
+        [self flushDirty];
+    });
+}
+
+// Only call on myQueue
+- (void)flushDirty
+{
+    self.flushScheduled = NO;
+    if (self.dirtyTasks.count == 0 && self.removedMarkers.count == 0)
+        return;
+
+    if (self.removedMarkers.count > 0)
+        [self.store removeTasksWithMarkers:[self.removedMarkers allObjects]];
+
+    NSMutableArray *taskInfos = [NSMutableArray arrayWithCapacity:self.dirtyTasks.count];
+    for (OBFileTransferTask *task in [self.dirtyTasks allValues])
+    {
+        [taskInfos addObject:[task asDictionary]];
+    }
+    if (taskInfos.count > 0)
+        [self.store saveTasks:taskInfos];
+
+    OB_DEBUG(@"Saved %lu changed and %lu removed tracked tasks", (unsigned long)taskInfos.count, (unsigned long)self.removedMarkers.count);
+    [self.dirtyTasks removeAllObjects];
+    [self.removedMarkers removeAllObjects];
+}
+
+// Write out any pending changes right away.  Call this when the app is about to be suspended, when the background
+// session finished its events, and whenever else losing the last persistDelay worth of changes would hurt.
+- (void)flush
+{
+    dispatch_sync(myQueue, ^{
+        [self flushDirty];
     });
 }
 
@@ -278,23 +784,19 @@ static dispatch_queue_t myQueue;
     @synchronized (self)
     {
         //    OB_DEBUG(@"Starting to restore OBTasks state");
-        NSDictionary *stateDictionary;
+        __block NSDictionary *stateDictionary;
         [self removeAllTasks];
-        if (![[NSFileManager defaultManager] fileExistsAtPath:self.statePlistFile])
-        {
-            OB_DEBUG(@"OBTasks file does not exist so saving current state");
-            [self saveState];
-        }
-        else
-        {
-            stateDictionary = [[NSMutableDictionary alloc] initWithContentsOfFile:self.statePlistFile];
-        }
-        self.retryTimerCount = [stateDictionary[@"retryTimerCount"] integerValue];
-        for (NSDictionary *taskInfo in stateDictionary[@"tasks"])
+        // Go through the queue so we don't read the store while a previous save is still being written
+        dispatch_sync(myQueue, ^{
+            stateDictionary = [self.store restoreState];
+        });
+        [self lockTasks];
+        for (NSDictionary *taskInfo in stateDictionary[OBFileTransferStoreTasksKey])
         {
-            [self.tasks addObject:[[OBFileTransferTask alloc] initFromDictionary:taskInfo]];
+            [self insertTask:[[OBFileTransferTask alloc] initFromDictionary:taskInfo]];
         }
-        OB_DEBUG(@"Restored %lu tracked tasks: %@", (unsigned long)self.tasks.count, [self tasksSummary]);
+        [self unlockTasks];
+        OB_DEBUG(@"Restored %lu tracked tasks: %@", (unsigned long)self.snapshot.tasksByMarker.count, [self tasksSummary]);
     }
 }
 
@@ -311,44 +813,164 @@ static dispatch_queue_t myQueue;
     return StatePlistFile;
 }
 
-- (void)updateRetryTimerCount
-{
-    self.retryTimerCount++;
-    [self saveState];
-}
-
-- (void)resetRetryTimerCount
+// The stores add their own extension(s) to this
+- (NSString *)stateBasePath
 {
-    self.retryTimerCount = 0;
-    [self saveState];
+    if (self.customStateBasePath != nil)
+        return self.customStateBasePath;
+    return [self.statePlistFile stringByDeletingPathExtension];
 }
 
 - (void)resetRetries
 {
-    [self.arrayLock lock];
-    for (OBFileTransferTask *task in self.tasks)
+    [self lockTasks];
+    for (OBFileTransferTask *task in [[self.tasksByMarker view] tasks])
     {
         task.attemptCount = 0;
+        task.nextAttemptAt = nil;
     }
-    self.retryTimerCount = 0;
-    [self.arrayLock unlock];
-    [self saveState];
+    [self unlockTasks];
+    dispatch_async(myQueue, ^{
+        [self flushDirty];
+        [self.store resetRetries];
+    });
 }
 
-// Create an immutable copy of the tasks array
+// The snapshot's array is already immutable, so there is nothing to copy
 - (NSArray *)tasksCopy
 {
-    [self.arrayLock lock];
-    NSArray *copy = [NSArray arrayWithArray:self.tasks];
-    [self.arrayLock unlock];
-    return copy;
+    return [self.snapshot.tasksByMarker tasks];
+}
+
+- (void)lockTasks
+{
+    pthread_mutex_lock(&_tasksLock);
+}
+
+// Publishes what the writer changed before letting the next one in
+- (void)unlockTasks
+{
+    [self publishSnapshot];
+    pthread_mutex_unlock(&_tasksLock);
 }
 
 - (void)removeAllTasks
 {
-    [self.arrayLock lock];
-    [self.tasks removeAllObjects];
-    [self.arrayLock unlock];
+    [self lockTasks];
+    [self.tasksByMarker removeAllObjects];
+    [self.tasksByNsTaskIdentifier removeAllObjects];
+    [self.tasksByStatus removeAllObjects];
+    [self unlockTasks];
 }
-@end
 
+// The following must be called with tasksLock held
+
+- (void)insertTask:(OBFileTransferTask *)task
+{
+    if (task.marker == nil)
+        return;
+    [self.tasksByMarker setObject:task forKey:task.marker];
+    [self indexNsTaskIdentifierOfTask:task];
+    // Restored tasks may have chunks in flight
+    NSArray *chunkNsTaskIdentifiers;
+    @synchronized (task)
+    {
+        chunkNsTaskIdentifiers = [task.activeChunks allKeys];
+    }
+    for (NSNumber *identifier in chunkNsTaskIdentifiers)
+    {
+        [self.tasksByNsTaskIdentifier setObject:task forKey:identifier];
+    }
+    [[self bucketForKey:[self bucketKeyForTask:task]] setObject:task forKey:task.marker];
+}
+
+- (void)deleteTask:(OBFileTransferTask *)task
+{
+    if (task.marker == nil || [self.tasksByMarker objectForKey:task.marker] != task)
+        return;
+    NSArray *chunkNsTaskIdentifiers;
+    @synchronized (task)
+    {
+        chunkNsTaskIdentifiers = [task.activeChunks allKeys];
+    }
+    for (NSNumber *identifier in chunkNsTaskIdentifiers)
+    {
+        if ([self.tasksByNsTaskIdentifier objectForKey:identifier] == task)
+            [self.tasksByNsTaskIdentifier removeObjectForKey:identifier];
+    }
+    [self.tasksByStatus[[self bucketKeyForTask:task]] removeObjectForKey:task.marker];
+    [self.tasksByMarker removeObjectForKey:task.marker];
+    [self unindexNsTaskIdentifierOfTask:task];
+}
+
+// Tasks we are no longer tracking just get the new status
+- (void)moveTask:(OBFileTransferTask *)task toStatus:(OBFileTransferTaskStatus)status
+{
+    if (task.status == status)
+        return;
+    BOOL tracked = task.marker != nil && [self.tasksByMarker objectForKey:task.marker] == task;
+    if (tracked)
+        [self.tasksByStatus[[self bucketKeyForTask:task]] removeObjectForKey:task.marker];
+    task.status = status;
+    if (tracked)
+        [[self bucketForKey:[self bucketKeyForTask:task]] setObject:task forKey:task.marker];
+}
+
+// Replace the snapshot with one reflecting the indexes.  Only the shards that changed are copied, nothing if nothing
+// changed.
+- (void)publishSnapshot
+{
+    OBFileTransferTaskSnapshot *current = self.snapshot;
+    OBFileTransferTaskIndexView *tasksByMarker = [self.tasksByMarker view];
+    OBFileTransferTaskIndexView *tasksByNsTaskIdentifier = [self.tasksByNsTaskIdentifier view];
+    NSMutableDictionary *tasksByStatus = [NSMutableDictionary dictionaryWithCapacity:self.tasksByStatus.count];
+    __block BOOL bucketsChanged = self.tasksByStatus.count != current.tasksByStatus.count;
+    [self.tasksByStatus enumerateKeysAndObjectsUsingBlock:^(NSNumber *key, OBFileTransferTaskIndex *bucket, BOOL *stop) {
+        tasksByStatus[key] = [bucket view];
+        bucketsChanged = bucketsChanged || tasksByStatus[key] != current.tasksByStatus[key];
+    }];
+    if (tasksByMarker == current.tasksByMarker && tasksByNsTaskIdentifier == current.tasksByNsTaskIdentifier && !bucketsChanged)
+        return;
+    self.snapshot = [[OBFileTransferTaskSnapshot alloc] initWithTasksByMarker:tasksByMarker
+                                                      tasksByNsTaskIdentifier:tasksByNsTaskIdentifier
+                                                                tasksByStatus:bucketsChanged ? tasksByStatus.copy : current.tasksByStatus];
+}
+
+- (OBFileTransferTaskIndex *)bucketForKey:(NSNumber *)key
+{
+    OBFileTransferTaskIndex *bucket = self.tasksByStatus[key];
+    if (bucket == nil)
+    {
+        bucket = [OBFileTransferTaskIndex new];
+        self.tasksByStatus[key] = bucket;
+    }
+    return bucket;
+}
+
+- (NSNumber *)bucketKeyForTask:(OBFileTransferTask *)task
+{
+    return [self bucketKeyForStatus:task.status upload:task.typeUpload];
+}
+
+- (NSNumber *)bucketKeyForStatus:(OBFileTransferTaskStatus)status upload:(BOOL)upload
+{
+    return @(status * 2 + (upload ? 1 : 0));
+}
+
+// A task without a session task of its own has identifier 0, e.g. a queued task or the parent of chunks, and isn't
+// indexed under it
+- (void)indexNsTaskIdentifierOfTask:(OBFileTransferTask *)task
+{
+    if (task.nsTaskIdentifier != 0)
+        [self.tasksByNsTaskIdentifier setObject:task forKey:@(task.nsTaskIdentifier)];
+}
+
+- (void)unindexNsTaskIdentifierOfTask:(OBFileTransferTask *)task
+{
+    if (task.nsTaskIdentifier == 0)
+        return;
+    NSNumber *identifier = @(task.nsTaskIdentifier);
+    if ([self.tasksByNsTaskIdentifier objectForKey:identifier] == task)
+        [self.tasksByNsTaskIdentifier removeObjectForKey:identifier];
+}
+@end
@@ -0,0 +1,17 @@
+//
+//  OBFileTransferTaskSQLiteStore.h
+//  Pods
+//
+//  Created by etcetc on 10/17/26.
+//
+//
+
+#import <Foundation/Foundation.h>
+#import "OBFileTransferTaskStore.h"
+
+// Task store backed by an SQLite database at basePath.sqlite.
+// Each task is a row indexed by marker, nsTaskIdentifier, status, direction and remote host, so an update only
+// rewrites the rows that changed and queries such as "pending uploads to host X" don't need to load every task.
+@interface OBFileTransferTaskSQLiteStore : NSObject <OBFileTransferTaskStore>
+
+@end
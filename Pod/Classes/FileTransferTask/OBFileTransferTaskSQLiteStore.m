@@ -0,0 +1,232 @@
+//
+//  OBFileTransferTaskSQLiteStore.m
+//  Pods
+//
+//  Created by etcetc on 10/17/26.
+//
+//  The full task dictionary is kept as a binary plist in the info column.  The other columns are copies of
+//  the fields we want to look tasks up by, except attempts and next_attempt_at which override the ones in info, so
+//  resetting the retries is a single UPDATE.
+//
+
+#import "OBFileTransferTaskSQLiteStore.h"
+#import <OBLogger/OBLogger.h>
+#import <sqlite3.h>
+
+
+@interface OBFileTransferTaskSQLiteStore ()
+{
+    sqlite3 *_db;
+    sqlite3_stmt *_upsertStatement;
+    sqlite3_stmt *_deleteStatement;
+}
+@property (nonatomic, strong) NSString *databaseFile;
+@end
+
+@implementation OBFileTransferTaskSQLiteStore
+
+- (instancetype)initWithBasePath:(NSString *)basePath
+{
+    self = [super init];
+    if (self)
+    {
+        _databaseFile = [basePath stringByAppendingPathExtension:@"sqlite"];
+        [self openDatabase];
+    }
+    return self;
+}
+
+- (void)dealloc
+{
+    sqlite3_finalize(_upsertStatement);
+    sqlite3_finalize(_deleteStatement);
+    sqlite3_close(_db);
+}
+
+#pragma mark - Setup
+
+- (void)openDatabase
+{
+    if (sqlite3_open([self.databaseFile fileSystemRepresentation], &_db) != SQLITE_OK)
+    {
+        OB_ERROR(@"Unable to open tasks database %@: %s", self.databaseFile, sqlite3_errmsg(_db));
+        sqlite3_close(_db);
+        _db = NULL;
+        return;
+    }
+
+    [self execute:@"PRAGMA journal_mode=WAL"];
+    [self execute:@"PRAGMA synchronous=NORMAL"];
+    [self execute:@"CREATE TABLE IF NOT EXISTS tasks ("
+            "marker TEXT PRIMARY KEY NOT NULL, "
+            "ns_task_identifier INTEGER, "
+            "status INTEGER, "
+            "upload INTEGER, "
+            "remote_host TEXT, "
+            "created_on REAL, "
+            "info BLOB NOT NULL, "
+            "attempts INTEGER NOT NULL DEFAULT 0, "
+            "next_attempt_at REAL)"];
+    [self execute:@"CREATE INDEX IF NOT EXISTS tasks_ns_task_identifier ON tasks (ns_task_identifier)"];
+    [self execute:@"CREATE INDEX IF NOT EXISTS tasks_status_direction_host ON tasks (status, upload, remote_host)"];
+
+    _upsertStatement = [self prepare:@"INSERT OR REPLACE INTO tasks "
+            "(marker, ns_task_identifier, status, upload, remote_host, created_on, info, attempts, next_attempt_at) "
+            "VALUES (?, ?, ?, ?, ?, ?, ?, ?, ?)"];
+    _deleteStatement = [self prepare:@"DELETE FROM tasks WHERE marker = ?"];
+}
+
+- (BOOL)execute:(NSString *)sql
+{
+    char *message = NULL;
+    if (sqlite3_exec(_db, [sql UTF8String], NULL, NULL, &message) != SQLITE_OK)
+    {
+        OB_ERROR(@"Tasks database error '%s' executing %@", message, sql);
+        sqlite3_free(message);
+        return NO;
+    }
+    return YES;
+}
+
+- (sqlite3_stmt *)prepare:(NSString *)sql
+{
+    sqlite3_stmt *statement = NULL;
+    if (sqlite3_prepare_v2(_db, [sql UTF8String], -1, &statement, NULL) != SQLITE_OK)
+    {
+        OB_ERROR(@"Tasks database error '%s' preparing %@", sqlite3_errmsg(_db), sql);
+        return NULL;
+    }
+    return statement;
+}
+
+#pragma mark - OBFileTransferTaskStore
+
+- (NSDictionary *)restoreState
+{
+    return @{OBFileTransferStoreTasksKey : [self tasksWhere:nil bind:nil]};
+}
+
+- (void)saveTasks:(NSArray *)taskDictionaries
+{
+    if (_db == NULL || taskDictionaries.count == 0)
+        return;
+
+    [self execute:@"BEGIN IMMEDIATE TRANSACTION"];
+    for (NSDictionary *taskInfo in taskDictionaries)
+    {
+        NSError *error;
+        NSData *info = [NSPropertyListSerialization dataWithPropertyList:taskInfo
+                                                                  format:NSPropertyListBinaryFormat_v1_0
+                                                                 options:0
+                                                                   error:&error];
+        if (info == nil)
+        {
+            OB_ERROR(@"Unable to serialize task %@: %@", taskInfo[MarkerKey], error.localizedDescription);
+            continue;
+        }
+
+        sqlite3_stmt *statement = _upsertStatement;
+        sqlite3_bind_text(statement, 1, [taskInfo[MarkerKey] UTF8String], -1, SQLITE_TRANSIENT);
+        sqlite3_bind_int64(statement, 2, [taskInfo[NSTaskIdentifierKey] longLongValue]);
+        sqlite3_bind_int64(statement, 3, [taskInfo[StatusKey] longLongValue]);
+        sqlite3_bind_int(statement, 4, [taskInfo[TypeUploadKey] boolValue] ? 1 : 0);
+        NSString *host = [OBFileTransferTask hostForRemoteUrl:taskInfo[RemoteUrlKey]];
+        if (host != nil)
+            sqlite3_bind_text(statement, 5, [host UTF8String], -1, SQLITE_TRANSIENT);
+        else
+            sqlite3_bind_null(statement, 5);
+        sqlite3_bind_double(statement, 6, [taskInfo[CreatedOnKey] timeIntervalSince1970]);
+        sqlite3_bind_blob(statement, 7, info.bytes, (int)info.length, SQLITE_TRANSIENT);
+        sqlite3_bind_int64(statement, 8, [taskInfo[AttemptsKey] longLongValue]);
+        if (taskInfo[NextAttemptAtKey] != nil)
+            sqlite3_bind_double(statement, 9, [taskInfo[NextAttemptAtKey] timeIntervalSince1970]);
+        else
+            sqlite3_bind_null(statement, 9);
+
+        if (sqlite3_step(statement) != SQLITE_DONE)
+            OB_ERROR(@"Unable to save task %@: %s", taskInfo[MarkerKey], sqlite3_errmsg(_db));
+        sqlite3_reset(statement);
+        sqlite3_clear_bindings(statement);
+    }
+    [self execute:@"COMMIT TRANSACTION"];
+}
+
+- (void)removeTasksWithMarkers:(NSArray *)markers
+{
+    if (_db == NULL || markers.count == 0)
+        return;
+
+    [self execute:@"BEGIN IMMEDIATE TRANSACTION"];
+    for (NSString *marker in markers)
+    {
+        sqlite3_bind_text(_deleteStatement, 1, [marker UTF8String], -1, SQLITE_TRANSIENT);
+        if (sqlite3_step(_deleteStatement) != SQLITE_DONE)
+            OB_ERROR(@"Unable to remove task %@: %s", marker, sqlite3_errmsg(_db));
+        sqlite3_reset(_deleteStatement);
+    }
+    [self execute:@"COMMIT TRANSACTION"];
+}
+
+- (void)resetRetries
+{
+    if (_db == NULL)
+        return;
+    [self execute:@"UPDATE tasks SET attempts = 0, next_attempt_at = NULL WHERE attempts > 0 OR next_attempt_at IS NOT NULL"];
+}
+
+- (void)reset
+{
+    [self execute:@"DELETE FROM tasks"];
+}
+
+- (NSArray *)tasksWithStatus:(OBFileTransferTaskStatus)status upload:(BOOL)upload host:(NSString *)hostOrNil
+{
+    NSString *where = hostOrNil == nil ? @"status = ? AND upload = ?" : @"status = ? AND upload = ? AND remote_host = ?";
+    return [self tasksWhere:where bind:^(sqlite3_stmt *statement) {
+        sqlite3_bind_int64(statement, 1, status);
+        sqlite3_bind_int(statement, 2, upload ? 1 : 0);
+        if (hostOrNil != nil)
+            sqlite3_bind_text(statement, 3, [[hostOrNil lowercaseString] UTF8String], -1, SQLITE_TRANSIENT);
+    }];
+}
+
+#pragma mark - Queries
+
+- (NSArray *)tasksWhere:(NSString *)whereOrNil bind:(void (^)(sqlite3_stmt *statement))bindOrNil
+{
+    NSMutableArray *tasks = [NSMutableArray new];
+    if (_db == NULL)
+        return tasks;
+
+    NSString *sql = whereOrNil == nil ?
+            @"SELECT info, attempts, next_attempt_at FROM tasks ORDER BY created_on" :
+            [NSString stringWithFormat:@"SELECT info, attempts, next_attempt_at FROM tasks WHERE %@ ORDER BY created_on", whereOrNil];
+    sqlite3_stmt *statement = [self prepare:sql];
+    if (statement == NULL)
+        return tasks;
+    if (bindOrNil)
+        bindOrNil(statement);
+
+    while (sqlite3_step(statement) == SQLITE_ROW)
+    {
+        NSData *info = [NSData dataWithBytes:sqlite3_column_blob(statement, 0)
+                                      length:(NSUInteger)sqlite3_column_bytes(statement, 0)];
+        NSDictionary *taskInfo = [NSPropertyListSerialization propertyListWithData:info
+                                                                           options:NSPropertyListImmutable
+                                                                            format:NULL
+                                                                             error:nil];
+        if (![taskInfo isKindOfClass:[NSDictionary class]])
+            continue;
+        NSMutableDictionary *retryInfo = [taskInfo mutableCopy];
+        retryInfo[AttemptsKey] = @(sqlite3_column_int64(statement, 1));
+        if (sqlite3_column_type(statement, 2) != SQLITE_NULL)
+            retryInfo[NextAttemptAtKey] = [NSDate dateWithTimeIntervalSince1970:sqlite3_column_double(statement, 2)];
+        else
+            [retryInfo removeObjectForKey:NextAttemptAtKey];
+        [tasks addObject:retryInfo];
+    }
+    sqlite3_finalize(statement);
+    return tasks;
+}
+
+@end
@@ -0,0 +1,41 @@
+//
+//  OBFileTransferTaskStore.h
+//  Pods
+//
+//  Created by etcetc on 10/17/26.
+//
+//
+
+#import <Foundation/Foundation.h>
+#import "OBFileTransferTask.h"
+
+// Keys of the state dictionary returned by restoreState
+extern NSString *const OBFileTransferStoreTasksKey;
+
+// Persistence for the task manager.  Tasks are passed around in their asDictionary form and identified by marker.
+// The task manager only ever calls a store from its serial persistence queue, so stores need not be thread safe.
+@protocol OBFileTransferTaskStore <NSObject>
+
+// basePath is a file path without extension, stores add whatever extension(s) they need
+- (instancetype)initWithBasePath:(NSString *)basePath;
+
+// Returns a dictionary with the array of task dictionaries
+- (NSDictionary *)restoreState;
+
+// Insert or replace each of the tasks, all in a single write
+- (void)saveTasks:(NSArray *)taskDictionaries;
+
+- (void)removeTasksWithMarkers:(NSArray *)markers;
+
+// Zero the attempt count and clear the next attempt time of every task
+- (void)resetRetries;
+
+// Forget all the tasks
+- (void)reset;
+
+@optional
+
+// Returns the dictionaries of the tasks in the indicated state.  A nil host matches all hosts.
+- (NSArray *)tasksWithStatus:(OBFileTransferTaskStatus)status upload:(BOOL)upload host:(NSString *)hostOrNil;
+
+@end
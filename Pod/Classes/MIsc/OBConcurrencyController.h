@@ -0,0 +1,39 @@
+//
+//  OBConcurrencyController.h
+//  Pods
+//
+//  Created by etcetc on 10/17/26.
+//
+//
+
+#import <Foundation/Foundation.h>
+
+// Decides how many transfers should be in flight, AIMD style.  Bytes moved, completions and failures are counted over
+// a measurement window.  When the window closes, a window with timeouts or too many failures halves the limit, and a
+// window where all the slots were busy and goodput went up raises it by one.  Otherwise the limit holds: the link is
+// full and more transfers would only split it further.  After halving, the limit climbs back one window at a time.
+// The clock is passed in rather than read, so the controller can be driven by a simulated one.  Completions are those
+// of whole transfers, not of their chunks or segments.
+@interface OBConcurrencyController : NSObject
+
+@property (nonatomic, readonly) NSUInteger minimumLimit;
+@property (nonatomic) NSUInteger maximumLimit;
+@property (nonatomic, readonly) NSUInteger limit;
+@property (nonatomic) NSTimeInterval windowLength;
+
+- (instancetype)initWithLimit:(NSUInteger)limit minimum:(NSUInteger)minimumLimit maximum:(NSUInteger)maximumLimit;
+
+// Meant for the progress callbacks: neither this nor isWindowOverAt: takes a lock
+- (void)transferredBytes:(int64_t)bytes;
+
+// Whether updateAt:inFlight: would close the window
+- (BOOL)isWindowOverAt:(NSTimeInterval)now;
+
+- (void)transferSucceeded;
+
+- (void)transferFailed:(BOOL)timedOut;
+
+// Closes the window if it is over.  Returns YES if the limit changed.
+- (BOOL)updateAt:(NSTimeInterval)now inFlight:(NSUInteger)inFlight;
+
+@end
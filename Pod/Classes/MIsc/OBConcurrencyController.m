@@ -0,0 +1,142 @@
+//
+//  OBConcurrencyController.m
+//  Pods
+//
+//  Created by etcetc on 10/17/26.
+//
+//
+
+#import "OBConcurrencyController.h"
+#import <OBLogger/OBLogger.h>
+#include <stdatomic.h>
+
+#define DEFAULT_WINDOW_LENGTH 5.0
+// Share of the completions in a window that may fail before we back off
+#define FAILURE_RATE_LIMIT 0.2
+// How much goodput has to go up for another transfer to have been worth it
+#define GOODPUT_GAIN 1.05
+
+@interface OBConcurrencyController ()
+@property (nonatomic) NSUInteger limit;
+@property (nonatomic) NSTimeInterval windowStart;
+@property (nonatomic) NSUInteger windowSuccesses;
+@property (nonatomic) NSUInteger windowFailures;
+@property (nonatomic) NSUInteger windowTimeouts;
+// All the slots were taken at some point in the window
+@property (nonatomic) BOOL windowBusy;
+@property (nonatomic) double lastGoodput;
+@end
+
+@implementation OBConcurrencyController
+{
+    // Updated by the progress callbacks without the lock
+    _Atomic(int64_t) _windowBytes;
+    // When the window closes, 0 until the first one is opened
+    _Atomic(double) _windowEnd;
+}
+
+- (instancetype)initWithLimit:(NSUInteger)limit minimum:(NSUInteger)minimumLimit maximum:(NSUInteger)maximumLimit
+{
+    self = [super init];
+    if (self)
+    {
+        _minimumLimit = MAX(minimumLimit, 1);
+        _maximumLimit = MAX(maximumLimit, _minimumLimit);
+        _limit = MIN(MAX(limit, _minimumLimit), _maximumLimit);
+        _windowLength = DEFAULT_WINDOW_LENGTH;
+        _windowStart = -1;
+        atomic_init(&_windowBytes, 0);
+        atomic_init(&_windowEnd, 0);
+    }
+    return self;
+}
+
+- (void)setMaximumLimit:(NSUInteger)maximumLimit
+{
+    @synchronized (self)
+    {
+        _maximumLimit = MAX(maximumLimit, self.minimumLimit);
+        self.limit = MIN(self.limit, _maximumLimit);
+    }
+}
+
+#pragma mark - Measurements
+
+- (void)transferredBytes:(int64_t)bytes
+{
+    atomic_fetch_add_explicit(&_windowBytes, bytes, memory_order_relaxed);
+}
+
+- (BOOL)isWindowOverAt:(NSTimeInterval)now
+{
+    return now >= atomic_load_explicit(&_windowEnd, memory_order_relaxed);
+}
+
+- (void)transferSucceeded
+{
+    @synchronized (self)
+    {
+        self.windowSuccesses++;
+    }
+}
+
+- (void)transferFailed:(BOOL)timedOut
+{
+    @synchronized (self)
+    {
+        self.windowFailures++;
+        if (timedOut)
+            self.windowTimeouts++;
+    }
+}
+
+#pragma mark - Control
+
+- (BOOL)updateAt:(NSTimeInterval)now inFlight:(NSUInteger)inFlight
+{
+    @synchronized (self)
+    {
+        if (inFlight >= self.limit)
+            self.windowBusy = YES;
+        if (self.windowStart < 0)
+        {
+            self.windowStart = now;
+            atomic_store_explicit(&_windowEnd, now + self.windowLength, memory_order_relaxed);
+        }
+        NSTimeInterval elapsed = now - self.windowStart;
+        if (elapsed < self.windowLength)
+            return NO;
+
+        // Bytes that come in from here on count in the next window
+        int64_t windowBytes = atomic_exchange_explicit(&_windowBytes, 0, memory_order_relaxed);
+        NSUInteger previousLimit = self.limit;
+        NSUInteger completions = self.windowSuccesses + self.windowFailures;
+        double goodput = windowBytes / elapsed;
+        if (self.windowTimeouts > 0 || (self.windowFailures > 0 && self.windowFailures >= FAILURE_RATE_LIMIT * completions))
+        {
+            self.limit = MAX(self.limit / 2, self.minimumLimit);
+            // Next to what the overloaded link gave, the goodput of fewer transfers would never look worth
+            // climbing back for
+            self.lastGoodput = 0;
+        }
+        else if (windowBytes > 0 || completions > 0)
+        {
+            if (self.windowBusy && goodput > self.lastGoodput * GOODPUT_GAIN)
+                self.limit = MIN(self.limit + 1, self.maximumLimit);
+            self.lastGoodput = goodput;
+        }
+
+        OB_DEBUG(@"Concurrency window: %.0f B/s, %lu ok, %lu failed (%lu timed out), limit %lu -> %lu",
+                goodput, (unsigned long)self.windowSuccesses, (unsigned long)self.windowFailures,
+                (unsigned long)self.windowTimeouts, (unsigned long)previousLimit, (unsigned long)self.limit);
+        self.windowStart = now;
+        atomic_store_explicit(&_windowEnd, now + self.windowLength, memory_order_relaxed);
+        self.windowSuccesses = 0;
+        self.windowFailures = 0;
+        self.windowTimeouts = 0;
+        self.windowBusy = inFlight >= self.limit;
+        return self.limit != previousLimit;
+    }
+}
+
+@end
@@ -0,0 +1,30 @@
+//
+//  OBContentHashIndex.h
+//  Pods
+//
+//  Created by etcetc on 10/17/26.
+//
+//
+
+#import <Foundation/Foundation.h>
+
+// Persisted map of content hash to the upload targets that content was uploaded to, so an upload of the same bytes
+// to the same target can be recognized as a duplicate.  A target is whatever string identifies the remote object,
+// e.g. the remote URL and filename of the upload.
+@interface OBContentHashIndex : NSObject
+
+- (instancetype)initWithFile:(NSString *)indexFile;
+
+// Lowercase hex SHA-256 of the file, read in fixed-size chunks.  nil if the file can't be read.
++ (NSString *)sha256OfFileAtPath:(NSString *)filePath;
+
+- (BOOL)hasUploaded:(NSString *)contentHash to:(NSString *)target;
+
+- (void)recordUpload:(NSString *)contentHash to:(NSString *)target;
+
+// The target now holds something else, or nothing
+- (void)forgetUploadsTo:(NSString *)target;
+
+- (void)removeAll;
+
+@end
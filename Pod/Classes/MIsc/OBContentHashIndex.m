@@ -0,0 +1,152 @@
+//
+//  OBContentHashIndex.m
+//  Pods
+//
+//  Created by etcetc on 10/17/26.
+//
+//  The index file is a plist of content hash to the array of targets.  A target holds one content at a time, so
+//  recording an upload to a target drops it from any other hash.
+//
+
+#import "OBContentHashIndex.h"
+#import <OBLogger/OBLogger.h>
+#import <CommonCrypto/CommonDigest.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#define HASH_READ_CHUNK_SIZE (256 * 1024)
+
+@interface OBContentHashIndex ()
+@property (nonatomic, strong) NSString *indexFile;
+@property (nonatomic, strong) NSMutableDictionary *targetsByHash;
+@end
+
+@implementation OBContentHashIndex
+
+- (instancetype)initWithFile:(NSString *)indexFile
+{
+    self = [super init];
+    if (self)
+    {
+        _indexFile = indexFile;
+        _targetsByHash = [NSMutableDictionary new];
+        NSDictionary *saved = [NSDictionary dictionaryWithContentsOfFile:indexFile];
+        for (NSString *contentHash in saved)
+        {
+            _targetsByHash[contentHash] = [NSMutableOrderedSet orderedSetWithArray:saved[contentHash]];
+        }
+    }
+    return self;
+}
+
++ (NSString *)sha256OfFileAtPath:(NSString *)filePath
+{
+    int fd = open([filePath fileSystemRepresentation], O_RDONLY);
+    if (fd < 0)
+    {
+        OB_WARN(@"Unable to open %@ to hash it: %s", filePath, strerror(errno));
+        return nil;
+    }
+
+    CC_SHA256_CTX context;
+    CC_SHA256_Init(&context);
+    void *buffer = malloc(HASH_READ_CHUNK_SIZE);
+    ssize_t bytesRead;
+    while ((bytesRead = read(fd, buffer, HASH_READ_CHUNK_SIZE)) > 0)
+    {
+        CC_SHA256_Update(&context, buffer, (CC_LONG)bytesRead);
+    }
+    free(buffer);
+    close(fd);
+    if (bytesRead < 0)
+    {
+        OB_WARN(@"Unable to read %@ to hash it: %s", filePath, strerror(errno));
+        return nil;
+    }
+
+    unsigned char digest[CC_SHA256_DIGEST_LENGTH];
+    CC_SHA256_Final(digest, &context);
+    NSMutableString *contentHash = [NSMutableString stringWithCapacity:2 * CC_SHA256_DIGEST_LENGTH];
+    for (int i = 0; i < CC_SHA256_DIGEST_LENGTH; i++)
+    {
+        [contentHash appendFormat:@"%02x", digest[i]];
+    }
+    return contentHash;
+}
+
+- (BOOL)hasUploaded:(NSString *)contentHash to:(NSString *)target
+{
+    @synchronized (self)
+    {
+        return [self.targetsByHash[contentHash] containsObject:target];
+    }
+}
+
+- (void)recordUpload:(NSString *)contentHash to:(NSString *)target
+{
+    if (contentHash == nil || target == nil)
+        return;
+    @synchronized (self)
+    {
+        if ([self.targetsByHash[contentHash] containsObject:target])
+            return;
+        [self removeTarget:target];
+        NSMutableOrderedSet *targets = self.targetsByHash[contentHash];
+        if (targets == nil)
+        {
+            targets = [NSMutableOrderedSet new];
+            self.targetsByHash[contentHash] = targets;
+        }
+        [targets addObject:target];
+        [self save];
+    }
+}
+
+- (void)forgetUploadsTo:(NSString *)target
+{
+    @synchronized (self)
+    {
+        if ([self removeTarget:target])
+            [self save];
+    }
+}
+
+- (void)removeAll
+{
+    @synchronized (self)
+    {
+        [self.targetsByHash removeAllObjects];
+        [self save];
+    }
+}
+
+// Only call synchronized.  Returns YES if the target was there.
+- (BOOL)removeTarget:(NSString *)target
+{
+    BOOL removed = NO;
+    for (NSString *contentHash in [self.targetsByHash allKeys])
+    {
+        NSMutableOrderedSet *targets = self.targetsByHash[contentHash];
+        if (![targets containsObject:target])
+            continue;
+        [targets removeObject:target];
+        if (targets.count == 0)
+            [self.targetsByHash removeObjectForKey:contentHash];
+        removed = YES;
+    }
+    return removed;
+}
+
+// Only call synchronized
+- (void)save
+{
+    NSMutableDictionary *index = [NSMutableDictionary dictionaryWithCapacity:self.targetsByHash.count];
+    for (NSString *contentHash in self.targetsByHash)
+    {
+        index[contentHash] = [self.targetsByHash[contentHash] array];
+    }
+    if (![index writeToFile:self.indexFile atomically:YES])
+        OB_ERROR(@"Could not save content hash index to %@", self.indexFile);
+}
+
+@end
@@ -0,0 +1,54 @@
+//
+//  OBDownloadCache.h
+//  Pods
+//
+//  Created by etcetc on 10/17/26.
+//
+//
+
+#import <Foundation/Foundation.h>
+
+// On-disk cache of downloaded files, indexed by remote URL.  The "URL" can be any string naming what was downloaded:
+// the manager adds the params of the download to it, since they may change the file that comes back.
+// With each file we keep the ETag and Last-Modified the server sent, so the next download of the same URL can be
+// a conditional GET, and how long the server said the file stays fresh, during which we don't ask at all.  Files
+// are handed out as clones (see OBFileCloner), which share blocks with the cached file until either is written to.
+// The cache holds at most byteLimit bytes.  When a new file takes it over, the least recently used files go first.
+@interface OBDownloadCache : NSObject
+
+@property (nonatomic, readonly) NSString *directory;
+@property (nonatomic) long long byteLimit;
+
+- (instancetype)initWithDirectory:(NSString *)directory byteLimit:(long long)byteLimit;
+
+// YES if we have the file and the server said we may use it without asking
+- (BOOL)isFreshUrl:(NSString *)remoteUrl;
+
+// Bytes of the file we have for the URL, -1 if we don't have it
+- (long long)lengthOfUrl:(NSString *)remoteUrl;
+
+// If-None-Match and/or If-Modified-Since headers for a download of the URL, empty if we don't have it
+- (NSDictionary *)validatorHeadersForUrl:(NSString *)remoteUrl;
+
+// Put the cached file for the URL at filePath, replacing whatever is there.  Returns NO if we don't have it.
+- (BOOL)materializeUrl:(NSString *)remoteUrl toPath:(NSString *)filePath;
+
+// After a download of the URL to filePath.  The validators and freshness come from the response headers; nothing is
+// kept if the response has neither a validator nor a freshness lifetime, or says no-store.
+- (void)storeFile:(NSString *)filePath forUrl:(NSString *)remoteUrl response:(NSHTTPURLResponse *)response;
+
+// Same with the validators known up front
+- (void)storeFile:(NSString *)filePath
+           forUrl:(NSString *)remoteUrl
+             etag:(NSString *)etagOrNil
+     lastModified:(NSString *)lastModifiedOrNil
+        expiresOn:(NSDate *)expiresOnOrNil;
+
+- (void)removeUrl:(NSString *)remoteUrl;
+
+- (void)removeAll;
+
+// Bytes currently held
+- (long long)size;
+
+@end
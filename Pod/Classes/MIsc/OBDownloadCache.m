@@ -0,0 +1,332 @@
+//
+//  OBDownloadCache.m
+//  Pods
+//
+//  Created by etcetc on 10/17/26.
+//
+//  The index is a plist of remote URL to entry dictionary, the files themselves are named after the SHA-1 of the URL.
+//
+
+#import "OBDownloadCache.h"
+#import "OBFileCloner.h"
+#import <OBLogger/OBLogger.h>
+#import <CommonCrypto/CommonDigest.h>
+
+static NSString *const OBDownloadCacheIndexFile = @"index.plist";
+static NSString *const OBDownloadCacheFileKey = @"file";
+static NSString *const OBDownloadCacheETagKey = @"etag";
+static NSString *const OBDownloadCacheLastModifiedKey = @"lastModified";
+static NSString *const OBDownloadCacheExpiresOnKey = @"expiresOn";
+static NSString *const OBDownloadCacheLengthKey = @"length";
+static NSString *const OBDownloadCacheLastAccessKey = @"lastAccess";
+
+@interface OBDownloadCache ()
+@property (nonatomic, strong) NSMutableDictionary *entries;
+@end
+
+@implementation OBDownloadCache
+
+- (instancetype)initWithDirectory:(NSString *)directory byteLimit:(long long)byteLimit
+{
+    self = [super init];
+    if (self)
+    {
+        _directory = directory;
+        _byteLimit = byteLimit;
+        [[NSFileManager defaultManager] createDirectoryAtPath:directory
+                                  withIntermediateDirectories:YES
+                                                   attributes:nil
+                                                        error:nil];
+        _entries = [[NSDictionary dictionaryWithContentsOfFile:[self indexFile]] mutableCopy];
+        if (_entries == nil)
+            _entries = [NSMutableDictionary new];
+    }
+    return self;
+}
+
+- (void)setByteLimit:(long long)byteLimit
+{
+    @synchronized (self)
+    {
+        _byteLimit = byteLimit;
+        [self evictToFit:0];
+    }
+}
+
+#pragma mark - Lookups
+
+- (BOOL)isFreshUrl:(NSString *)remoteUrl
+{
+    @synchronized (self)
+    {
+        NSDate *expiresOn = self.entries[remoteUrl][OBDownloadCacheExpiresOnKey];
+        return expiresOn != nil && [expiresOn timeIntervalSinceNow] > 0;
+    }
+}
+
+- (long long)lengthOfUrl:(NSString *)remoteUrl
+{
+    @synchronized (self)
+    {
+        NSNumber *length = self.entries[remoteUrl][OBDownloadCacheLengthKey];
+        return length != nil ? length.longLongValue : -1;
+    }
+}
+
+- (NSDictionary *)validatorHeadersForUrl:(NSString *)remoteUrl
+{
+    NSMutableDictionary *headers = [NSMutableDictionary new];
+    @synchronized (self)
+    {
+        NSDictionary *entry = self.entries[remoteUrl];
+        if (entry[OBDownloadCacheETagKey] != nil)
+            headers[@"If-None-Match"] = entry[OBDownloadCacheETagKey];
+        if (entry[OBDownloadCacheLastModifiedKey] != nil)
+            headers[@"If-Modified-Since"] = entry[OBDownloadCacheLastModifiedKey];
+    }
+    return headers;
+}
+
+- (BOOL)materializeUrl:(NSString *)remoteUrl toPath:(NSString *)filePath
+{
+    @synchronized (self)
+    {
+        NSMutableDictionary *entry = [self.entries[remoteUrl] mutableCopy];
+        if (entry == nil)
+            return NO;
+
+        NSString *cachedFile = [self.directory stringByAppendingPathComponent:entry[OBDownloadCacheFileKey]];
+        NSFileManager *fileManager = [NSFileManager defaultManager];
+        [fileManager createDirectoryAtPath:[filePath stringByDeletingLastPathComponent]
+               withIntermediateDirectories:YES
+                                attributes:nil
+                                     error:nil];
+        [fileManager removeItemAtPath:filePath error:nil];
+
+        NSError *error;
+        OBFileCloneMethod cloneMethod = [OBFileCloner cloneFileAtPath:cachedFile toPath:filePath error:&error];
+        if (cloneMethod == OBFileCloneFailed)
+        {
+            OB_WARN(@"Unable to use cached copy of %@: %@", remoteUrl, error.localizedDescription);
+            [self removeEntry:remoteUrl];
+            [self saveIndex];
+            return NO;
+        }
+
+        entry[OBDownloadCacheLastAccessKey] = [NSDate date];
+        self.entries[remoteUrl] = entry;
+        [self saveIndex];
+        OB_DEBUG(@"Materialized cached %@ as %@ (method %lu)", remoteUrl, filePath, (unsigned long)cloneMethod);
+        return YES;
+    }
+}
+
+#pragma mark - Storing
+
+- (void)storeFile:(NSString *)filePath forUrl:(NSString *)remoteUrl response:(NSHTTPURLResponse *)response
+{
+    NSString *etag;
+    NSString *lastModified;
+    NSString *cacheControl;
+    NSString *expires;
+    for (NSString *name in response.allHeaderFields)
+    {
+        NSString *value = response.allHeaderFields[name];
+        if ([name caseInsensitiveCompare:@"ETag"] == NSOrderedSame)
+            etag = value;
+        else if ([name caseInsensitiveCompare:@"Last-Modified"] == NSOrderedSame)
+            lastModified = value;
+        else if ([name caseInsensitiveCompare:@"Cache-Control"] == NSOrderedSame)
+            cacheControl = [value lowercaseString];
+        else if ([name caseInsensitiveCompare:@"Expires"] == NSOrderedSame)
+            expires = value;
+    }
+
+    if ([cacheControl rangeOfString:@"no-store"].location != NSNotFound)
+    {
+        [self removeUrl:remoteUrl];
+        return;
+    }
+
+    [self storeFile:filePath
+             forUrl:remoteUrl
+               etag:etag
+       lastModified:lastModified
+          expiresOn:[self expiryForCacheControl:cacheControl expires:expires]];
+}
+
+- (void)storeFile:(NSString *)filePath
+           forUrl:(NSString *)remoteUrl
+             etag:(NSString *)etagOrNil
+     lastModified:(NSString *)lastModifiedOrNil
+        expiresOn:(NSDate *)expiresOnOrNil
+{
+    if (remoteUrl == nil || (etagOrNil == nil && lastModifiedOrNil == nil && expiresOnOrNil == nil))
+        return;
+
+    long long length = [[[NSFileManager defaultManager] attributesOfItemAtPath:filePath error:nil] fileSize];
+    @synchronized (self)
+    {
+        [self removeEntry:remoteUrl];
+        if (length > self.byteLimit)
+        {
+            [self saveIndex];
+            return;
+        }
+        [self evictToFit:length];
+
+        NSString *fileName = [self fileNameForUrl:remoteUrl];
+        NSError *error;
+        if ([OBFileCloner cloneFileAtPath:filePath
+                                   toPath:[self.directory stringByAppendingPathComponent:fileName]
+                                    error:&error] == OBFileCloneFailed)
+        {
+            OB_WARN(@"Unable to cache %@: %@", remoteUrl, error.localizedDescription);
+            [self saveIndex];
+            return;
+        }
+
+        NSMutableDictionary *entry = [NSMutableDictionary new];
+        entry[OBDownloadCacheFileKey] = fileName;
+        entry[OBDownloadCacheLengthKey] = @(length);
+        entry[OBDownloadCacheLastAccessKey] = [NSDate date];
+        if (etagOrNil != nil)
+            entry[OBDownloadCacheETagKey] = etagOrNil;
+        if (lastModifiedOrNil != nil)
+            entry[OBDownloadCacheLastModifiedKey] = lastModifiedOrNil;
+        if (expiresOnOrNil != nil)
+            entry[OBDownloadCacheExpiresOnKey] = expiresOnOrNil;
+        self.entries[remoteUrl] = entry;
+        [self saveIndex];
+        OB_DEBUG(@"Cached %@ (%lld bytes, %lld in cache)", remoteUrl, length, [self size]);
+    }
+}
+
+// max-age wins over Expires, no-cache means we have to ask every time
+- (NSDate *)expiryForCacheControl:(NSString *)cacheControl expires:(NSString *)expires
+{
+    if ([cacheControl rangeOfString:@"no-cache"].location != NSNotFound)
+        return nil;
+
+    NSRange maxAge = [cacheControl rangeOfString:@"max-age="];
+    if (maxAge.location != NSNotFound)
+    {
+        NSInteger seconds = [[cacheControl substringFromIndex:NSMaxRange(maxAge)] integerValue];
+        return seconds > 0 ? [NSDate dateWithTimeIntervalSinceNow:seconds] : nil;
+    }
+
+    if (expires != nil)
+    {
+        static NSDateFormatter *httpDateFormatter;
+        static dispatch_once_t onceToken;
+        dispatch_once(&onceToken, ^{
+            httpDateFormatter = [NSDateFormatter new];
+            httpDateFormatter.locale = [NSLocale localeWithLocaleIdentifier:@"en_US_POSIX"];
+            httpDateFormatter.timeZone = [NSTimeZone timeZoneWithAbbreviation:@"GMT"];
+            httpDateFormatter.dateFormat = @"EEE',' dd MMM yyyy HH':'mm':'ss 'GMT'";
+        });
+        @synchronized (httpDateFormatter)
+        {
+            NSDate *expiresOn = [httpDateFormatter dateFromString:expires];
+            return [expiresOn timeIntervalSinceNow] > 0 ? expiresOn : nil;
+        }
+    }
+    return nil;
+}
+
+#pragma mark - Removal
+
+- (void)removeUrl:(NSString *)remoteUrl
+{
+    @synchronized (self)
+    {
+        if (self.entries[remoteUrl] == nil)
+            return;
+        [self removeEntry:remoteUrl];
+        [self saveIndex];
+    }
+}
+
+- (void)removeAll
+{
+    @synchronized (self)
+    {
+        for (NSString *remoteUrl in [self.entries allKeys])
+        {
+            [self removeEntry:remoteUrl];
+        }
+        [self saveIndex];
+    }
+}
+
+- (long long)size
+{
+    @synchronized (self)
+    {
+        long long size = 0;
+        for (NSDictionary *entry in [self.entries allValues])
+        {
+            size += [entry[OBDownloadCacheLengthKey] longLongValue];
+        }
+        return size;
+    }
+}
+
+// Only call synchronized.  Drops least recently used files until another length bytes fit in the budget.
+- (void)evictToFit:(long long)length
+{
+    long long size = [self size];
+    if (size + length <= self.byteLimit)
+        return;
+
+    NSArray *leastRecentlyUsed = [self.entries keysSortedByValueUsingComparator:^NSComparisonResult(NSDictionary *entry1, NSDictionary *entry2) {
+        return [entry1[OBDownloadCacheLastAccessKey] compare:entry2[OBDownloadCacheLastAccessKey]];
+    }];
+    for (NSString *remoteUrl in leastRecentlyUsed)
+    {
+        if (size + length <= self.byteLimit)
+            break;
+        size -= [self.entries[remoteUrl][OBDownloadCacheLengthKey] longLongValue];
+        OB_DEBUG(@"Evicting %@ from the download cache", remoteUrl);
+        [self removeEntry:remoteUrl];
+    }
+    [self saveIndex];
+}
+
+// Only call synchronized, leaves saving the index to the caller
+- (void)removeEntry:(NSString *)remoteUrl
+{
+    NSString *fileName = self.entries[remoteUrl][OBDownloadCacheFileKey];
+    if (fileName != nil)
+        [[NSFileManager defaultManager] removeItemAtPath:[self.directory stringByAppendingPathComponent:fileName] error:nil];
+    [self.entries removeObjectForKey:remoteUrl];
+}
+
+#pragma mark - Files
+
+- (NSString *)indexFile
+{
+    return [self.directory stringByAppendingPathComponent:OBDownloadCacheIndexFile];
+}
+
+// Only call synchronized
+- (void)saveIndex
+{
+    if (![self.entries writeToFile:[self indexFile] atomically:YES])
+        OB_ERROR(@"Could not save download cache index to %@", [self indexFile]);
+}
+
+- (NSString *)fileNameForUrl:(NSString *)remoteUrl
+{
+    NSData *data = [remoteUrl dataUsingEncoding:NSUTF8StringEncoding];
+    unsigned char digest[CC_SHA1_DIGEST_LENGTH];
+    CC_SHA1(data.bytes, (CC_LONG)data.length, digest);
+    NSMutableString *fileName = [NSMutableString stringWithCapacity:2 * CC_SHA1_DIGEST_LENGTH];
+    for (int i = 0; i < CC_SHA1_DIGEST_LENGTH; i++)
+    {
+        [fileName appendFormat:@"%02x", digest[i]];
+    }
+    return fileName;
+}
+
+@end
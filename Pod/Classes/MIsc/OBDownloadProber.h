@@ -0,0 +1,20 @@
+//
+//  OBDownloadProber.h
+//  Pods
+//
+//  Created by etcetc on 10/17/26.
+//
+//
+
+#import <Foundation/Foundation.h>
+
+// Sends the requests that find out about a download before it starts, e.g. the size of the file, and hands back the
+// response as soon as its headers are in.  The body is never read: the task is cancelled then, so a server that
+// ignores a Range header doesn't get to send us the whole file.  Probes go at the same time, each on its own data task
+// of an ephemeral session.  Thread safe.
+@interface OBDownloadProber : NSObject
+
+// The completion is called once, on the queue of the session, with nil if no HTTP response came
+- (void)probe:(NSURLRequest *)request completion:(void (^)(NSHTTPURLResponse *response))completion;
+
+@end
@@ -0,0 +1,78 @@
+//
+//  OBDownloadProber.m
+//  Pods
+//
+//  Created by etcetc on 10/17/26.
+//
+//
+
+#import "OBDownloadProber.h"
+#import <OBLogger/OBLogger.h>
+
+@interface OBDownloadProber () <NSURLSessionDataDelegate>
+@property (nonatomic, strong) NSURLSession *session;
+// By session task identifier, the completion of each probe under way
+@property (nonatomic, strong) NSMutableDictionary *completions;
+@end
+
+@implementation OBDownloadProber
+
+- (instancetype)init
+{
+    self = [super init];
+    if (self)
+    {
+        _completions = [NSMutableDictionary new];
+        NSURLSessionConfiguration *configuration = [NSURLSessionConfiguration ephemeralSessionConfiguration];
+        configuration.requestCachePolicy = NSURLRequestReloadIgnoringLocalCacheData;
+        _session = [NSURLSession sessionWithConfiguration:configuration delegate:self delegateQueue:nil];
+    }
+    return self;
+}
+
+- (void)probe:(NSURLRequest *)request completion:(void (^)(NSHTTPURLResponse *response))completion
+{
+    NSURLSessionDataTask *task = [self.session dataTaskWithRequest:request];
+    @synchronized (self)
+    {
+        self.completions[@(task.taskIdentifier)] = [completion copy];
+    }
+    [task resume];
+}
+
+// The completion of the probe, which is then no longer under way.  Nil if it was already taken.
+- (void (^)(NSHTTPURLResponse *))takeCompletionOfTask:(NSURLSessionTask *)task
+{
+    @synchronized (self)
+    {
+        void (^completion)(NSHTTPURLResponse *) = self.completions[@(task.taskIdentifier)];
+        [self.completions removeObjectForKey:@(task.taskIdentifier)];
+        return completion;
+    }
+}
+
+#pragma mark - NSURLSessionDataDelegate
+
+- (void)URLSession:(NSURLSession *)session
+          dataTask:(NSURLSessionDataTask *)dataTask
+didReceiveResponse:(NSURLResponse *)response
+ completionHandler:(void (^)(NSURLSessionResponseDisposition disposition))completionHandler
+{
+    // The headers are all we are after
+    completionHandler(NSURLSessionResponseCancel);
+    void (^completion)(NSHTTPURLResponse *) = [self takeCompletionOfTask:dataTask];
+    if (completion != nil)
+        completion([response isKindOfClass:[NSHTTPURLResponse class]] ? (NSHTTPURLResponse *)response : nil);
+}
+
+- (void)URLSession:(NSURLSession *)session task:(NSURLSessionTask *)task didCompleteWithError:(NSError *)error
+{
+    // Only still there if the probe failed before a response came
+    void (^completion)(NSHTTPURLResponse *) = [self takeCompletionOfTask:task];
+    if (completion == nil)
+        return;
+    OB_WARN(@"Probe of %@ failed: %@", task.originalRequest.URL, error);
+    completion(nil);
+}
+
+@end
@@ -0,0 +1,39 @@
+//
+//  OBFileCloner.h
+//  Pods
+//
+//  Created by etcetc on 10/17/26.
+//
+//
+
+#import <Foundation/Foundation.h>
+
+typedef NS_ENUM(NSUInteger, OBFileCloneMethod)
+{
+    OBFileCloneFailed = 0,
+    OBFileCloneCopyOnWrite,
+    OBFileCloneChunkedCopy
+};
+
+// Makes a copy of a file as cheaply as the file system allows: a copy-on-write clone (APFS), and if that
+// doesn't work a copy in fixed-size chunks.  Either way the copy is a file of its own, writing to it leaves the
+// original alone.
+@interface OBFileCloner : NSObject
+
+// Returns how the file was cloned.  toPath must not exist.
++ (OBFileCloneMethod)cloneFileAtPath:(NSString *)fromPath toPath:(NSString *)toPath error:(NSError **)error;
+
+// Copy length bytes starting at offset into a new file at toPath, in fixed-size chunks.  toPath must not exist.
++ (BOOL)copyRangeOfFile:(NSString *)fromPath
+                 offset:(long long)offset
+                 length:(long long)length
+                 toPath:(NSString *)toPath
+                  error:(NSError **)error;
+
+// Create the file with its full length up front, e.g. for the segments of a download to be written into
++ (BOOL)preallocateFileAtPath:(NSString *)path length:(long long)length error:(NSError **)error;
+
+// Write the whole of fromPath into the existing file toPath, starting at offset
++ (BOOL)writeFileAtPath:(NSString *)fromPath intoFile:(NSString *)toPath atOffset:(long long)offset error:(NSError **)error;
+
+@end
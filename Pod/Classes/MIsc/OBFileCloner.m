@@ -0,0 +1,167 @@
+//
+//  OBFileCloner.m
+//  Pods
+//
+//  Created by etcetc on 10/17/26.
+//
+//
+
+#import "OBFileCloner.h"
+#import <OBLogger/OBLogger.h>
+#include <dlfcn.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#define CLONE_COPY_CHUNK_SIZE (256 * 1024)
+
+// clonefile() only exists as of iOS 10.3, so we look it up at run time
+typedef int (*OBCloneFileFunction)(const char *src, const char *dst, uint32_t flags);
+
+@implementation OBFileCloner
+
++ (OBFileCloneMethod)cloneFileAtPath:(NSString *)fromPath toPath:(NSString *)toPath error:(NSError **)error
+{
+    const char *from = [fromPath fileSystemRepresentation];
+    const char *to = [toPath fileSystemRepresentation];
+
+    static OBCloneFileFunction cloneFile;
+    static dispatch_once_t onceToken;
+    dispatch_once(&onceToken, ^{
+        cloneFile = (OBCloneFileFunction)dlsym(RTLD_DEFAULT, "clonefile");
+    });
+
+    if (cloneFile != NULL && cloneFile(from, to, 0) == 0)
+        return OBFileCloneCopyOnWrite;
+
+    // e.g. not APFS, or different volumes
+    OB_DEBUG(@"Unable to clone %@ (%s), copying it", fromPath, strerror(errno));
+    if ([self copyFile:from offset:0 length:-1 to:to])
+        return OBFileCloneChunkedCopy;
+
+    int copyErrno = errno;
+    unlink(to);
+    if (error != NULL)
+        *error = [NSError errorWithDomain:NSPOSIXErrorDomain code:copyErrno userInfo:@{NSFilePathErrorKey : fromPath}];
+    return OBFileCloneFailed;
+}
+
++ (BOOL)copyRangeOfFile:(NSString *)fromPath
+                 offset:(long long)offset
+                 length:(long long)length
+                 toPath:(NSString *)toPath
+                  error:(NSError **)error
+{
+    if ([self copyFile:[fromPath fileSystemRepresentation] offset:offset length:length to:[toPath fileSystemRepresentation]])
+        return YES;
+
+    int copyErrno = errno;
+    OB_ERROR(@"Unable to copy %lld bytes at %lld of %@: %s", length, offset, fromPath, strerror(copyErrno));
+    unlink([toPath fileSystemRepresentation]);
+    if (error != NULL)
+        *error = [NSError errorWithDomain:NSPOSIXErrorDomain code:copyErrno userInfo:@{NSFilePathErrorKey : fromPath}];
+    return NO;
+}
+
++ (BOOL)preallocateFileAtPath:(NSString *)path length:(long long)length error:(NSError **)error
+{
+    int fd = open([path fileSystemRepresentation], O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    BOOL ok = fd >= 0;
+    if (ok)
+    {
+#ifdef F_PREALLOCATE
+        // Reserve the blocks up front so the segments don't fragment the file, not a problem if it can't be done
+        fstore_t store = {F_ALLOCATEALL, F_PEOFPOSMODE, 0, (off_t)length, 0};
+        fcntl(fd, F_PREALLOCATE, &store);
+#endif
+        ok = ftruncate(fd, (off_t)length) == 0;
+        if (close(fd) != 0)
+            ok = NO;
+    }
+    if (ok)
+        return YES;
+
+    int preallocateErrno = errno;
+    OB_ERROR(@"Unable to create %@ of %lld bytes: %s", path, length, strerror(preallocateErrno));
+    if (error != NULL)
+        *error = [NSError errorWithDomain:NSPOSIXErrorDomain code:preallocateErrno userInfo:@{NSFilePathErrorKey : path}];
+    return NO;
+}
+
++ (BOOL)writeFileAtPath:(NSString *)fromPath intoFile:(NSString *)toPath atOffset:(long long)offset error:(NSError **)error
+{
+    int fromFd = open([fromPath fileSystemRepresentation], O_RDONLY);
+    int toFd = open([toPath fileSystemRepresentation], O_WRONLY);
+    BOOL ok = fromFd >= 0 && toFd >= 0 && [self copyFd:fromFd offset:0 length:-1 toFd:toFd offset:offset];
+    int writeErrno = errno;
+    if (fromFd >= 0)
+        close(fromFd);
+    if (toFd >= 0 && close(toFd) != 0 && ok)
+    {
+        ok = NO;
+        writeErrno = errno;
+    }
+    if (ok)
+        return YES;
+
+    OB_ERROR(@"Unable to write %@ into %@ at %lld: %s", fromPath, toPath, offset, strerror(writeErrno));
+    if (error != NULL)
+        *error = [NSError errorWithDomain:NSPOSIXErrorDomain code:writeErrno userInfo:@{NSFilePathErrorKey : toPath}];
+    return NO;
+}
+
++ (BOOL)copyFile:(const char *)from offset:(long long)offset length:(long long)length to:(const char *)to
+{
+    int fromFd = open(from, O_RDONLY);
+    if (fromFd < 0)
+        return NO;
+    int toFd = open(to, O_WRONLY | O_CREAT | O_EXCL, 0644);
+    if (toFd < 0)
+    {
+        close(fromFd);
+        return NO;
+    }
+
+    BOOL ok = [self copyFd:fromFd offset:offset length:length toFd:toFd offset:0];
+    close(fromFd);
+    if (close(toFd) != 0)
+        ok = NO;
+    return ok;
+}
+
+// A negative length copies up to the end of the file
++ (BOOL)copyFd:(int)fromFd offset:(long long)fromOffset length:(long long)length toFd:(int)toFd offset:(long long)toOffset
+{
+    uint8_t *buffer = malloc(CLONE_COPY_CHUNK_SIZE);
+    BOOL ok = YES;
+    ssize_t bytesRead;
+    long long remaining = length;
+    while (ok && remaining != 0 &&
+            (bytesRead = pread(fromFd, buffer, remaining > 0 ? (size_t)MIN(remaining, CLONE_COPY_CHUNK_SIZE) : CLONE_COPY_CHUNK_SIZE, (off_t)fromOffset)) != 0)
+    {
+        if (bytesRead < 0)
+        {
+            ok = NO;
+            break;
+        }
+        fromOffset += bytesRead;
+        if (remaining > 0)
+            remaining -= bytesRead;
+        uint8_t *bytes = buffer;
+        while (bytesRead > 0)
+        {
+            ssize_t written = pwrite(toFd, bytes, (size_t)bytesRead, (off_t)toOffset);
+            if (written < 0)
+            {
+                ok = NO;
+                break;
+            }
+            bytes += written;
+            bytesRead -= written;
+            toOffset += written;
+        }
+    }
+    free(buffer);
+    return ok;
+}
+
+@end
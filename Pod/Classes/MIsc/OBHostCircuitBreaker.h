@@ -0,0 +1,37 @@
+//
+//  OBHostCircuitBreaker.h
+//  Pods
+//
+//  Created by etcetc on 10/17/26.
+//
+//
+
+#import <Foundation/Foundation.h>
+
+// Keeps track of the health of each host.  After failureThreshold failures in a row the breaker of the host opens and
+// no transfer should be started to it.  Once it has been open for a while it lets a single transfer through as a
+// probe (half-open): if that succeeds the breaker closes, if it fails the breaker opens again for twice as long, up to
+// maxOpenInterval.  While the breaker is open only the probe counts; transfers are told apart by their marker.
+@interface OBHostCircuitBreaker : NSObject
+
+// 0 keeps the breakers closed
+@property (nonatomic) NSUInteger failureThreshold;
+@property (nonatomic) NSTimeInterval openInterval;
+@property (nonatomic) NSTimeInterval maxOpenInterval;
+
+// Whether a transfer to the host may be started now
+- (BOOL)allowsTransferTo:(NSString *)host;
+
+// A transfer to the host was started.  If the breaker allowed it as its probe, no other one is allowed until the
+// probe is done or openInterval went by without an answer.
+- (void)startedTransferTo:(NSString *)host marker:(NSString *)marker;
+
+// Returns YES if that closed the breaker
+- (BOOL)transferSucceededTo:(NSString *)host marker:(NSString *)marker;
+
+// Returns when the breaker of the host will let a probe through if this failure left it open, nil otherwise
+- (NSDate *)transferFailedTo:(NSString *)host marker:(NSString *)marker;
+
+- (void)reset;
+
+@end
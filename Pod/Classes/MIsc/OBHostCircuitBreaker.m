@@ -0,0 +1,147 @@
+//
+//  OBHostCircuitBreaker.m
+//  Pods
+//
+//  Created by etcetc on 10/17/26.
+//
+//
+
+#import "OBHostCircuitBreaker.h"
+#import <OBLogger/OBLogger.h>
+
+#define DEFAULT_FAILURE_THRESHOLD 5
+#define DEFAULT_OPEN_INTERVAL 30.0
+#define DEFAULT_MAX_OPEN_INTERVAL (10 * 60.0)
+
+// What we know of a host that failed recently.  Hosts that are fine don't have one.
+@interface OBHostHealth : NSObject
+@property (nonatomic) NSUInteger failures;
+// Set while the breaker is open
+@property (nonatomic, strong) NSDate *openUntil;
+@property (nonatomic) NSTimeInterval openInterval;
+// Set while a probe is out
+@property (nonatomic, strong) NSString *probeMarker;
+@property (nonatomic, strong) NSDate *probeStartedAt;
+@end
+
+@implementation OBHostHealth
+@end
+
+@interface OBHostCircuitBreaker ()
+@property (nonatomic, strong) NSMutableDictionary *healthByHost;
+@end
+
+@implementation OBHostCircuitBreaker
+
+- (instancetype)init
+{
+    self = [super init];
+    if (self)
+    {
+        _failureThreshold = DEFAULT_FAILURE_THRESHOLD;
+        _openInterval = DEFAULT_OPEN_INTERVAL;
+        _maxOpenInterval = DEFAULT_MAX_OPEN_INTERVAL;
+        _healthByHost = [NSMutableDictionary new];
+    }
+    return self;
+}
+
+- (BOOL)allowsTransferTo:(NSString *)host
+{
+    @synchronized (self)
+    {
+        OBHostHealth *health = self.healthByHost[host];
+        if (health.openUntil == nil)
+            return YES;
+        if ([health.openUntil timeIntervalSinceNow] > 0)
+            return NO;
+        // Half-open: one probe at a time, unless the last one never told us how it went
+        return health.probeStartedAt == nil || -[health.probeStartedAt timeIntervalSinceNow] > health.openInterval;
+    }
+}
+
+- (void)startedTransferTo:(NSString *)host marker:(NSString *)marker
+{
+    @synchronized (self)
+    {
+        OBHostHealth *health = self.healthByHost[host];
+        if (health.openUntil != nil && [health.openUntil timeIntervalSinceNow] <= 0)
+        {
+            OB_INFO(@"Probing %@ with %@", host, marker);
+            health.probeMarker = marker;
+            health.probeStartedAt = [NSDate date];
+        }
+    }
+}
+
+- (BOOL)transferSucceededTo:(NSString *)host marker:(NSString *)marker
+{
+    @synchronized (self)
+    {
+        OBHostHealth *health = self.healthByHost[host];
+        if (health == nil)
+            return NO;
+        if (health.openUntil == nil)
+        {
+            [self.healthByHost removeObjectForKey:host];
+            return NO;
+        }
+        // Transfers that were already in flight when the breaker opened don't close it either
+        if (![self isProbe:marker of:health])
+            return NO;
+        [self.healthByHost removeObjectForKey:host];
+        OB_INFO(@"%@ is back, closing its circuit breaker", host);
+        return YES;
+    }
+}
+
+- (NSDate *)transferFailedTo:(NSString *)host marker:(NSString *)marker
+{
+    if (host == nil || self.failureThreshold == 0)
+        return nil;
+    @synchronized (self)
+    {
+        OBHostHealth *health = self.healthByHost[host];
+        if (health == nil)
+        {
+            health = [OBHostHealth new];
+            self.healthByHost[host] = health;
+        }
+
+        if (health.openUntil != nil)
+        {
+            // Transfers that were already in flight when the breaker opened don't count, only the probe does
+            if (![self isProbe:marker of:health])
+                return nil;
+            health.openInterval = MIN(health.openInterval * 2, self.maxOpenInterval);
+        }
+        else
+        {
+            health.failures++;
+            if (health.failures < self.failureThreshold)
+                return nil;
+            health.openInterval = self.openInterval;
+        }
+
+        health.openUntil = [NSDate dateWithTimeIntervalSinceNow:health.openInterval];
+        health.probeMarker = nil;
+        health.probeStartedAt = nil;
+        OB_WARN(@"%@ keeps failing, not sending it anything for %.0f seconds", host, health.openInterval);
+        return health.openUntil;
+    }
+}
+
+- (BOOL)isProbe:(NSString *)marker of:(OBHostHealth *)health
+{
+    return health.probeMarker != nil && [health.probeMarker isEqualToString:marker];
+}
+
+- (void)reset
+{
+    @synchronized (self)
+    {
+        [self.healthByHost removeAllObjects];
+    }
+}
+
+@end
@@ -0,0 +1,30 @@
+//
+//  OBReadyQueue.h
+//  Pods
+//
+//  Created by etcetc on 10/17/26.
+//
+//
+
+#import <Foundation/Foundation.h>
+
+// The markers of the transfers waiting for their turn: a first in, first out lane per priority, the highest priority
+// lane first.  Not thread safe.
+@interface OBReadyQueue : NSObject
+
+@property (nonatomic, readonly) NSUInteger count;
+
+// At the end of the lane of the priority.  A marker already in that lane keeps its place, one in another lane moves.
+- (void)addMarker:(NSString *)marker priority:(NSInteger)priority;
+
+- (void)removeMarker:(NSString *)marker;
+
+- (BOOL)containsMarker:(NSString *)marker;
+
+- (void)removeAllMarkers;
+
+// Goes through the markers in order and takes out those the block returns YES for, until it sets stop.  Each marker is
+// looked at once, so a pass that hands out several turns is still a single walk through the queue.
+- (NSArray *)takeMarkersPassingTest:(BOOL (^)(NSString *marker, BOOL *stop))predicate;
+
+@end
@@ -0,0 +1,112 @@
+//
+//  OBReadyQueue.m
+//  Pods
+//
+//  Created by etcetc on 10/17/26.
+//
+//
+
+#import "OBReadyQueue.h"
+
+@interface OBReadyQueue ()
+// By priority, the markers in the order they came
+@property (nonatomic, strong) NSMutableDictionary *lanes;
+@property (nonatomic, strong) NSMutableDictionary *priorityOfMarker;
+@end
+
+@implementation OBReadyQueue
+
+- (instancetype)init
+{
+    self = [super init];
+    if (self)
+    {
+        _lanes = [NSMutableDictionary new];
+        _priorityOfMarker = [NSMutableDictionary new];
+    }
+    return self;
+}
+
+- (NSUInteger)count
+{
+    return self.priorityOfMarker.count;
+}
+
+- (void)addMarker:(NSString *)marker priority:(NSInteger)priority
+{
+    NSNumber *current = self.priorityOfMarker[marker];
+    if (current != nil)
+    {
+        if (current.integerValue == priority)
+            return;
+        [self removeMarker:marker];
+    }
+
+    NSMutableOrderedSet *lane = self.lanes[@(priority)];
+    if (lane == nil)
+    {
+        lane = [NSMutableOrderedSet new];
+        self.lanes[@(priority)] = lane;
+    }
+    [lane addObject:marker];
+    self.priorityOfMarker[marker] = @(priority);
+}
+
+- (void)removeMarker:(NSString *)marker
+{
+    NSNumber *priority = self.priorityOfMarker[marker];
+    if (priority == nil)
+        return;
+    [self.priorityOfMarker removeObjectForKey:marker];
+    NSMutableOrderedSet *lane = self.lanes[priority];
+    [lane removeObject:marker];
+    if (lane.count == 0)
+        [self.lanes removeObjectForKey:priority];
+}
+
+- (BOOL)containsMarker:(NSString *)marker
+{
+    return self.priorityOfMarker[marker] != nil;
+}
+
+- (void)removeAllMarkers
+{
+    [self.lanes removeAllObjects];
+    [self.priorityOfMarker removeAllObjects];
+}
+
+- (NSArray *)takeMarkersPassingTest:(BOOL (^)(NSString *marker, BOOL *stop))predicate
+{
+    NSMutableArray *taken = [NSMutableArray new];
+    BOOL stop = NO;
+    // Highest priority first
+    NSArray *priorities = [[self.lanes allKeys] sortedArrayUsingComparator:^NSComparisonResult(NSNumber *a, NSNumber *b) {
+        return [b compare:a];
+    }];
+    for (NSNumber *priority in priorities)
+    {
+        NSMutableOrderedSet *lane = self.lanes[priority];
+        NSMutableIndexSet *takenIndexes = [NSMutableIndexSet new];
+        NSUInteger index = 0;
+        for (NSString *marker in lane)
+        {
+            if (predicate(marker, &stop))
+            {
+                [takenIndexes addIndex:index];
+                [taken addObject:marker];
+            }
+            index++;
+            if (stop)
+                break;
+        }
+        [lane removeObjectsAtIndexes:takenIndexes];
+        if (lane.count == 0)
+            [self.lanes removeObjectForKey:priority];
+        if (stop)
+            break;
+    }
+    [self.priorityOfMarker removeObjectsForKeys:taken];
+    return taken;
+}
+
+@end
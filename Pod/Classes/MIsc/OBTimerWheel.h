@@ -0,0 +1,28 @@
+//
+//  OBTimerWheel.h
+//  Pods
+//
+//  Created by etcetc on 10/17/26.
+//
+//
+
+#import <Foundation/Foundation.h>
+
+// Calls back with the keys whose time has come, on its own serial queue.  Keys are hashed into a ring of slots by
+// their due time, one slot per tick, so each tick only looks at the keys of one slot rather than at all of them.  A
+// key due more than a turn of the ring away just stays in its slot until the turn it is due.  The timer only runs
+// while there are keys, and after a sleep the ticks that were missed are caught up on the next one.
+@interface OBTimerWheel : NSObject
+
+- (instancetype)initWithTickLength:(NSTimeInterval)tickLength
+                         slotCount:(NSUInteger)slotCount
+                           handler:(void (^)(NSArray *dueKeys))handler;
+
+// Replaces any earlier time for the key.  A time in the past fires on the next tick.
+- (void)scheduleKey:(NSString *)key at:(NSDate *)dueDate;
+
+- (void)cancelKey:(NSString *)key;
+
+- (void)cancelAll;
+
+@end
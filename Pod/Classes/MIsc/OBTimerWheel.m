@@ -0,0 +1,170 @@
+//
+//  OBTimerWheel.m
+//  Pods
+//
+//  Created by etcetc on 10/17/26.
+//
+//  Ticks are counted from the reference date, so the slot of a due time doesn't depend on when the wheel started.  A due
+//  time goes in the slot of the first tick at or after it, and a slot is only looked at once its tick has passed, so
+//  everything in it that is due this turn is due by then.
+//
+
+#import "OBTimerWheel.h"
+#import <OBLogger/OBLogger.h>
+
+@interface OBTimerWheel ()
+@property (nonatomic) NSTimeInterval tickLength;
+@property (nonatomic, copy) void (^handler)(NSArray *dueKeys);
+@property (nonatomic, strong) dispatch_queue_t queue;
+@property (nonatomic, strong) dispatch_source_t timer;
+@property (nonatomic) BOOL timerRunning;
+// Per slot, the due date of each key in it
+@property (nonatomic, strong) NSArray *slots;
+@property (nonatomic, strong) NSMutableDictionary *slotOfKey;
+// Last tick whose slot was looked at, or that went by while the wheel was empty
+@property (nonatomic) long long lastTick;
+@end
+
+@implementation OBTimerWheel
+
+- (instancetype)initWithTickLength:(NSTimeInterval)tickLength
+                         slotCount:(NSUInteger)slotCount
+                           handler:(void (^)(NSArray *dueKeys))handler
+{
+    self = [super init];
+    if (self)
+    {
+        _tickLength = tickLength;
+        _handler = [handler copy];
+        NSMutableArray *slots = [NSMutableArray arrayWithCapacity:slotCount];
+        for (NSUInteger i = 0; i < slotCount; i++)
+        {
+            [slots addObject:[NSMutableDictionary new]];
+        }
+        _slots = slots;
+        _slotOfKey = [NSMutableDictionary new];
+        _lastTick = [self tickPassedAt:[NSDate date]];
+
+        _queue = dispatch_queue_create("OBTimerWheelQueue", NULL);
+        _timer = dispatch_source_create(DISPATCH_SOURCE_TYPE_TIMER, 0, 0, _queue);
+        uint64_t interval = (uint64_t)(tickLength * NSEC_PER_SEC);
+        dispatch_source_set_timer(_timer, dispatch_time(DISPATCH_TIME_NOW, (int64_t)interval), interval, interval / 10);
+        __weak OBTimerWheel *weakSelf = self;
+        dispatch_source_set_event_handler(_timer, ^{
+            [weakSelf tick];
+        });
+    }
+    return self;
+}
+
+- (void)dealloc
+{
+    // A suspended source can't be cancelled
+    if (!_timerRunning)
+        dispatch_resume(_timer);
+    dispatch_source_cancel(_timer);
+}
+
+#pragma mark - Keys
+
+- (void)scheduleKey:(NSString *)key at:(NSDate *)dueDate
+{
+    dispatch_async(self.queue, ^{
+        [self removeKey:key];
+        // Slots that went by while we were idle are empty, no need to look at them
+        if (!self.timerRunning)
+            self.lastTick = MAX(self.lastTick, [self tickPassedAt:[NSDate date]]);
+        // Whatever is already due goes in the next slot to be looked at
+        long long tick = MAX([self tickDueAt:dueDate], self.lastTick + 1);
+        NSUInteger slot = (NSUInteger)(tick % (long long)self.slots.count);
+        self.slots[slot][key] = dueDate;
+        self.slotOfKey[key] = @(slot);
+        [self updateTimer];
+    });
+}
+
+- (void)cancelKey:(NSString *)key
+{
+    dispatch_async(self.queue, ^{
+        [self removeKey:key];
+        [self updateTimer];
+    });
+}
+
+- (void)cancelAll
+{
+    dispatch_async(self.queue, ^{
+        [self.slots makeObjectsPerformSelector:@selector(removeAllObjects)];
+        [self.slotOfKey removeAllObjects];
+        [self updateTimer];
+    });
+}
+
+// Only call on the queue
+- (void)removeKey:(NSString *)key
+{
+    NSNumber *slot = self.slotOfKey[key];
+    if (slot == nil)
+        return;
+    [self.slots[slot.unsignedIntegerValue] removeObjectForKey:key];
+    [self.slotOfKey removeObjectForKey:key];
+}
+
+#pragma mark - Ticking
+
+// First tick at or after the date
+- (long long)tickDueAt:(NSDate *)date
+{
+    return (long long)ceil([date timeIntervalSinceReferenceDate] / self.tickLength);
+}
+
+// Last tick at or before the date
+- (long long)tickPassedAt:(NSDate *)date
+{
+    return (long long)floor([date timeIntervalSinceReferenceDate] / self.tickLength);
+}
+
+// Only call on the queue.  Looks at the slots of all the ticks since the last one, at most one turn of the ring.
+- (void)tick
+{
+    NSDate *now = [NSDate date];
+    long long nowTick = [self tickPassedAt:now];
+    long long firstTick = MAX(self.lastTick + 1, nowTick - (long long)self.slots.count + 1);
+    NSMutableArray *dueKeys = [NSMutableArray new];
+    for (long long tick = firstTick; tick <= nowTick; tick++)
+    {
+        NSMutableDictionary *slot = self.slots[(NSUInteger)(tick % (long long)self.slots.count)];
+        for (NSString *key in [slot allKeys])
+        {
+            if ([slot[key] compare:now] != NSOrderedDescending)
+            {
+                [slot removeObjectForKey:key];
+                [self.slotOfKey removeObjectForKey:key];
+                [dueKeys addObject:key];
+            }
+        }
+    }
+    self.lastTick = MAX(self.lastTick, nowTick);
+    [self updateTimer];
+
+    if (dueKeys.count > 0)
+    {
+        OB_DEBUG(@"Timer wheel: %lu due, %lu waiting", (unsigned long)dueKeys.count, (unsigned long)self.slotOfKey.count);
+        self.handler(dueKeys);
+    }
+}
+
+// Only call on the queue
+- (void)updateTimer
+{
+    BOOL needed = self.slotOfKey.count > 0;
+    if (needed == self.timerRunning)
+        return;
+    self.timerRunning = needed;
+    if (needed)
+        dispatch_resume(self.timer);
+    else
+        dispatch_suspend(self.timer);
+}
+
+@end
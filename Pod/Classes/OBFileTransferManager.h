@@ -28,6 +28,8 @@ typedef struct
 
 - (void)fileTransferRetrying:(NSString *)markerId attemptCount:(NSUInteger)attemptCount withError:(NSError *)error;
 
+// Seconds to wait before trying a transfer again after its retryAttempt'th attempt failed.  The actual wait is
+// somewhere between half of that and all of it, so transfers that failed together don't retry together.
 - (NSTimeInterval)retryTimeoutValue:(NSInteger)retryAttempt;
 @end
 
@@ -43,6 +45,20 @@ extern NSString *const OBFTMDownloadDirectoryParam;                        // Fi
 extern NSString *const OBFTMUploadDirectoryParam;                          // FilePath for the default upload directory
 extern NSString *const OBFTMRemoteBaseUrlParam;                            // Default remote base URL (only valid for private file stores - for S3, Google cloud, etc these are predetermined)
 extern NSString *const OBFTMOnlyForegroundTransferParam;                    // Boolean to specify if we should liimit to foreground transfers
+extern NSString *const OBFTMPersistDelayParam;                             // Seconds we may wait before persisting task changes (default 1)
+extern NSString *const OBFTMPersistBatchSizeParam;                         // Number of changed tasks that forces them to be persisted right away (default 100)
+extern NSString *const OBFTMSegmentedDownloadThresholdParam;               // Downloads of at least this many bytes are fetched in parallel ranges (default 16MB, 0 = off)
+extern NSString *const OBFTMDownloadSegmentSizeParam;                      // Size of each range of a segmented download (default 8MB)
+extern NSString *const OBFTMMaxDownloadSegmentsParam;                      // Ranges of one download fetched at the same time (default 4)
+extern NSString *const OBFTMDownloadCacheSizeParam;                        // Bytes of downloaded files kept to serve repeated downloads (default 64MB, 0 = off)
+extern NSString *const OBFTMDeduplicateUploadsParam;                       // Boolean to skip uploads of content the server already has (default NO)
+extern NSString *const OBFTMMaxConcurrentTransfersParam;                   // Transfers in flight at the same time (default 8, 0 = no limit)
+extern NSString *const OBFTMMaxConcurrentTransfersPerHostParam;            // Transfers in flight to the same host (default 4, 0 = no limit)
+extern NSString *const OBFTMAdaptiveConcurrencyParam;                      // Boolean to adapt the transfers in flight to the link, up to MaxConcurrentTransfers (default YES)
+extern NSString *const OBFTMHostFailureThresholdParam;                     // Failures in a row after which nothing is sent to the host for a while (default 5, 0 = never)
+extern NSString *const OBFTMHostProbeIntervalParam;                        // Seconds before a failing host is probed again, doubling while it still fails (default 30)
+
+extern NSString *const OBFTMPriorityParamKey;                              // Transfer param: OBFileTransferPriority, or any other NSInteger (default Normal)
 
 @interface OBFileTransferManager : NSObject <NSURLSessionDelegate, NSURLSessionTaskDelegate, NSURLSessionDataDelegate, NSURLSessionDownloadDelegate>
 
@@ -54,6 +70,26 @@ extern NSString *const OBFTMOnlyForegroundTransferParam;                    // B
 @property (nonatomic, strong) NSString *remoteUrlBase;
 @property (nonatomic) NSUInteger maxAttempts;
 @property (nonatomic) BOOL foregroundTransferOnly;
+// Segmented downloads: a download first asks for its first byte to learn the size of the file.  If it is at least
+// segmentedDownloadThreshold and the server takes Range requests, the file is fetched as downloadSegmentSize ranges,
+// up to maxDownloadSegments at a time, written into place and renamed to the local file once complete.
+@property (nonatomic) long long segmentedDownloadThreshold;
+@property (nonatomic) long long downloadSegmentSize;
+@property (nonatomic) NSUInteger maxDownloadSegments;
+// Downloaded files are kept in a cache of up to downloadCacheSize bytes, least recently used first out.  Downloading a
+// URL we have again is a conditional GET, or no request at all while the server says the file is fresh.  0 turns it off.
+@property (nonatomic) long long downloadCacheSize;
+// Uploads are hashed first and skipped if the server already has the content where the file would go.  Each agent
+// decides how to check, see OBFileTransferAgent.
+@property (nonatomic) BOOL deduplicateUploads;
+// At most maxConcurrentTransfers transfers are in flight, and at most maxConcurrentTransfersPerHost to the same host.
+// The others wait with status FileTransferQueued; the one with the highest priority goes first, then the oldest.
+// A chunked upload or segmented download counts as one transfer.  0 means no limit.
+@property (nonatomic) NSUInteger maxConcurrentTransfers;
+@property (nonatomic) NSUInteger maxConcurrentTransfersPerHost;
+// With adaptiveConcurrency the number of transfers in flight follows the link: it goes up by one while that raises
+// goodput and is halved on timeouts or a burst of failures, never above maxConcurrentTransfers.
+@property (nonatomic) BOOL adaptiveConcurrency;
 
 @property (nonatomic, strong) id <OBFileTransferDelegate> delegate;
 
@@ -87,6 +123,14 @@ extern NSString *const OBFTMOnlyForegroundTransferParam;                    // B
           withMarker:(NSString *)markerId
           withParams:(NSDictionary *)params;
 
+// Batch versions of the above, e.g. to sync a whole album.  Each entry is a dictionary with MarkerKey, RemoteUrlKey,
+// LocalFilePathKey and optionally ParamsKey.  The entries are checked, tracked and saved together and then queued in
+// one go, which is much cheaper than one call per file.  A later entry with the same marker wins.  Returns the entries
+// that were rejected because they lack one of the required keys.
+- (NSArray *)uploadFiles:(NSArray *)transfers;
+
+- (NSArray *)downloadFiles:(NSArray *)transfers;
+
 /**
  * deleteFile is synchrounous and should be run on a background thread by the caller if async is required.
  */
@@ -96,6 +140,19 @@ extern NSString *const OBFTMOnlyForegroundTransferParam;                    // B
 
 - (void)cancelTransfer:(NSString *)marker onComplete:(void (^)())completionBlockOrNil;
 
+// Bulk versions of cancelTransfer and restartTransfer.  However many transfers, the session is only asked for its
+// tasks once and the task state is updated in one batch.  The completion is called once all are done.
+- (void)cancelTransfers:(NSArray *)markers onComplete:(void (^)())completionBlockOrNil;
+
+- (void)restartTransfers:(NSArray *)markers onComplete:(void (^)())completionBlockOrNil;
+
+// Cancel the transfers the predicate returns YES for, e.g. by marker prefix ([obTask.marker hasPrefix:...]), host
+// ([obTask remoteHost]) or direction (obTask.typeUpload)
+- (void)cancelTransfersMatching:(BOOL (^)(OBFileTransferTask *obTask))predicate onComplete:(void (^)())completionBlockOrNil;
+
+// Change the priority of a transfer.  Only matters while it is queued: a transfer in flight is not interrupted.
+- (void)setPriority:(NSInteger)priority forTransfer:(NSString *)marker;
+
 - (NSArray *)currentState;
 
 - (void)currentTransferStateWithCompletionHandler:(void (^)(NSArray *ftState))handler;
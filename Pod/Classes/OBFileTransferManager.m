@@ -19,6 +19,15 @@
 #import "OBFileTransferManager.h"
 #import "OBFileTransferTaskManager.h"
 #import "OBFTMError.h"
+#import "OBFileCloner.h"
+#import "OBDownloadCache.h"
+#import "OBDownloadProber.h"
+#import "OBContentHashIndex.h"
+#import "OBConcurrencyController.h"
+#import "OBTimerWheel.h"
+#import "OBReadyQueue.h"
+#import "OBHostCircuitBreaker.h"
+#import "OBChunkedUploadAgentProtocol.h"
 #import "OBS3ExceptionHandler.h"
 
 // *********************************
@@ -35,9 +44,34 @@
 @property (nonatomic) UIBackgroundTaskIdentifier backgroundTaskIdentifier;
 @property (nonatomic, strong) OBFileTransferTaskManager *transferTaskManager;
 @property (nonatomic, strong) NSDictionary *configParams;
-@property BOOL timerEngaged;
-@property (nonatomic, strong, readonly) NSMutableDictionary <NSURLSessionTask *, NSMutableData *> *XMLResponses;
+// Transfers pending retry, by marker, until their next attempt is due
+@property (nonatomic, strong) OBTimerWheel *retryWheel;
+// Bodies of the error responses (and of the S3 XML ones) of the running tasks, for the agents to make sense of
+@property (nonatomic, strong, readonly) NSMutableDictionary <NSURLSessionTask *, NSMutableData *> *responseBodies;
 @property (nonatomic, strong) OBS3ExceptionHandler *S3ExceptionHandler;
+// By agent class, the markers of the transfers waiting for the refresh of its credentials that is under way, and when
+// each is due
+@property (nonatomic, strong) NSMutableDictionary *credentialRefreshes;
+// Chunked uploads are started, continued and finished on this queue, since those steps may need synchronous calls to the server
+@property (nonatomic, strong) dispatch_queue_t chunkedUploadQueue;
+// Segmented downloads are set up and their segments sent on this queue
+@property (nonatomic, strong) dispatch_queue_t segmentedDownloadQueue;
+@property (nonatomic, strong) OBDownloadProber *downloadProber;
+// By download source (see downloadSourceOfObTask:), the size of the file as the last probe of it found
+@property (nonatomic, strong) NSCache *knownDownloadSizes;
+@property (nonatomic, strong) OBDownloadCache *downloadCache;
+// Uploads are hashed and checked for on the server on this queue
+@property (nonatomic, strong) dispatch_queue_t deduplicationQueue;
+@property (nonatomic, strong) OBContentHashIndex *contentHashIndex;
+// Markers of the transfers waiting for their turn, in the order they get it, and by marker the transfers that have theirs
+@property (nonatomic, strong) OBReadyQueue *readyTransfers;
+@property (nonatomic, strong) NSMutableDictionary *runningTransfers;
+@property (nonatomic, strong) OBConcurrencyController *concurrencyController;
+@property (nonatomic, strong) OBHostCircuitBreaker *hostCircuitBreaker;
+// Marker of the download in flight for each download source, and by marker of such a download, the markers of the
+// other downloads of the same file waiting for it
+@property (nonatomic, strong) NSMutableDictionary *inFlightDownloads;
+@property (nonatomic, strong) NSMutableDictionary *attachedDownloads;
 
 @end
 
@@ -48,6 +82,19 @@ NSString *const OBFTMDownloadDirectoryParam = @"DownloadDirectoryPath";
 NSString *const OBFTMUploadDirectoryParam = @"UploadDirectoryPath";                 // FilePath for the default upload directory
 NSString *const OBFTMRemoteBaseUrlParam = @"RemoteBaseUrl";                         // Default remote base URL (only valid for private file stores - for S3, Google cloud, etc these are predetermined)
 NSString *const OBFTMOnlyForegroundTransferParam = @"OnlyForeground";               // Boolean to specify if we should liimit to foreground transfers
+NSString *const OBFTMPersistDelayParam = @"PersistDelay";                           // Seconds we may wait before persisting task changes (default 1)
+NSString *const OBFTMPersistBatchSizeParam = @"PersistBatchSize";                   // Number of changed tasks that forces them to be persisted right away (default 100)
+NSString *const OBFTMSegmentedDownloadThresholdParam = @"SegmentedDownloadThreshold"; // Downloads of at least this many bytes are fetched in parallel ranges (default 16MB, 0 = off)
+NSString *const OBFTMDownloadSegmentSizeParam = @"DownloadSegmentSize";             // Size of each range of a segmented download (default 8MB)
+NSString *const OBFTMMaxDownloadSegmentsParam = @"MaxDownloadSegments";             // Ranges of one download fetched at the same time (default 4)
+NSString *const OBFTMDownloadCacheSizeParam = @"DownloadCacheSize";                 // Bytes of downloaded files kept to serve repeated downloads (default 64MB, 0 = off)
+NSString *const OBFTMDeduplicateUploadsParam = @"DeduplicateUploads";               // Boolean to skip uploads of content the server already has (default NO)
+NSString *const OBFTMMaxConcurrentTransfersParam = @"MaxConcurrentTransfers";       // Transfers in flight at the same time (default 8, 0 = no limit)
+NSString *const OBFTMMaxConcurrentTransfersPerHostParam = @"MaxConcurrentTransfersPerHost"; // Transfers in flight to the same host (default 4, 0 = no limit)
+NSString *const OBFTMAdaptiveConcurrencyParam = @"AdaptiveConcurrency";             // Boolean to adapt the transfers in flight to the link, up to MaxConcurrentTransfers (default YES)
+NSString *const OBFTMHostFailureThresholdParam = @"HostFailureThreshold";           // Failures in a row after which nothing is sent to the host for a while (default 5, 0 = never)
+NSString *const OBFTMHostProbeIntervalParam = @"HostProbeInterval";                 // Seconds before a failing host is probed again, doubling while it still fails (default 30)
+NSString *const OBFTMPriorityParamKey = @"_priority";                               // Transfer param: OBFileTransferPriority, or any other NSInteger
 
 @implementation OBFileTransferManager
 
@@ -56,6 +103,19 @@ static NSString *const OBFileTransferSessionIdentifier = @"com.onebeat.fileTrans
 
 #define INFINITE_ATTEMPTS 0
 
+#define DEFAULT_SEGMENTED_DOWNLOAD_THRESHOLD (16 * 1024 * 1024)
+#define DEFAULT_DOWNLOAD_SEGMENT_SIZE (8 * 1024 * 1024)
+#define DEFAULT_MAX_DOWNLOAD_SEGMENTS 4
+#define DEFAULT_DOWNLOAD_CACHE_SIZE (64 * 1024 * 1024)
+#define DEFAULT_MAX_CONCURRENT_TRANSFERS 8
+#define DEFAULT_MAX_CONCURRENT_TRANSFERS_PER_HOST 4
+// Where adaptive concurrency starts, and how high it may go if MaxConcurrentTransfers is 0
+#define INITIAL_ADAPTIVE_CONCURRENCY 4
+#define MAX_ADAPTIVE_CONCURRENCY 32
+#define MAX_RETRY_DELAY (60 * 60)
+#define RETRY_WHEEL_TICK 1.0
+#define RETRY_WHEEL_SLOTS 256
+
 //--------------
 // Instantiation
 //--------------
@@ -66,13 +126,54 @@ static NSString *const OBFileTransferSessionIdentifier = @"com.onebeat.fileTrans
     if (self)
     {
         _backgroundTaskIdentifier = UIBackgroundTaskInvalid;
-        _XMLResponses = [NSMutableDictionary new];
+        _responseBodies = [NSMutableDictionary new];
         _S3ExceptionHandler = [OBS3ExceptionHandler new];
-
+        _credentialRefreshes = [NSMutableDictionary new];
+        _chunkedUploadQueue = dispatch_queue_create("OBFileTransferManagerChunkedUploadQueue", NULL);
+        _segmentedDownloadQueue = dispatch_queue_create("OBFileTransferManagerSegmentedDownloadQueue", NULL);
+        _downloadProber = [OBDownloadProber new];
+        _knownDownloadSizes = [NSCache new];
+        _deduplicationQueue = dispatch_queue_create("OBFileTransferManagerDeduplicationQueue", NULL);
+        _segmentedDownloadThreshold = DEFAULT_SEGMENTED_DOWNLOAD_THRESHOLD;
+        _downloadSegmentSize = DEFAULT_DOWNLOAD_SEGMENT_SIZE;
+        _maxDownloadSegments = DEFAULT_MAX_DOWNLOAD_SEGMENTS;
+        _downloadCacheSize = DEFAULT_DOWNLOAD_CACHE_SIZE;
+        _inFlightDownloads = [NSMutableDictionary new];
+        _attachedDownloads = [NSMutableDictionary new];
+        _readyTransfers = [OBReadyQueue new];
+        _runningTransfers = [NSMutableDictionary new];
+        _maxConcurrentTransfers = DEFAULT_MAX_CONCURRENT_TRANSFERS;
+        _maxConcurrentTransfersPerHost = DEFAULT_MAX_CONCURRENT_TRANSFERS_PER_HOST;
+        _adaptiveConcurrency = YES;
+        _concurrencyController = [[OBConcurrencyController alloc] initWithLimit:INITIAL_ADAPTIVE_CONCURRENCY
+                                                                        minimum:1
+                                                                        maximum:DEFAULT_MAX_CONCURRENT_TRANSFERS];
+        _hostCircuitBreaker = [OBHostCircuitBreaker new];
+        __weak OBFileTransferManager *weakSelf = self;
+        _retryWheel = [[OBTimerWheel alloc] initWithTickLength:RETRY_WHEEL_TICK
+                                                     slotCount:RETRY_WHEEL_SLOTS
+                                                       handler:^(NSArray *dueKeys) {
+                                                           [weakSelf retryDueTransfers:dueKeys];
+                                                       }];
+
+        // Task changes are persisted lazily, so make sure they hit the disk before we may get killed
+        [[NSNotificationCenter defaultCenter] addObserver:self
+                                                 selector:@selector(flushTransferState)
+                                                     name:UIApplicationDidEnterBackgroundNotification
+                                                   object:nil];
+        [[NSNotificationCenter defaultCenter] addObserver:self
+                                                 selector:@selector(flushTransferState)
+                                                     name:UIApplicationWillTerminateNotification
+                                                   object:nil];
     }
     return self;
 }
 
+- (void)dealloc
+{
+    [[NSNotificationCenter defaultCenter] removeObserver:self];
+}
+
 // Right now we just return a single instance but in the future I could return multiple instances
 // if I want to have different delegates for each
 + (instancetype)instance
@@ -139,6 +240,42 @@ static NSString *const OBFileTransferSessionIdentifier = @"com.onebeat.fileTrans
     if (configuration[OBFTMRemoteBaseUrlParam])
         self.remoteUrlBase = configuration[OBFTMRemoteBaseUrlParam];
 
+    if (configuration[OBFTMPersistDelayParam])
+        self.transferTaskManager.persistDelay = [configuration[OBFTMPersistDelayParam] doubleValue];
+
+    if (configuration[OBFTMPersistBatchSizeParam])
+        self.transferTaskManager.persistBatchSize = [configuration[OBFTMPersistBatchSizeParam] unsignedIntegerValue];
+
+    if (configuration[OBFTMSegmentedDownloadThresholdParam])
+        self.segmentedDownloadThreshold = [configuration[OBFTMSegmentedDownloadThresholdParam] longLongValue];
+
+    if (configuration[OBFTMDownloadSegmentSizeParam])
+        self.downloadSegmentSize = MAX([configuration[OBFTMDownloadSegmentSizeParam] longLongValue], 1);
+
+    if (configuration[OBFTMMaxDownloadSegmentsParam])
+        self.maxDownloadSegments = MAX([configuration[OBFTMMaxDownloadSegmentsParam] unsignedIntegerValue], 1);
+
+    if (configuration[OBFTMDownloadCacheSizeParam])
+        self.downloadCacheSize = [configuration[OBFTMDownloadCacheSizeParam] longLongValue];
+
+    if (configuration[OBFTMDeduplicateUploadsParam])
+        self.deduplicateUploads = [configuration[OBFTMDeduplicateUploadsParam] boolValue];
+
+    if (configuration[OBFTMMaxConcurrentTransfersParam])
+        self.maxConcurrentTransfers = [configuration[OBFTMMaxConcurrentTransfersParam] unsignedIntegerValue];
+
+    if (configuration[OBFTMMaxConcurrentTransfersPerHostParam])
+        self.maxConcurrentTransfersPerHost = [configuration[OBFTMMaxConcurrentTransfersPerHostParam] unsignedIntegerValue];
+
+    if (configuration[OBFTMAdaptiveConcurrencyParam])
+        self.adaptiveConcurrency = [configuration[OBFTMAdaptiveConcurrencyParam] boolValue];
+
+    if (configuration[OBFTMHostFailureThresholdParam])
+        self.hostCircuitBreaker.failureThreshold = [configuration[OBFTMHostFailureThresholdParam] unsignedIntegerValue];
+
+    if (configuration[OBFTMHostProbeIntervalParam])
+        self.hostCircuitBreaker.openInterval = [configuration[OBFTMHostProbeIntervalParam] doubleValue];
+
 }
 
 // ---------------
@@ -158,6 +295,44 @@ static NSString *const OBFileTransferSessionIdentifier = @"com.onebeat.fileTrans
     return _transferTaskManager;
 }
 
+- (void)setDownloadCacheSize:(long long)downloadCacheSize
+{
+    _downloadCacheSize = downloadCacheSize;
+    @synchronized (self)
+    {
+        if (downloadCacheSize <= 0 && _downloadCache != nil)
+        {
+            [_downloadCache removeAll];
+            _downloadCache = nil;
+        }
+        _downloadCache.byteLimit = downloadCacheSize;
+    }
+}
+
+// nil when the download cache is off
+- (OBDownloadCache *)downloadCache
+{
+    @synchronized (self)
+    {
+        if (_downloadCache == nil && self.downloadCacheSize > 0)
+        {
+            NSString *directory = [[self tempDirectory] stringByAppendingPathComponent:@"DownloadCache"];
+            _downloadCache = [[OBDownloadCache alloc] initWithDirectory:directory byteLimit:self.downloadCacheSize];
+        }
+        return _downloadCache;
+    }
+}
+
+- (OBContentHashIndex *)contentHashIndex
+{
+    @synchronized (self)
+    {
+        if (_contentHashIndex == nil)
+            _contentHashIndex = [[OBContentHashIndex alloc] initWithFile:[[self tempDirectory] stringByAppendingPathComponent:@"UploadContentHashes.plist"]];
+        return _contentHashIndex;
+    }
+}
+
 // ---------------
 // Session methods
 // ---------------
@@ -260,19 +435,70 @@ static NSString *const OBFileTransferSessionIdentifier = @"com.onebeat.fileTrans
     }];
 }
 
-- (void)cancelSessionTask:(NSUInteger)taskIdentifier completion:(void (^)())completionBlockOrNil
+// Also cancels the tasks of the chunks or segments in flight.  Those are forgotten right away so their completion is ignored.
+- (void)cancelSessionTasksOfObTask:(OBFileTransferTask *)obTask completion:(void (^)())completionBlockOrNil
+{
+    [self cancelSessionTasksOfObTasks:@[obTask] keepResumeData:NO completion:completionBlockOrNil];
+}
+
+// Cancel the download task of the obTask, keeping its resume data for the next attempt
+- (void)cancelDownloadOfObTask:(OBFileTransferTask *)obTask completion:(void (^)())completionBlockOrNil
+{
+    [self cancelSessionTasksOfObTasks:@[obTask] keepResumeData:YES completion:completionBlockOrNil];
+}
+
+// Cancels the session tasks of all the obTasks with a single look at the session: the identifiers of their tasks are
+// mapped to them first, so each session task is a lookup.  With keepResumeData, plain downloads keep their resume data
+// for the next attempt.  The completion is called once all of them are cancelled.
+- (void)cancelSessionTasksOfObTasks:(NSArray *)obTasks
+                     keepResumeData:(BOOL)keepResumeData
+                         completion:(void (^)())completionBlockOrNil
 {
-    OB_DEBUG(@"Canceling session task %lu", (unsigned long)taskIdentifier);
+    NSMutableDictionary *obTasksByNsTaskIdentifier = [NSMutableDictionary dictionaryWithCapacity:obTasks.count];
+    for (OBFileTransferTask *obTask in obTasks)
+    {
+        NSArray *chunkNsTaskIdentifiers;
+        @synchronized (obTask)
+        {
+            chunkNsTaskIdentifiers = [obTask.activeChunks allKeys];
+        }
+        if (chunkNsTaskIdentifiers.count == 0)
+            obTasksByNsTaskIdentifier[@(obTask.nsTaskIdentifier)] = obTask;
+        for (NSNumber *identifier in chunkNsTaskIdentifiers)
+        {
+            [self.transferTaskManager finishedChunkNsTask:identifier.unsignedIntegerValue ofTask:obTask];
+            obTasksByNsTaskIdentifier[identifier] = obTask;
+        }
+    }
+
+    OB_DEBUG(@"Canceling session tasks of %lu transfers", (unsigned long)obTasks.count);
     [[self session] getTasksWithCompletionHandler:^(NSArray *dataTasks, NSArray *uploadTasks, NSArray *downloadTasks) {
+        dispatch_group_t group = dispatch_group_create();
         for (NSURLSessionTask *task in [uploadTasks arrayByAddingObjectsFromArray:downloadTasks])
         {
-            if (task.taskIdentifier == taskIdentifier)
+            OBFileTransferTask *obTask = obTasksByNsTaskIdentifier[@(task.taskIdentifier)];
+            if (obTask == nil)
+                continue;
+            if (keepResumeData && !obTask.typeUpload && !obTask.isSegmentedDownload &&
+                    [task isKindOfClass:[NSURLSessionDownloadTask class]])
+            {
+                OB_DEBUG(@"Canceling download task identifier %lu for resumption", (unsigned long)task.taskIdentifier);
+                dispatch_group_enter(group);
+                [(NSURLSessionDownloadTask *)task cancelByProducingResumeData:^(NSData *resumeData) {
+                    if (resumeData != nil)
+                        [self.transferTaskManager update:obTask withResumeData:resumeData];
+                    dispatch_group_leave(group);
+                }];
+            }
+            else
             {
-                OB_DEBUG(@"Canceling task identifier %lu", (unsigned long)taskIdentifier);
+                OB_DEBUG(@"Canceling task identifier %lu", (unsigned long)task.taskIdentifier);
                 [task cancel];
             }
         }
-        if (completionBlockOrNil) completionBlockOrNil();
+        dispatch_group_notify(group, dispatch_get_global_queue(DISPATCH_QUEUE_PRIORITY_DEFAULT, 0), ^{
+            if (completionBlockOrNil) completionBlockOrNil();
+        });
     }];
 }
 
@@ -306,7 +532,18 @@ static NSString *const OBFileTransferSessionIdentifier = @"com.onebeat.fileTrans
 - (void)reset:(void (^)())completionBlockOrNil
 {
     [self cancelSessionTasks:^{
-        self.timerEngaged = 0;
+        [self.retryWheel cancelAll];
+        [self.hostCircuitBreaker reset];
+        @synchronized (self.inFlightDownloads)
+        {
+            [self.inFlightDownloads removeAllObjects];
+            [self.attachedDownloads removeAllObjects];
+        }
+        @synchronized (self.readyTransfers)
+        {
+            [self.readyTransfers removeAllMarkers];
+            [self.runningTransfers removeAllObjects];
+        }
         [self.transferTaskManager reset];
         if (completionBlockOrNil) completionBlockOrNil();
     }];
@@ -316,10 +553,7 @@ static NSString *const OBFileTransferSessionIdentifier = @"com.onebeat.fileTrans
 // tasks that were pending.
 - (void)restartAllTasks:(void (^)())completionBlockOrNil
 {
-    for (OBFileTransferTask *obTask in self.transferTaskManager.allTasks)
-    {
-        [self restartTransferTask:obTask];
-    }
+    [self restartTransferTasks:self.transferTaskManager.allTasks completion:completionBlockOrNil];
 }
 
 // Upload the file at the indicated filePath to the remoteFileUrl (do not include target filename here!).
@@ -349,6 +583,16 @@ static NSString *const OBFileTransferSessionIdentifier = @"com.onebeat.fileTrans
     [self processTransfer:markerId remote:remoteFileUrl local:filePath params:params upload:NO];
 }
 
+- (NSArray *)uploadFiles:(NSArray *)transfers
+{
+    return [self processTransfers:transfers upload:YES];
+}
+
+- (NSArray *)downloadFiles:(NSArray *)transfers
+{
+    return [self processTransfers:transfers upload:NO];
+}
+
 - (NSError *)deleteFile:(NSString *)remoteUrl
 {
     NSString *fullPath = [self fullRemotePath:remoteUrl];
@@ -362,13 +606,57 @@ static NSString *const OBFileTransferSessionIdentifier = @"com.onebeat.fileTrans
 {
     OBFileTransferTask *obTask = [[self transferTaskManager] transferTaskWithMarker:marker];
     if (obTask != nil)
+        [self cancelTransferTasks:@[obTask] completion:completionBlockOrNil];
+}
+
+- (void)cancelTransfers:(NSArray *)markers onComplete:(void (^)())completionBlockOrNil
+{
+    NSMutableArray *obTasks = [NSMutableArray arrayWithCapacity:markers.count];
+    for (NSString *marker in markers)
     {
-        [self cancelSessionTask:obTask.nsTaskIdentifier completion:^{
-            [[self transferTaskManager] removeTaskWithMarker:marker];
-            if (completionBlockOrNil)
-                completionBlockOrNil();
-        }];
+        OBFileTransferTask *obTask = [[self transferTaskManager] transferTaskWithMarker:marker];
+        if (obTask != nil)
+            [obTasks addObject:obTask];
+    }
+    [self cancelTransferTasks:obTasks completion:completionBlockOrNil];
+}
+
+- (void)cancelTransfersMatching:(BOOL (^)(OBFileTransferTask *obTask))predicate onComplete:(void (^)())completionBlockOrNil
+{
+    NSMutableArray *obTasks = [NSMutableArray new];
+    for (OBFileTransferTask *obTask in self.transferTaskManager.allTasks)
+    {
+        if (predicate(obTask))
+            [obTasks addObject:obTask];
+    }
+    [self cancelTransferTasks:obTasks completion:completionBlockOrNil];
+}
+
+- (void)setPriority:(NSInteger)priority forTransfer:(NSString *)marker
+{
+    OBFileTransferTask *obTask = [[self transferTaskManager] transferTaskWithMarker:marker];
+    if (obTask != nil && obTask.priority != priority)
+    {
+        [[self transferTaskManager] update:obTask withPriority:priority];
+        @synchronized (self.readyTransfers)
+        {
+            if ([self.readyTransfers containsMarker:marker])
+                [self.readyTransfers addMarker:marker priority:priority];
+        }
+        [self scheduleTransfers];
+    }
+}
+
+- (void)restartTransfers:(NSArray *)markers onComplete:(void (^)())completionBlockOrNil
+{
+    NSMutableArray *obTasks = [NSMutableArray arrayWithCapacity:markers.count];
+    for (NSString *marker in markers)
+    {
+        OBFileTransferTask *obTask = [[self transferTaskManager] transferTaskWithMarker:marker];
+        if (obTask != nil)
+            [obTasks addObject:obTask];
     }
+    [self restartTransferTasks:obTasks completion:completionBlockOrNil];
 }
 
 // Cancel the transfer and restart it.  Return to the caller the information about the task that was just created.
@@ -418,13 +706,13 @@ static NSString *const OBFileTransferSessionIdentifier = @"com.onebeat.fileTrans
 }
 
 // Just a helpful status description, returning how many are pending
+// Transfers pending retry or waiting for their turn
 - (NSString *)pendingSummary
 {
-    NSInteger uploads = 0, downloads = 0;
-    for (OBFileTransferTask *task in [self.transferTaskManager pendingTasks])
-    {
-        if (task.typeUpload) uploads++; else downloads++;
-    }
+    NSUInteger uploads = [self.transferTaskManager countOfTasksWithStatus:FileTransferPendingRetry upload:YES] +
+            [self.transferTaskManager countOfTasksWithStatus:FileTransferQueued upload:YES];
+    NSUInteger downloads = [self.transferTaskManager countOfTasksWithStatus:FileTransferPendingRetry upload:NO] +
+            [self.transferTaskManager countOfTasksWithStatus:FileTransferQueued upload:NO];
     return [NSString stringWithFormat:@"%d up, %d down", (int)uploads, (int)downloads];
 }
 
@@ -450,9 +738,8 @@ static NSString *const OBFileTransferSessionIdentifier = @"com.onebeat.fileTrans
 // Retry all pending transfers
 - (void)retryPendingInternal
 {
-    //    Cancel any timers because we are retrying everything.  Then if there is a failure, we re-engage the timer
-    [NSObject cancelPreviousPerformRequestsWithTarget:self selector:@selector(retryPendingInternal) object:nil];
-    self.timerEngaged = NO;
+    //    Nothing waits for its retry time because we are retrying everything.  Whatever fails again gets a new one.
+    [self.retryWheel cancelAll];
 
     //    Not sure yet what the right thing to do is.... Even if we know the netowrk is not available, should we
     //    go through the motions of retrying, or just reset the timer?
@@ -465,7 +752,7 @@ static NSString *const OBFileTransferSessionIdentifier = @"com.onebeat.fileTrans
 
     } else {
         OB_INFO(@"Not retrying because network is not available");
-        [self setupRetryTimer];
+        ...
     }
 
     */
@@ -475,10 +762,7 @@ static NSString *const OBFileTransferSessionIdentifier = @"com.onebeat.fileTrans
     if (pendingTasks.count > 0)
     {
         OB_INFO(@"Retrying %lu pending tasks", (unsigned long)pendingTasks.count);
-        for (OBFileTransferTask *obTask in [self.transferTaskManager pendingTasks])
-        {
-            [self processObTask:obTask];
-        }
+        [self processObTasks:pendingTasks];
     }
 
 }
@@ -486,15 +770,70 @@ static NSString *const OBFileTransferSessionIdentifier = @"com.onebeat.fileTrans
 #pragma mark -- Internal
 
 // Kill the transfer wherever it is and restart it from scratch, but
-// up the attemptCount
+// up the attemptCount.  A download keeps the bytes it already has.
 - (void)restartTransferTask:(OBFileTransferTask *)obTask
 {
     if (obTask != nil)
+        [self restartTransferTasks:@[obTask] completion:nil];
+}
+
+- (void)restartTransferTasks:(NSArray *)obTasks completion:(void (^)())completionBlockOrNil
+{
+    if (obTasks.count == 0)
     {
-        [self cancelSessionTask:obTask.nsTaskIdentifier completion:^{
-            [self processObTask:obTask];
-        }];
+        if (completionBlockOrNil) completionBlockOrNil();
+        return;
+    }
+    [self cancelSessionTasksOfObTasks:obTasks keepResumeData:YES completion:^{
+        [self processObTasks:obTasks];
+        if (completionBlockOrNil) completionBlockOrNil();
+    }];
+}
+
+// Cancel the transfers and stop tracking them, all in one go
+- (void)cancelTransferTasks:(NSArray *)obTasks completion:(void (^)())completionBlockOrNil
+{
+    if (obTasks.count == 0)
+    {
+        if (completionBlockOrNil) completionBlockOrNil();
+        return;
     }
+    [self cancelSessionTasksOfObTasks:obTasks keepResumeData:NO completion:^{
+        NSMutableArray *attachedMarkers = [NSMutableArray new];
+        for (OBFileTransferTask *obTask in obTasks)
+        {
+            if (obTask.isChunkedUpload)
+                [self abortChunkedUpload:obTask];
+            if (obTask.isSegmentedDownload)
+                [[NSFileManager defaultManager] removeItemAtPath:[self segmentedDownloadFile:obTask] error:nil];
+            [attachedMarkers addObjectsFromArray:[self detachDownload:obTask]];
+        }
+        [[self transferTaskManager] removeTasks:obTasks];
+        @synchronized (self.readyTransfers)
+        {
+            for (OBFileTransferTask *obTask in obTasks)
+            {
+                if (self.runningTransfers[obTask.marker] == obTask)
+                    [self.runningTransfers removeObjectForKey:obTask.marker];
+                else if ([self.transferTaskManager transferTaskWithMarker:obTask.marker] == nil)
+                    [self.readyTransfers removeMarker:obTask.marker];
+            }
+        }
+        // The first attached download goes on its own and the others attach to it.  Those cancelled too are gone.
+        NSMutableArray *attachedTasks = [NSMutableArray new];
+        for (NSString *attachedMarker in attachedMarkers)
+        {
+            OBFileTransferTask *attachedTask = [[self transferTaskManager] transferTaskWithMarker:attachedMarker];
+            if (attachedTask != nil)
+                [attachedTasks addObject:attachedTask];
+        }
+        if (attachedTasks.count > 0)
+            [self processObTasks:attachedTasks];
+        else
+            [self scheduleTransfers];
+        if (completionBlockOrNil)
+            completionBlockOrNil();
+    }];
 }
 
 
@@ -507,6 +846,15 @@ static NSString *const OBFileTransferSessionIdentifier = @"com.onebeat.fileTrans
     NSString *fullRemoteUrl = [self fullRemotePath:remoteFileUrl];
     NSString *localFilePath;
 
+    // The priority is ours, the agents don't get to see it
+    NSInteger priority = [params[OBFTMPriorityParamKey] integerValue];
+    if (params[OBFTMPriorityParamKey] != nil)
+    {
+        NSMutableDictionary *agentParams = [params mutableCopy];
+        [agentParams removeObjectForKey:OBFTMPriorityParamKey];
+        params = agentParams;
+    }
+
     OBFileTransferTask *obTask;
     if (upload)
     {
@@ -524,142 +872,1405 @@ static NSString *const OBFileTransferSessionIdentifier = @"com.onebeat.fileTrans
                                                   withMarker:marker
                                                   withParams:params];
     }
+    if (priority != OBFileTransferPriorityNormal)
+        [self.transferTaskManager update:obTask withPriority:priority];
     [self processObTask:obTask];
 }
 
-// given an obTask, create a native file transfer task and process it
-- (void)processObTask:(OBFileTransferTask *)obTask
+// Same as processTransfer for each entry, but the task manager takes them all at once and the scheduler gets them all
+// before it gives out any turn.  Returns the rejected entries.
+- (NSArray *)processTransfers:(NSArray *)transfers upload:(BOOL)upload
 {
-    NSURLSessionTask *task = [self createNsTaskFromObTask:obTask];
-    [self.transferTaskManager processing:obTask withNsTask:task];
-    [task resume];
+    NSMutableArray *rejected = [NSMutableArray new];
+    // Later entries replace earlier ones with the same marker, as they would with separate calls
+    NSMutableDictionary *transfersByMarker = [NSMutableDictionary dictionaryWithCapacity:transfers.count];
+    NSMutableArray *markers = [NSMutableArray arrayWithCapacity:transfers.count];
+    for (NSDictionary *transfer in transfers)
+    {
+        NSDictionary *normalized = [self normalizedTransfer:transfer upload:upload];
+        if (normalized == nil)
+        {
+            OB_ERROR(@"Not transferring %@: needs a marker, a remote URL and a local file path", transfer);
+            [rejected addObject:transfer];
+            continue;
+        }
+        if (transfersByMarker[normalized[MarkerKey]] == nil)
+            [markers addObject:normalized[MarkerKey]];
+        transfersByMarker[normalized[MarkerKey]] = normalized;
+    }
+    if (markers.count == 0)
+        return rejected;
+
+    NSArray *obTasks = [self.transferTaskManager trackTransfers:[transfersByMarker objectsForKeys:markers notFoundMarker:@{}]
+                                                         upload:upload];
+    OB_INFO(@"Queueing %lu %@", (unsigned long)obTasks.count, upload ? @"uploads" : @"downloads");
+    [self processObTasks:obTasks];
+    return rejected;
 }
 
-// Create a NS Task from the OBTask info
-// NOTE: FileTransferAgents have different behavrior as to whether they create a multipart body
-//   For example, a standard server upload will do so as a multipart request, but the S3 agent does not.
-//   Since the background file transfer manager expects a file, if there is a multipart body, we need to write the whole
-//   thing to a file.  Once the file is written, we can just reuse this and in case there is a retry, we don't need
-//   to go through the process of re-encoding the request with the file again.  Note that we still create the request
-//   but without the file body.
-// WARN: above optimization will not work if the creation of the request headers depends on the file.
-- (NSURLSessionTask *)createNsTaskFromObTask:(OBFileTransferTask *)obTask
+// The entry the way trackTransfers:upload: takes it, nil if it lacks something
+- (NSDictionary *)normalizedTransfer:(NSDictionary *)transfer upload:(BOOL)upload
 {
-    NSURLSessionTask *task;
-    
-    OBFileTransferAgent *fileTransferAgent = [OBFileTransferAgentFactory fileTransferAgentInstance:obTask.remoteUrl
-                                                                                        withConfig:self.configParams];
-
-    NSFileManager *fileManager = [NSFileManager defaultManager];
-    
-    if (obTask.typeUpload)
+    if (![transfer isKindOfClass:[NSDictionary class]])
+        return nil;
+    NSString *marker = transfer[MarkerKey];
+    NSString *remoteUrl = transfer[RemoteUrlKey];
+    NSString *localFilePath = transfer[LocalFilePathKey];
+    NSDictionary *params = transfer[ParamsKey];
+    if (![marker isKindOfClass:[NSString class]] || marker.length == 0 ||
+            ![remoteUrl isKindOfClass:[NSString class]] ||
+            ![localFilePath isKindOfClass:[NSString class]] || localFilePath.length == 0 ||
+            (params != nil && ![params isKindOfClass:[NSDictionary class]]))
+        return nil;
+
+    NSMutableDictionary *normalized = [NSMutableDictionary dictionaryWithCapacity:5];
+    normalized[MarkerKey] = marker;
+    normalized[RemoteUrlKey] = [self fullRemotePath:remoteUrl];
+    normalized[LocalFilePathKey] = upload ? [self normalizeLocalUploadPath:localFilePath] : [self normalizeLocalDownloadPath:localFilePath];
+    if (params[OBFTMPriorityParamKey] != nil)
     {
+        normalized[PriorityKey] = @([params[OBFTMPriorityParamKey] integerValue]);
+        NSMutableDictionary *agentParams = [params mutableCopy];
+        [agentParams removeObjectForKey:OBFTMPriorityParamKey];
+        params = agentParams;
+    }
+    if (params != nil)
+        normalized[ParamsKey] = params;
+    return normalized;
+}
 
-        NSError *error;
-        NSMutableURLRequest *request;
+#pragma mark - Scheduling
 
-        // We create the file that needs to be transmitted in a local directory
-        if (![self isLocalFile:obTask.localFilePath])
-        {
-            request = [fileTransferAgent uploadFileRequest:obTask.localFilePath
-                                                        to:obTask.remoteUrl
-                                                withParams:obTask.params];
-            
-            NSString *tmpFile = [self temporaryFile:obTask.marker];
-            // If the file already exists, we should delete it...
-            
-            if ([fileManager fileExistsAtPath:tmpFile])
-            {
-                [fileManager removeItemAtPath:tmpFile error:&error];
-                
-                if (error != nil)
-                    OB_ERROR(@"Unable to delete existing temporary file %@", tmpFile);
-                else
-                    OB_DEBUG(@"Deleted existing tmp file %@", tmpFile);
+// Transfers wait in the ready queue for their turn: at most concurrencyLimit are in flight, and of those at most
+// maxConcurrentTransfersPerHost to the same host, and none to a host whose circuit breaker is open.  The waiting
+// transfer with the highest priority goes next, the oldest of those with the same priority (see OBReadyQueue).  A
+// transfer keeps its turn, chunks and segments included, until it completes, is queued for retry or is cancelled.
 
-                error = nil;
-            }
-            if (fileTransferAgent.hasMultipartBody)
-            {
-                if (![[request HTTPBody] writeToFile:tmpFile atomically:NO])
-                {
-                    error = [self createNSErrorForCode:OBFTMTmpFileCreateError];
-                }
-            }
-            else
-            {
-                [fileManager copyItemAtPath:obTask.localFilePath
-                                     toPath:tmpFile
-                                      error:&error];
-                
-                if (error != nil)
-                    OB_ERROR(@"Unable to copy file %@ to temporary file %@", obTask.localFilePath, tmpFile);
-            }
+// Start the transfer when its turn comes, right away if it already has it
+- (void)processObTask:(OBFileTransferTask *)obTask
+{
+    if (obTask == nil)
+        return;
 
-            if (error == nil)
+    BOOL hasTurn;
+    @synchronized (self.readyTransfers)
+    {
+        hasTurn = self.runningTransfers[obTask.marker] == obTask;
+        if (!hasTurn)
+            [self.readyTransfers addMarker:obTask.marker priority:obTask.priority];
+    }
+
+    if (hasTurn)
+    {
+        [self startObTask:obTask];
+        return;
+    }
+    if (obTask.status != FileTransferQueued)
+        [self.transferTaskManager update:obTask withStatus:FileTransferQueued];
+    [self scheduleTransfers];
+}
+
+// processObTask for many at once, with a single scheduling pass at the end
+- (void)processObTasks:(NSArray *)obTasks
+{
+    NSMutableArray *withTurn = [NSMutableArray new];
+    NSMutableArray *waiting = [NSMutableArray new];
+    @synchronized (self.readyTransfers)
+    {
+        for (OBFileTransferTask *obTask in obTasks)
+        {
+            if (self.runningTransfers[obTask.marker] == obTask)
             {
-                [self.transferTaskManager update:obTask withLocalFilePath:tmpFile];
+                [withTurn addObject:obTask];
             }
             else
             {
-                OB_ERROR(@"Unable to create transfer task because of error: %@", error.localizedDescription);
-                return nil;
+                [self.readyTransfers addMarker:obTask.marker priority:obTask.priority];
+                [waiting addObject:obTask];
             }
-
-        }
-        else
-        {
-            // filePath may not be nil because S3 needs to calculate contentLength as of IOS 8.
-            request = [fileTransferAgent uploadFileRequest:obTask.localFilePath
-                                                        to:obTask.remoteUrl
-                                                withParams:obTask.params];
         }
+    }
 
-        if (!self.foregroundTransferOnly)
-        {
-            request.networkServiceType = NSURLNetworkServiceTypeBackground;
-        }
+    for (OBFileTransferTask *obTask in waiting)
+    {
+        if (obTask.status != FileTransferQueued)
+            [self.transferTaskManager update:obTask withStatus:FileTransferQueued];
+    }
+    for (OBFileTransferTask *obTask in withTurn)
+    {
+        [self startObTask:obTask];
+    }
+    if (waiting.count > 0)
+        [self scheduleTransfers];
+}
 
-        // For now hardcode this!
-        request.allowsCellularAccess = YES;
-        
-        NSURL *fileURL = [NSURL fileURLWithPath:obTask.localFilePath];
-        
-        if (![fileManager fileExistsAtPath:fileURL.path])
+// Give turns to waiting transfers while there is room
+- (void)scheduleTransfers
+{
+    NSMutableArray *transfersToStart = [NSMutableArray new];
+    @synchronized (self.readyTransfers)
+    {
+        // Transfers that are no longer tracked, e.g. replaced by another one with the same marker, lose their turn
+        NSCountedSet *hosts = [NSCountedSet new];
+        for (NSString *marker in [self.runningTransfers allKeys])
         {
-            return nil;
+            OBFileTransferTask *obTask = self.runningTransfers[marker];
+            if ([self.transferTaskManager transferTaskWithMarker:marker] != obTask)
+                [self.runningTransfers removeObjectForKey:marker];
+            else
+                [hosts addObject:[self hostOfTransfer:obTask]];
         }
 
-        task = [[self session] uploadTaskWithRequest:request
-                                            fromFile:fileURL];
-
-    }
-    else
-    {
-        NSMutableURLRequest *request = [fileTransferAgent downloadFileRequest:obTask.remoteUrl
-                                                                   withParams:obTask.params];
-        if (!self.foregroundTransferOnly)
+        // One walk through the ready queue, in order, however many turns there are to give out.  A transfer passed
+        // over because of its host stays where it is.
+        NSUInteger limit = [self concurrencyLimit];
+        if (limit == 0 || self.runningTransfers.count < limit)
         {
-            request.networkServiceType = NSURLNetworkServiceTypeBackground;
+            [self.readyTransfers takeMarkersPassingTest:^BOOL(NSString *marker, BOOL *stop) {
+                OBFileTransferTask *obTask = [self.transferTaskManager transferTaskWithMarker:marker];
+                if (obTask == nil)
+                    return YES;
+                NSString *host = [self hostOfTransfer:obTask];
+                if (self.maxConcurrentTransfersPerHost > 0 && [hosts countForObject:host] >= self.maxConcurrentTransfersPerHost)
+                    return NO;
+                if (![self.hostCircuitBreaker allowsTransferTo:host])
+                    return NO;
+
+                self.runningTransfers[marker] = obTask;
+                [hosts addObject:host];
+                [self.hostCircuitBreaker startedTransferTo:host marker:marker];
+                [transfersToStart addObject:obTask];
+                *stop = limit != 0 && self.runningTransfers.count >= limit;
+                return YES;
+            }];
         }
-        
-        // For now hardcode this!
-        request.allowsCellularAccess = YES;
+    }
 
-        task = [[self session] downloadTaskWithRequest:request];
+    for (OBFileTransferTask *obTask in transfersToStart)
+    {
+        OB_DEBUG(@"Starting %@ transfer %@", @(obTask.priority), obTask.marker);
+        [self startObTask:obTask];
     }
-    
-    return task;
 }
 
-// Returns if the file is owned by the file transfer manager
-- (BOOL)isLocalFile:(NSString *)localFilePath
+- (NSString *)hostOfTransfer:(OBFileTransferTask *)obTask
 {
-    return ([localFilePath rangeOfString:[self tempDirectory]].location != NSNotFound);
+    NSString *host = [obTask remoteHost];
+    return host != nil ? host : @"";
 }
 
-#pragma mark - Delegates
-
+// The transfer gives up its turn, or its place in the ready queue
+- (void)transferLeft:(OBFileTransferTask *)obTask
+{
+    @synchronized (self.readyTransfers)
+    {
+        if (self.runningTransfers[obTask.marker] == obTask)
+            [self.runningTransfers removeObjectForKey:obTask.marker];
+        else if ([self.transferTaskManager transferTaskWithMarker:obTask.marker] == nil)
+            [self.readyTransfers removeMarker:obTask.marker];
+    }
+    [self scheduleTransfers];
+}
+
+- (void)setMaxConcurrentTransfers:(NSUInteger)maxConcurrentTransfers
+{
+    _maxConcurrentTransfers = maxConcurrentTransfers;
+    self.concurrencyController.maximumLimit = maxConcurrentTransfers > 0 ? maxConcurrentTransfers : MAX_ADAPTIVE_CONCURRENCY;
+    [self scheduleTransfers];
+}
+
+- (void)setMaxConcurrentTransfersPerHost:(NSUInteger)maxConcurrentTransfersPerHost
+{
+    _maxConcurrentTransfersPerHost = maxConcurrentTransfersPerHost;
+    [self scheduleTransfers];
+}
+
+- (void)setAdaptiveConcurrency:(BOOL)adaptiveConcurrency
+{
+    _adaptiveConcurrency = adaptiveConcurrency;
+    [self scheduleTransfers];
+}
+
+#pragma mark - Adaptive concurrency
+
+// The concurrency controller (see OBConcurrencyController) is fed the bytes moved by every session task and how each
+// transfer ended, chunked and segmented ones counting once, and moves the limit between 1 and
+// maxConcurrentTransfers.  Lowering it doesn't stop transfers in flight, new ones just wait until enough of them are
+// done.
+
+- (NSUInteger)concurrencyLimit
+{
+    return self.adaptiveConcurrency ? self.concurrencyController.limit : self.maxConcurrentTransfers;
+}
+
+- (void)measureCompletionOfNsTask:(NSURLSessionTask *)task clientError:(NSError *)clientError
+{
+    if (clientError.code == NSURLErrorCancelled)
+        return;
+    if ([self nsTask:task failedInTransit:clientError])
+        [self.concurrencyController transferFailed:clientError.code == NSURLErrorTimedOut];
+    else
+        [self.concurrencyController transferSucceeded];
+    [self adaptConcurrency];
+}
+
+// Only trouble with the network or the server counts: not cancellations, nor errors like a 404
+- (BOOL)nsTask:(NSURLSessionTask *)task failedInTransit:(NSError *)clientError
+{
+    NSInteger statusCode = ((NSHTTPURLResponse *)task.response).statusCode;
+    return clientError != nil || statusCode >= 500 || statusCode == 429;
+}
+
+// Called for every progress callback of every session task, so no lock is taken until the window is over
+- (void)measureBytesTransferred:(int64_t)bytes
+{
+    if (!self.adaptiveConcurrency)
+        return;
+    [self.concurrencyController transferredBytes:bytes];
+    if ([self.concurrencyController isWindowOverAt:[NSProcessInfo processInfo].systemUptime])
+        [self adaptConcurrency];
+}
+
+- (void)adaptConcurrency
+{
+    if (!self.adaptiveConcurrency)
+        return;
+    NSUInteger inFlight;
+    @synchronized (self.readyTransfers)
+    {
+        inFlight = self.runningTransfers.count;
+    }
+    if ([self.concurrencyController updateAt:[NSProcessInfo processInfo].systemUptime inFlight:inFlight])
+    {
+        OB_INFO(@"Up to %lu transfers in flight", (unsigned long)self.concurrencyController.limit);
+        [self scheduleTransfers];
+    }
+}
+
+#pragma mark - Host health
+
+// Session tasks that fail in transit count against the host of their transfer (see OBHostCircuitBreaker).  Once its
+// breaker opens, transfers to the host wait in the ready queue, retries included, until the breaker lets a probe
+// through; other hosts are not held up.
+
+- (void)updateHealthOfHostOf:(OBFileTransferTask *)obTask nsTask:(NSURLSessionTask *)task clientError:(NSError *)clientError
+{
+    // Not being connected at all is not the host's fault
+    if (clientError.code == NSURLErrorCancelled || [self isOfflineError:clientError])
+        return;
+
+    NSString *host = [self hostOfTransfer:obTask];
+    if (![self nsTask:task failedInTransit:clientError])
+    {
+        if ([self.hostCircuitBreaker transferSucceededTo:host marker:obTask.marker])
+            [self scheduleTransfers];
+        return;
+    }
+
+    NSDate *probeAt = [self.hostCircuitBreaker transferFailedTo:host marker:obTask.marker];
+    if (probeAt != nil)
+    {
+        dispatch_after(dispatch_time(DISPATCH_TIME_NOW, (int64_t)([probeAt timeIntervalSinceNow] * NSEC_PER_SEC)),
+                dispatch_get_global_queue(DISPATCH_QUEUE_PRIORITY_DEFAULT, 0), ^{
+                    [self scheduleTransfers];
+                });
+    }
+}
+
+- (BOOL)isOfflineError:(NSError *)error
+{
+    if (![error.domain isEqualToString:NSURLErrorDomain])
+        return NO;
+    return error.code == NSURLErrorNotConnectedToInternet ||
+            error.code == NSURLErrorInternationalRoamingOff ||
+            error.code == NSURLErrorCallIsActive ||
+            error.code == NSURLErrorDataNotAllowed;
+}
+
+// Create a native file transfer task for the obTask and start it
+- (void)startObTask:(OBFileTransferTask *)obTask
+{
+    if (obTask.typeUpload)
+    {
+        OBFileTransferAgent *fileTransferAgent = [OBFileTransferAgentFactory fileTransferAgentInstance:obTask.remoteUrl
+                                                                                            withConfig:self.configParams];
+        if (self.deduplicateUploads && obTask.contentHash == nil && !obTask.isChunkedUpload)
+        {
+            [self processDeduplicatedUpload:obTask agent:fileTransferAgent];
+            return;
+        }
+        if (obTask.isChunkedUpload || [self shouldUploadInChunks:obTask agent:fileTransferAgent])
+        {
+            [self processChunkedUpload:obTask agent:(id <OBChunkedUploadAgent>)fileTransferAgent];
+            return;
+        }
+    }
+    else
+    {
+        if (obTask.resumeData == nil && !obTask.isSegmentedDownload && [self.downloadCache isFreshUrl:[self downloadSourceOfObTask:obTask]] &&
+                [self downloadFromCache:obTask])
+        {
+            // Completion is reported asynchronously, the same as for a transfer that goes to the network
+            dispatch_async(self.segmentedDownloadQueue, ^{
+                [self transferCompleted:obTask error:nil];
+            });
+            return;
+        }
+        if ([self attachToInFlightDownload:obTask])
+            return;
+        if (obTask.isSegmentedDownload || [self mayBeSegmentedDownload:obTask])
+        {
+            [self processSegmentedDownload:obTask];
+            return;
+        }
+    }
+
+    NSURLSessionTask *task = [self createNsTaskFromObTask:obTask];
+    if (task == nil)
+    {
+        [self failObTaskWithoutNsTask:obTask];
+        return;
+    }
+    [self.transferTaskManager processing:obTask withNsTask:task];
+    [task resume];
+}
+
+// No session task could be made, e.g. the file to upload is gone.  Trying again won't help, and the transfer has to
+// give up its turn.  Reported asynchronously, as when a start fails on the network, so that a batch of these doesn't
+// recurse through scheduleTransfers.
+- (void)failObTaskWithoutNsTask:(OBFileTransferTask *)obTask
+{
+    OB_ERROR(@"Unable to create a session task for %@", obTask.marker);
+    NSError *error = [self createNSErrorForCode:obTask.typeUpload ? OBFTMTmpFileCreateError : OBFTMUnknownError];
+    dispatch_async(dispatch_get_global_queue(DISPATCH_QUEUE_PRIORITY_DEFAULT, 0), ^{
+        [self transferCompleted:obTask error:error];
+    });
+}
+
+// Create a NS Task from the OBTask info
+// NOTE: FileTransferAgents have different behavrior as to whether they create a multipart body
+//   For example, a standard server upload will do so as a multipart request, but the S3 agent does not.
+//   Since the background file transfer manager expects a file, if there is a multipart body, we need to write the whole
+//   thing to a file.  Once the file is written, we can just reuse this and in case there is a retry, we don't need
+//   to go through the process of re-encoding the request with the file again.  Note that we still create the request
+//   but without the file body.
+// WARN: above optimization will not work if the creation of the request headers depends on the file.
+- (NSURLSessionTask *)createNsTaskFromObTask:(OBFileTransferTask *)obTask
+{
+    NSURLSessionTask *task;
+    
+    OBFileTransferAgent *fileTransferAgent = [OBFileTransferAgentFactory fileTransferAgentInstance:obTask.remoteUrl
+                                                                                        withConfig:self.configParams];
+
+    NSFileManager *fileManager = [NSFileManager defaultManager];
+    
+    if (obTask.typeUpload)
+    {
+
+        NSError *error;
+        NSMutableURLRequest *request;
+
+        // We create the file that needs to be transmitted in a local directory
+        if (![self isLocalFile:obTask.localFilePath])
+        {
+            request = [fileTransferAgent uploadFileRequest:obTask.localFilePath
+                                                        to:obTask.remoteUrl
+                                                withParams:obTask.params];
+            
+            NSString *tmpFile = [self temporaryFile:obTask.marker];
+            // If the file already exists, we should delete it...
+            
+            if ([fileManager fileExistsAtPath:tmpFile])
+            {
+                [fileManager removeItemAtPath:tmpFile error:&error];
+                
+                if (error != nil)
+                    OB_ERROR(@"Unable to delete existing temporary file %@", tmpFile);
+                else
+                    OB_DEBUG(@"Deleted existing tmp file %@", tmpFile);
+
+                error = nil;
+            }
+            if (fileTransferAgent.hasMultipartBody)
+            {
+                // Stream the body straight to the file rather than building it in memory
+                OBMultipartBodyWriter *body = [fileTransferAgent uploadBodyForFile:obTask.localFilePath
+                                                                        withParams:obTask.params];
+                BOOL written = body != nil ? [body writeToFile:tmpFile error:nil] :
+                        [[request HTTPBody] writeToFile:tmpFile atomically:NO];
+                if (!written)
+                {
+                    error = [self createNSErrorForCode:OBFTMTmpFileCreateError];
+                }
+            }
+            else
+            {
+                // Clone rather than copy when the volume can (see OBFileCloner)
+                OBFileCloneMethod cloneMethod = [OBFileCloner cloneFileAtPath:obTask.localFilePath
+                                                                       toPath:tmpFile
+                                                                        error:&error];
+                if (cloneMethod == OBFileCloneFailed)
+                    OB_ERROR(@"Unable to copy file %@ to temporary file %@", obTask.localFilePath, tmpFile);
+                else
+                    OB_DEBUG(@"Staged %@ as %@ (method %lu)", obTask.localFilePath, tmpFile, (unsigned long)cloneMethod);
+            }
+
+            if (error == nil)
+            {
+                [self.transferTaskManager update:obTask withLocalFilePath:tmpFile];
+            }
+            else
+            {
+                OB_ERROR(@"Unable to create transfer task because of error: %@", error.localizedDescription);
+                return nil;
+            }
+
+        }
+        else
+        {
+            // filePath may not be nil because S3 needs to calculate contentLength as of IOS 8.
+            request = [fileTransferAgent uploadFileRequest:obTask.localFilePath
+                                                        to:obTask.remoteUrl
+                                                withParams:obTask.params];
+        }
+
+        if (!self.foregroundTransferOnly)
+        {
+            request.networkServiceType = NSURLNetworkServiceTypeBackground;
+        }
+
+        // For now hardcode this!
+        request.allowsCellularAccess = YES;
+        
+        NSURL *fileURL = [NSURL fileURLWithPath:obTask.localFilePath];
+        
+        if (![fileManager fileExistsAtPath:fileURL.path])
+        {
+            return nil;
+        }
+
+        task = [[self session] uploadTaskWithRequest:request
+                                            fromFile:fileURL];
+
+    }
+    else
+    {
+        // Pick up an interrupted download where it stopped.  The resume data is only good for one try.
+        if (obTask.resumeData != nil)
+        {
+            task = [[self session] downloadTaskWithResumeData:obTask.resumeData];
+            [self.transferTaskManager update:obTask withResumeData:nil];
+            if (task == nil)
+                OB_WARN(@"Unable to resume download of %@, starting over", obTask.marker);
+        }
+        if (task == nil)
+        {
+            NSMutableURLRequest *request = [self downloadRequestForObTask:obTask agent:fileTransferAgent];
+            [self addCacheValidators:request forObTask:obTask];
+            task = [[self session] downloadTaskWithRequest:request];
+        }
+    }
+    
+    return task;
+}
+
+- (NSMutableURLRequest *)downloadRequestForObTask:(OBFileTransferTask *)obTask agent:(OBFileTransferAgent *)fileTransferAgent
+{
+    NSMutableURLRequest *request = [fileTransferAgent downloadFileRequest:obTask.remoteUrl
+                                                               withParams:obTask.params];
+    if (!self.foregroundTransferOnly)
+    {
+        request.networkServiceType = NSURLNetworkServiceTypeBackground;
+    }
+
+    // For now hardcode this!
+    request.allowsCellularAccess = YES;
+    return request;
+}
+
+#pragma mark - Download cache
+
+// Downloaded files are kept in the download cache (see OBDownloadCache) under what they were downloaded from.  A
+// download of a file we have is served from the cache if the server said the file stays fresh, otherwise it becomes a
+// conditional GET and a 304 is served from the cache.  Either way the local file is a clone of the cached one.
+
+// Identifies what a download fetches.  The remote URL alone doesn't: the agents build the request from the params as
+// well, e.g. the S3 agent takes the object key from the filename and the server agent adds the params to the query.
+- (NSString *)downloadSourceOfObTask:(OBFileTransferTask *)obTask
+{
+    NSDictionary *params = obTask.params;
+    if (params.count == 0)
+        return obTask.remoteUrl;
+    NSMutableArray *pairs = [NSMutableArray arrayWithCapacity:params.count];
+    for (NSString *key in [[params allKeys] sortedArrayUsingSelector:@selector(compare:)])
+    {
+        [pairs addObject:[NSString stringWithFormat:@"%@=%@", key, params[key]]];
+    }
+    return [NSString stringWithFormat:@"%@ %@", obTask.remoteUrl, [pairs componentsJoinedByString:@"&"]];
+}
+
+- (void)addCacheValidators:(NSMutableURLRequest *)request forObTask:(OBFileTransferTask *)obTask
+{
+    NSDictionary *validators = [self.downloadCache validatorHeadersForUrl:[self downloadSourceOfObTask:obTask]];
+    if (validators.count == 0)
+        return;
+    // Make sure a 304 comes to us rather than being handled by the URL loading system
+    request.cachePolicy = NSURLRequestReloadIgnoringLocalCacheData;
+    [validators enumerateKeysAndObjectsUsingBlock:^(NSString *name, NSString *value, BOOL *stop) {
+        [request setValue:value forHTTPHeaderField:name];
+    }];
+}
+
+// Puts the cached file at the local file path of the download.  Returns NO if it isn't in the cache.
+- (BOOL)downloadFromCache:(OBFileTransferTask *)obTask
+{
+    if (![self.downloadCache materializeUrl:[self downloadSourceOfObTask:obTask] toPath:obTask.localFilePath])
+        return NO;
+    OB_INFO(@"Download %@ served from the cache", obTask.marker);
+    [self.transferTaskManager update:obTask withStatus:FileTransferDownloadFileReady];
+    return YES;
+}
+
+#pragma mark - Attached downloads
+
+// Only one download of a file is in flight at a time, going by the download source (see downloadSourceOfObTask:).
+// Other downloads of the same file, whatever their marker and local file, attach to it: they get its progress and
+// retries under their own marker, and when it completes a clone of its file (or its error).  If the download in
+// flight is cancelled, the first attached one takes over.  An attached download keeps the marker of the one it waits
+// for, so the attachments can be rebuilt after a relaunch.
+
+// Returns YES if the download was attached to another one of the same file.  Otherwise it becomes the one in flight.
+- (BOOL)attachToInFlightDownload:(OBFileTransferTask *)obTask
+{
+    NSString *source = [self downloadSourceOfObTask:obTask];
+    NSString *inFlightMarker;
+    @synchronized (self.inFlightDownloads)
+    {
+        inFlightMarker = self.inFlightDownloads[source];
+        OBFileTransferTask *inFlight = inFlightMarker != nil ? [self.transferTaskManager transferTaskWithMarker:inFlightMarker] : nil;
+        if (inFlight == nil || inFlight == obTask)
+        {
+            self.inFlightDownloads[source] = obTask.marker;
+            inFlightMarker = nil;
+        }
+        else
+        {
+            NSMutableOrderedSet *attached = self.attachedDownloads[inFlightMarker];
+            if (attached == nil)
+            {
+                attached = [NSMutableOrderedSet new];
+                self.attachedDownloads[inFlightMarker] = attached;
+            }
+            [attached addObject:obTask.marker];
+        }
+    }
+    if (inFlightMarker == nil)
+    {
+        // It was attached to a download that went away, e.g. was cancelled
+        if (obTask.leaderMarker != nil)
+            [self.transferTaskManager update:obTask withLeaderMarker:nil];
+        return NO;
+    }
+
+    OB_INFO(@"Download %@ attached to download %@ of the same file", obTask.marker, inFlightMarker);
+    [self.transferTaskManager update:obTask withLeaderMarker:inFlightMarker];
+    [self.transferTaskManager processing:obTask withNsTask:nil];
+    [self transferLeft:obTask];
+    return YES;
+}
+
+// Attached downloads are in progress without a session task of their own.  Those whose download in flight is still
+// there attach to it again, the others wait for their turn like any download.
+- (void)restoreAttachedDownloads
+{
+    NSUInteger attachedCount = 0;
+    for (OBFileTransferTask *obTask in [self.transferTaskManager processingTasks])
+    {
+        if (obTask.leaderMarker == nil)
+            continue;
+        OBFileTransferTask *leader = [self.transferTaskManager transferTaskWithMarker:obTask.leaderMarker];
+        if (leader != nil && !leader.typeUpload && leader.leaderMarker == nil &&
+                [[self downloadSourceOfObTask:leader] isEqualToString:[self downloadSourceOfObTask:obTask]])
+        {
+            @synchronized (self.inFlightDownloads)
+            {
+                self.inFlightDownloads[[self downloadSourceOfObTask:leader]] = leader.marker;
+                NSMutableOrderedSet *attached = self.attachedDownloads[leader.marker];
+                if (attached == nil)
+                {
+                    attached = [NSMutableOrderedSet new];
+                    self.attachedDownloads[leader.marker] = attached;
+                }
+                [attached addObject:obTask.marker];
+            }
+            attachedCount++;
+        }
+        else
+        {
+            OB_INFO(@"Download %@ was attached to %@, which is gone, queueing it", obTask.marker, obTask.leaderMarker);
+            [self.transferTaskManager update:obTask withLeaderMarker:nil];
+            [self.transferTaskManager update:obTask withStatus:FileTransferQueued];
+        }
+    }
+    if (attachedCount > 0)
+        OB_INFO(@"%lu downloads attached to others", (unsigned long)attachedCount);
+}
+
+- (NSArray *)markersAttachedToDownload:(OBFileTransferTask *)obTask
+{
+    if (obTask.typeUpload)
+        return @[];
+    @synchronized (self.inFlightDownloads)
+    {
+        NSOrderedSet *attached = self.attachedDownloads[obTask.marker];
+        return attached != nil ? [attached array] : @[];
+    }
+}
+
+// The download no longer goes on, returns the markers of the downloads that were attached to it
+- (NSArray *)detachDownload:(OBFileTransferTask *)obTask
+{
+    if (obTask.typeUpload)
+        return @[];
+    @synchronized (self.inFlightDownloads)
+    {
+        [[self.attachedDownloads allValues] makeObjectsPerformSelector:@selector(removeObject:) withObject:obTask.marker];
+        NSString *source = [self downloadSourceOfObTask:obTask];
+        if ([self.inFlightDownloads[source] isEqualToString:obTask.marker])
+            [self.inFlightDownloads removeObjectForKey:source];
+        NSArray *attached = [self.attachedDownloads[obTask.marker] array];
+        [self.attachedDownloads removeObjectForKey:obTask.marker];
+        return attached != nil ? attached : @[];
+    }
+}
+
+// Call once the download is done but before the delegate hears of it, since the delegate may move the file
+- (void)completeDownloadsAttachedTo:(OBFileTransferTask *)obTask error:(NSError *)error
+{
+    for (NSString *marker in [self detachDownload:obTask])
+    {
+        OBFileTransferTask *attachedTask = [self.transferTaskManager transferTaskWithMarker:marker];
+        if (attachedTask == nil)
+            continue;
+
+        NSError *attachedError = error;
+        if (error == nil && ![attachedTask.localFilePath isEqualToString:obTask.localFilePath])
+        {
+            NSFileManager *fileManager = [NSFileManager defaultManager];
+            [fileManager createDirectoryAtPath:[attachedTask.localFilePath stringByDeletingLastPathComponent]
+                   withIntermediateDirectories:YES
+                                    attributes:nil
+                                         error:nil];
+            [fileManager removeItemAtPath:attachedTask.localFilePath error:nil];
+            if ([OBFileCloner cloneFileAtPath:obTask.localFilePath toPath:attachedTask.localFilePath error:nil] == OBFileCloneFailed)
+                attachedError = [self createNSErrorForCode:OBFTMTmpDownloadFileCopyError];
+        }
+        OB_INFO(@"Download for %@ done along with %@%@", marker, obTask.marker, attachedError != nil ? [NSString stringWithFormat:@" with error %@", attachedError] : @"");
+        [[self transferTaskManager] removeTaskWithMarker:marker];
+        [self.delegate fileTransferCompleted:marker withError:attachedError];
+    }
+}
+
+// Returns if the file is owned by the file transfer manager
+- (BOOL)isLocalFile:(NSString *)localFilePath
+{
+    return ([localFilePath rangeOfString:[self tempDirectory]].location != NSNotFound);
+}
+
+#pragma mark - Upload deduplication
+
+// With deduplicateUploads, an upload is first hashed (SHA-256) and the agent asked whether the server already has that
+// content where the file would go (see OBFileTransferAgent).  If it does, the upload completes right away.  Otherwise
+// the hash goes along in the metadata of the upload, for the stores that keep it, and once the upload is done we
+// remember that the content is there in the content hash index.
+
+- (void)processDeduplicatedUpload:(OBFileTransferTask *)obTask agent:(OBFileTransferAgent *)fileTransferAgent
+{
+    // The attempt is counted once the upload is sent
+    [self.transferTaskManager update:obTask withStatus:FileTransferInProgress];
+    dispatch_async(self.deduplicationQueue, ^{
+        NSString *contentHash = [OBContentHashIndex sha256OfFileAtPath:obTask.localFilePath];
+        if (contentHash == nil)
+        {
+            // Not worth failing the upload over, the upload itself will tell if the file is gone.  The empty hash
+            // says we tried.
+            [self.transferTaskManager update:obTask withContentHash:@""];
+            [self processObTask:obTask];
+            return;
+        }
+
+        [self.transferTaskManager update:obTask withContentHash:contentHash];
+
+        BOOL knownUploaded = [self.contentHashIndex hasUploaded:contentHash to:[self uploadTargetOfObTask:obTask]];
+        if ([fileTransferAgent hasUploadOf:obTask.localFilePath
+                                        to:obTask.remoteUrl
+                                withParams:obTask.params
+                               contentHash:contentHash
+                             knownUploaded:knownUploaded])
+        {
+            OB_INFO(@"Server already has the content of upload %@, skipping it", obTask.marker);
+            if ([self isLocalFile:obTask.localFilePath])
+                [self uploadCompleted:obTask];
+            [self transferCompleted:obTask error:nil];
+            return;
+        }
+        [self processObTask:obTask];
+    });
+}
+
+// Identifies the remote object of an upload for the content hash index
+- (NSString *)uploadTargetOfObTask:(OBFileTransferTask *)obTask
+{
+    NSString *filename = obTask.params[FilenameParamKey];
+    return filename == nil ? obTask.remoteUrl : [NSString stringWithFormat:@"%@ %@", obTask.remoteUrl, filename];
+}
+
+// After an upload completed without error
+- (void)recordUploadedContent:(OBFileTransferTask *)obTask
+{
+    if (obTask.contentHash.length > 0)
+        [self.contentHashIndex recordUpload:obTask.contentHash to:[self uploadTargetOfObTask:obTask]];
+}
+
+#pragma mark - Chunked uploads
+
+// Large files may be sent in chunks, each its own upload task (see OBChunkedUploadAgent).  Several chunks may be in
+// flight at once and when one fails only that chunk is sent again.  Once the server has every chunk, the agent
+// puts the file together.
+
+- (BOOL)shouldUploadInChunks:(OBFileTransferTask *)obTask agent:(OBFileTransferAgent *)fileTransferAgent
+{
+    return [fileTransferAgent conformsToProtocol:@protocol(OBChunkedUploadAgent)] &&
+            [(id <OBChunkedUploadAgent>)fileTransferAgent shouldUploadInChunks:obTask.localFilePath withParams:obTask.params];
+}
+
+- (BOOL)isChunkNsTask:(NSURLSessionTask *)nsTask ofObTask:(OBFileTransferTask *)obTask
+{
+    if (obTask == nil)
+        return NO;
+    @synchronized (obTask)
+    {
+        return obTask.activeChunks[@(nsTask.taskIdentifier)] != nil;
+    }
+}
+
+- (void)processChunkedUpload:(OBFileTransferTask *)obTask agent:(id <OBChunkedUploadAgent>)agent
+{
+    [self.transferTaskManager processing:obTask withNsTask:nil];
+    dispatch_async(self.chunkedUploadQueue, ^{
+        if (![self stageChunkedUpload:obTask])
+        {
+            [self transferCompleted:obTask error:[self createNSErrorForCode:OBFTMTmpFileCreateError]];
+            return;
+        }
+
+        if (obTask.uploadId != nil && ![self reconcileChunkedUpload:obTask agent:agent])
+            return;
+
+        if (obTask.uploadId == nil)
+        {
+            NSError *error;
+            NSString *uploadId = [agent startChunkedUploadOf:obTask.localFilePath
+                                                          to:obTask.remoteUrl
+                                                  withParams:obTask.params
+                                                       error:&error];
+            if (uploadId == nil)
+            {
+                OB_WARN(@"Unable to start chunked upload for %@: %@", obTask.marker, error);
+                [self chunkedUploadFailed:obTask error:error];
+                return;
+            }
+            @synchronized (obTask)
+            {
+                obTask.uploadId = uploadId;
+                obTask.chunkedLength = (long long)[[[NSFileManager defaultManager] attributesOfItemAtPath:obTask.localFilePath error:nil] fileSize];
+                obTask.chunkSize = [agent chunkSize];
+            }
+            [self.transferTaskManager update:obTask withChunkReceipts:@{}];
+            OB_INFO(@"Started chunked upload %@ for %@: %ld chunks", uploadId, obTask.marker, (long)obTask.chunkCount);
+        }
+        [self sendChunks:obTask agent:agent];
+    });
+}
+
+// Only call on chunkedUploadQueue.  When resuming, the server is the authority on which chunks it has: a chunk may
+// have made it even though we never heard back, or the server may have dropped some.  Chunks in flight are left alone.
+// Clears the uploadId if the server no longer knows the upload.  Returns NO if the upload should not go on now.
+- (BOOL)reconcileChunkedUpload:(OBFileTransferTask *)obTask agent:(id <OBChunkedUploadAgent>)agent
+{
+    if (![agent respondsToSelector:@selector(receiptsForChunkedUpload:of:to:withParams:chunkSize:error:)])
+        return YES;
+
+    NSError *error;
+    NSDictionary *serverReceipts = [agent receiptsForChunkedUpload:obTask.uploadId
+                                                                of:obTask.localFilePath
+                                                                to:obTask.remoteUrl
+                                                        withParams:obTask.params
+                                                         chunkSize:obTask.chunkSize
+                                                             error:&error];
+    if (serverReceipts == nil && error != nil)
+    {
+        OB_WARN(@"Unable to check the chunks of upload %@ for %@: %@", obTask.uploadId, obTask.marker, error);
+        [self chunkedUploadFailed:obTask error:error];
+        return NO;
+    }
+
+    if (serverReceipts == nil)
+    {
+        // The server forgot about it (e.g. it was aborted or expired), start over
+        OB_INFO(@"Restarting chunked upload for %@", obTask.marker);
+        obTask.uploadId = nil;
+        [self.transferTaskManager update:obTask withChunkReceipts:@{}];
+        return YES;
+    }
+
+    NSMutableDictionary *receipts = [NSMutableDictionary new];
+    for (NSNumber *chunkNumber in serverReceipts)
+    {
+        if (chunkNumber.integerValue >= 1 && chunkNumber.integerValue <= obTask.chunkCount)
+            receipts[chunkNumber] = serverReceipts[chunkNumber];
+    }
+    OB_INFO(@"Resuming chunked upload for %@: server has %lu of %ld chunks", obTask.marker, (unsigned long)receipts.count, (long)obTask.chunkCount);
+    [self.transferTaskManager update:obTask withChunkReceipts:receipts];
+    return YES;
+}
+
+// Like the single uploads, the chunks are cut from a copy we own so the client may delete its file
+- (BOOL)stageChunkedUpload:(OBFileTransferTask *)obTask
+{
+    if ([self isLocalFile:obTask.localFilePath])
+        return YES;
+
+    NSString *tmpFile = [self temporaryFile:obTask.marker];
+    [[NSFileManager defaultManager] removeItemAtPath:tmpFile error:nil];
+    NSError *error;
+    if ([OBFileCloner cloneFileAtPath:obTask.localFilePath toPath:tmpFile error:&error] == OBFileCloneFailed)
+    {
+        OB_ERROR(@"Unable to copy file %@ to temporary file %@: %@", obTask.localFilePath, tmpFile, error.localizedDescription);
+        return NO;
+    }
+    [self.transferTaskManager update:obTask withLocalFilePath:tmpFile];
+    return YES;
+}
+
+// Only call on chunkedUploadQueue.  Keeps up to maxConcurrentChunks chunks in flight, lowest numbers first, and
+// finishes the upload once the server has all of them.
+- (void)sendChunks:(OBFileTransferTask *)obTask agent:(id <OBChunkedUploadAgent>)agent
+{
+    if ([self.transferTaskManager transferTaskWithMarker:obTask.marker] != obTask || obTask.status != FileTransferInProgress)
+        return;
+
+    NSInteger chunkCount = obTask.chunkCount;
+    NSUInteger maxConcurrent = MAX([agent maxConcurrentChunks], 1);
+    NSMutableArray *chunksToSend = [NSMutableArray new];
+    BOOL allSent;
+    @synchronized (obTask)
+    {
+        NSSet *inFlight = [NSSet setWithArray:[obTask.activeChunks allValues]];
+        NSUInteger available = maxConcurrent > inFlight.count ? maxConcurrent - inFlight.count : 0;
+        for (NSInteger chunkNumber = 1; chunkNumber <= chunkCount && chunksToSend.count < available; chunkNumber++)
+        {
+            if (obTask.chunkReceipts[@(chunkNumber)] == nil && ![inFlight containsObject:@(chunkNumber)])
+                [chunksToSend addObject:@(chunkNumber)];
+        }
+        allSent = obTask.chunkReceipts.count == (NSUInteger)chunkCount;
+    }
+
+    if (allSent)
+    {
+        [self finishChunkedUpload:obTask agent:agent];
+        return;
+    }
+
+    for (NSNumber *chunkNumber in chunksToSend)
+    {
+        NSURLSessionTask *task = [self createNsTaskForChunk:chunkNumber.integerValue ofObTask:obTask agent:agent];
+        if (task == nil)
+        {
+            [self transferCompleted:obTask error:[self createNSErrorForCode:OBFTMTmpFileCreateError]];
+            return;
+        }
+        [self.transferTaskManager processing:obTask withChunkNsTask:task chunk:chunkNumber.integerValue];
+        [task resume];
+    }
+}
+
+- (NSURLSessionTask *)createNsTaskForChunk:(NSInteger)chunkNumber
+                                  ofObTask:(OBFileTransferTask *)obTask
+                                     agent:(id <OBChunkedUploadAgent>)agent
+{
+    long long offset = [obTask offsetOfChunk:chunkNumber];
+    long long length = [obTask lengthOfChunk:chunkNumber];
+    NSString *chunkFile = [self chunkFile:chunkNumber ofObTask:obTask];
+    [[NSFileManager defaultManager] removeItemAtPath:chunkFile error:nil];
+    if (![OBFileCloner copyRangeOfFile:obTask.localFilePath offset:offset length:length toPath:chunkFile error:nil])
+        return nil;
+
+    NSMutableURLRequest *request = [agent chunkRequest:chunkNumber
+                                                offset:offset
+                                                length:length
+                                           totalLength:obTask.chunkedLength
+                                              uploadId:obTask.uploadId
+                                                    of:obTask.localFilePath
+                                                    to:obTask.remoteUrl
+                                            withParams:obTask.params];
+    if (!self.foregroundTransferOnly)
+    {
+        request.networkServiceType = NSURLNetworkServiceTypeBackground;
+    }
+    request.allowsCellularAccess = YES;
+
+    return [[self session] uploadTaskWithRequest:request fromFile:[NSURL fileURLWithPath:chunkFile]];
+}
+
+- (NSString *)chunkFile:(NSInteger)chunkNumber ofObTask:(OBFileTransferTask *)obTask
+{
+    return [[self temporaryFile:obTask.marker] stringByAppendingFormat:@".chunk%ld", (long)chunkNumber];
+}
+
+- (void)chunkNsTask:(NSURLSessionTask *)task
+           ofObTask:(OBFileTransferTask *)obTask
+completedWithClientError:(NSError *)clientError
+        serverError:(NSError *)serverError
+{
+    NSNumber *chunkNumber;
+    @synchronized (obTask)
+    {
+        chunkNumber = obTask.activeChunks[@(task.taskIdentifier)];
+    }
+    [self.transferTaskManager finishedChunkNsTask:task.taskIdentifier ofTask:obTask];
+    [[NSFileManager defaultManager] removeItemAtPath:[self chunkFile:chunkNumber.integerValue ofObTask:obTask] error:nil];
+
+    id <OBChunkedUploadAgent> agent = (id <OBChunkedUploadAgent>)[OBFileTransferAgentFactory fileTransferAgentInstance:obTask.remoteUrl
+                                                                                                          withConfig:self.configParams];
+    if (clientError == nil && serverError != nil &&
+            [agent respondsToSelector:@selector(isCompletedChunkResponse:forRequest:)] &&
+            [agent isCompletedChunkResponse:(NSHTTPURLResponse *)task.response forRequest:task.originalRequest])
+        serverError = nil;
+
+    NSString *receipt;
+    if (clientError == nil && serverError == nil)
+    {
+        receipt = [agent receiptForChunkResponse:(NSHTTPURLResponse *)task.response];
+        // Without its receipt the server can't be told to put the chunk in, so send it again
+        if (receipt == nil)
+            serverError = [NSError errorWithDomain:NSURLErrorDomain code:NSURLErrorBadServerResponse userInfo:nil];
+    }
+
+    if (clientError == nil && serverError == nil)
+    {
+        [self.transferTaskManager update:obTask withReceipt:receipt forChunk:chunkNumber.integerValue];
+        OB_DEBUG(@"Chunk %@ of %@ done", chunkNumber, obTask.marker);
+        dispatch_async(self.chunkedUploadQueue, ^{
+            [self sendChunks:obTask agent:agent];
+        });
+        return;
+    }
+
+    OB_WARN(@"Chunk %@ of %@ failed", chunkNumber, obTask.marker);
+    [self chunkNsTask:task failedForObTask:obTask clientError:clientError serverError:serverError];
+}
+
+// A chunk or segment failed: retry the whole transfer later, which only sends what is missing, or give up on it
+- (void)chunkNsTask:(NSURLSessionTask *)task
+    failedForObTask:(OBFileTransferTask *)obTask
+        clientError:(NSError *)clientError
+        serverError:(NSError *)serverError
+{
+    NSError *error = serverError != nil ? serverError : clientError;
+    OB_WARN(@"%@ of %@ failed with error %@", obTask.typeUpload ? @"Upload" : @"Download", obTask.marker, error);
+    // Another chunk already failed, the retry will take care of this one too
+    if (obTask.status == FileTransferPendingRetry)
+        return;
+    // A chunk that failed in transit counts as a failure of the whole transfer, the first one only
+    if ([self nsTask:task failedInTransit:clientError])
+        [self measureCompletionOfNsTask:task clientError:clientError];
+
+    OBRetryDecision *decision = [self retryDecisionFor:obTask nsTask:task clientError:clientError serverError:serverError];
+    if (decision != nil)
+    {
+        [self queueForRetry:obTask decision:decision];
+        [self transferRetrying:obTask error:error];
+    }
+    else
+    {
+        [self cancelSessionTasksOfObTask:obTask completion:^{
+            if (obTask.typeUpload)
+                [self abortChunkedUpload:obTask];
+            else
+                [[NSFileManager defaultManager] removeItemAtPath:[self segmentedDownloadFile:obTask] error:nil];
+            [self transferCompleted:obTask error:error];
+        }];
+    }
+}
+
+// Only call on chunkedUploadQueue
+- (void)finishChunkedUpload:(OBFileTransferTask *)obTask agent:(id <OBChunkedUploadAgent>)agent
+{
+    NSDictionary *receipts;
+    @synchronized (obTask)
+    {
+        receipts = [obTask.chunkReceipts copy];
+    }
+    NSError *error = [agent finishChunkedUpload:obTask.uploadId
+                                             of:obTask.localFilePath
+                                             to:obTask.remoteUrl
+                                     withParams:obTask.params
+                                       receipts:receipts];
+    if (error == nil)
+    {
+        [self uploadCompleted:obTask];
+        [self transferCompleted:obTask error:nil];
+    }
+    else
+    {
+        [self chunkedUploadFailed:obTask error:error];
+    }
+}
+
+// For the steps that talk to the server directly: the errors are either http status codes or client errors
+- (void)chunkedUploadFailed:(OBFileTransferTask *)obTask error:(NSError *)error
+{
+    BOOL serverError = [error.domain isEqualToString:NSURLErrorDomain] && error.code >= 300;
+    OBRetryDecision *decision = [self retryDecisionFor:obTask
+                                                nsTask:nil
+                                           clientError:serverError ? nil : error
+                                           serverError:serverError ? error : nil];
+    if (decision != nil)
+    {
+        [self queueForRetry:obTask decision:decision];
+        [self transferRetrying:obTask error:error];
+    }
+    else
+    {
+        [self abortChunkedUpload:obTask];
+        [self transferCompleted:obTask error:error];
+    }
+}
+
+- (void)abortChunkedUpload:(OBFileTransferTask *)obTask
+{
+    NSString *uploadId = obTask.uploadId;
+    if (uploadId == nil)
+        return;
+    id <OBChunkedUploadAgent> agent = (id <OBChunkedUploadAgent>)[OBFileTransferAgentFactory fileTransferAgentInstance:obTask.remoteUrl
+                                                                                                          withConfig:self.configParams];
+    NSString *filePath = obTask.localFilePath;
+    NSString *remoteUrl = obTask.remoteUrl;
+    NSDictionary *params = obTask.params;
+    dispatch_async(self.chunkedUploadQueue, ^{
+        [agent abortChunkedUpload:uploadId of:filePath to:remoteUrl withParams:params];
+    });
+}
+
+// For transfers that don't end with a single session task: chunked, segmented or from the download cache
+- (void)transferCompleted:(OBFileTransferTask *)obTask error:(NSError *)error
+{
+    NSString *marker = obTask.marker;
+    if ([self.transferTaskManager transferTaskWithMarker:marker] != obTask)
+        return;
+    OB_INFO(@"%@ for %@ done%@", obTask.typeUpload ? @"Upload" : @"Download", marker, error != nil ? [NSString stringWithFormat:@" with error %@", error] : @"");
+    [[self transferTaskManager] removeTaskWithMarker:marker];
+    if (obTask.typeUpload && error == nil)
+        [self recordUploadedContent:obTask];
+    // The session task of any other transfer was measured as it completed
+    if (error == nil && (obTask.isChunkedUpload || obTask.isSegmentedDownload))
+    {
+        [self.concurrencyController transferSucceeded];
+        [self adaptConcurrency];
+    }
+    [self completeDownloadsAttachedTo:obTask error:error];
+    [self transferLeft:obTask];
+    [self updateBackground];
+    [self.delegate fileTransferCompleted:marker withError:error];
+}
+
+#pragma mark - Segmented downloads
+
+// Large downloads may be fetched as byte ranges (segments), each its own download task, several at a time.  Each
+// segment is written at its offset into a file of the full size, which is renamed to the local file once all segments
+// are in.  Like chunks, a failed segment is fetched again on its own and the segments we have survive a relaunch.
+// This only relies on the download request of the agent taking a Range header, which holds for plain http, S3 and GCS.
+
+// Whether a download that isn't segmented yet is worth a probe: only if we don't know the file is too small.  The size
+// comes from the last probe of the URL, or else from the copy in the download cache.
+- (BOOL)mayBeSegmentedDownload:(OBFileTransferTask *)obTask
+{
+    if (self.segmentedDownloadThreshold <= 0 || obTask.resumeData != nil)
+        return NO;
+    NSString *source = [self downloadSourceOfObTask:obTask];
+    NSNumber *knownSize = [self.knownDownloadSizes objectForKey:source];
+    long long size = knownSize != nil ? knownSize.longLongValue : [self.downloadCache lengthOfUrl:source];
+    return size < 0 || size >= self.segmentedDownloadThreshold;
+}
+
+- (void)processSegmentedDownload:(OBFileTransferTask *)obTask
+{
+    [self.transferTaskManager processing:obTask withNsTask:nil];
+    dispatch_async(self.segmentedDownloadQueue, ^{
+        if (obTask.isSegmentedDownload && ![[NSFileManager defaultManager] fileExistsAtPath:[self segmentedDownloadFile:obTask]])
+        {
+            OB_WARN(@"Segments of %@ are gone, starting over", obTask.marker);
+            [self resetSegmentedDownload:obTask];
+        }
+
+        if (obTask.isSegmentedDownload)
+            [self sendSegments:obTask];
+        else
+            [self probeDownload:obTask];
+    });
+}
+
+// Asks for the first byte to find out the size of the file and whether the server takes ranges.  If we have the file
+// in the cache the request is conditional, so the answer may also be a 304.  Only the headers of the answer are read,
+// and the probes of several downloads go at the same time.
+- (void)probeDownload:(OBFileTransferTask *)obTask
+{
+    OBFileTransferAgent *fileTransferAgent = [OBFileTransferAgentFactory fileTransferAgentInstance:obTask.remoteUrl
+                                                                                        withConfig:self.configParams];
+    NSMutableURLRequest *request = [self downloadRequestForObTask:obTask agent:fileTransferAgent];
+    [request setValue:@"bytes=0-0" forHTTPHeaderField:@"Range"];
+    [self addCacheValidators:request forObTask:obTask];
+    NSInteger attempt = obTask.attemptCount;
+    [self.downloadProber probe:request completion:^(NSHTTPURLResponse *response) {
+        dispatch_async(self.segmentedDownloadQueue, ^{
+            [self startDownload:obTask attempt:attempt afterProbe:response];
+        });
+    }];
+}
+
+// Only call on segmentedDownloadQueue
+- (void)startDownload:(OBFileTransferTask *)obTask attempt:(NSInteger)attempt afterProbe:(NSHTTPURLResponse *)response
+{
+    long long length = [self lengthOfProbedDownload:response];
+    if (length >= 0)
+        [self.knownDownloadSizes setObject:@(length) forKey:[self downloadSourceOfObTask:obTask]];
+
+    // Cancelled, or started again, while the probe was out
+    if ([self.transferTaskManager transferTaskWithMarker:obTask.marker] != obTask ||
+            obTask.status != FileTransferInProgress || obTask.attemptCount != attempt)
+        return;
+
+    if (response.statusCode == 304 && [self downloadFromCache:obTask])
+    {
+        [self transferCompleted:obTask error:nil];
+        return;
+    }
+    if ([self startSegmentedDownload:obTask probe:response])
+    {
+        [self sendSegments:obTask];
+        return;
+    }
+
+    // Small, or the server doesn't do ranges
+    NSURLSessionTask *task = [self createNsTaskFromObTask:obTask];
+    if (task == nil)
+    {
+        [self failObTaskWithoutNsTask:obTask];
+        return;
+    }
+    [self.transferTaskManager update:obTask withNsTask:task];
+    [task resume];
+}
+
+// Size of the file from the answer to a probe, -1 if it doesn't say
+- (long long)lengthOfProbedDownload:(NSHTTPURLResponse *)response
+{
+    if (response.statusCode == 200)
+        return response.expectedContentLength;
+    if (response.statusCode != 206)
+        return -1;
+    // Content-Range: bytes 0-0/<size>, the size may be * if unknown
+    NSString *contentRange = [OBFileTransferAgent headerNamed:@"Content-Range" ofResponse:response];
+    NSRange slash = [contentRange rangeOfString:@"/"];
+    long long length = slash.location == NSNotFound ? 0 : [[contentRange substringFromIndex:slash.location + 1] longLongValue];
+    return length > 0 ? length : -1;
+}
+
+// Only call on segmentedDownloadQueue.  Returns YES if the probe says the download should go in segments, which are
+// then set up.
+- (BOOL)startSegmentedDownload:(OBFileTransferTask *)obTask probe:(NSHTTPURLResponse *)response
+{
+    if (response.statusCode != 206)
+        return NO;
+    long long length = [self lengthOfProbedDownload:response];
+    if (length < self.segmentedDownloadThreshold || length <= 0)
+        return NO;
+
+    NSString *validator = [OBFileTransferAgent headerNamed:@"ETag" ofResponse:response];
+    if (validator == nil)
+        validator = [OBFileTransferAgent headerNamed:@"Last-Modified" ofResponse:response];
+
+    if (![OBFileCloner preallocateFileAtPath:[self segmentedDownloadFile:obTask] length:length error:nil])
+        return NO;
+
+    @synchronized (obTask)
+    {
+        obTask.chunkedLength = length;
+        obTask.chunkSize = self.downloadSegmentSize;
+        obTask.downloadValidator = validator;
+    }
+    [self.transferTaskManager update:obTask withChunkReceipts:@{}];
+    OB_INFO(@"Downloading %@ in %ld segments of %lld bytes", obTask.marker, (long)obTask.chunkCount, obTask.chunkSize);
+    return YES;
+}
+
+// Forget the segments, the next attempt finds out the size again
+- (void)resetSegmentedDownload:(OBFileTransferTask *)obTask
+{
+    @synchronized (obTask)
+    {
+        obTask.chunkSize = 0;
+        obTask.chunkedLength = 0;
+        obTask.downloadValidator = nil;
+    }
+    [self.transferTaskManager update:obTask withChunkReceipts:@{}];
+    [[NSFileManager defaultManager] removeItemAtPath:[self segmentedDownloadFile:obTask] error:nil];
+}
+
+// Only call on segmentedDownloadQueue.  Keeps up to maxDownloadSegments segments in flight, lowest numbers first, and
+// finishes the download once we have all of them.
+- (void)sendSegments:(OBFileTransferTask *)obTask
+{
+    if ([self.transferTaskManager transferTaskWithMarker:obTask.marker] != obTask ||
+            obTask.status != FileTransferInProgress || !obTask.isSegmentedDownload)
+        return;
+
+    NSInteger segmentCount = obTask.chunkCount;
+    NSMutableArray *segmentsToSend = [NSMutableArray new];
+    BOOL allReceived;
+    @synchronized (obTask)
+    {
+        NSSet *inFlight = [NSSet setWithArray:[obTask.activeChunks allValues]];
+        NSUInteger available = self.maxDownloadSegments > inFlight.count ? self.maxDownloadSegments - inFlight.count : 0;
+        for (NSInteger segmentNumber = 1; segmentNumber <= segmentCount && segmentsToSend.count < available; segmentNumber++)
+        {
+            if (obTask.chunkReceipts[@(segmentNumber)] == nil && ![inFlight containsObject:@(segmentNumber)])
+                [segmentsToSend addObject:@(segmentNumber)];
+        }
+        allReceived = obTask.chunkReceipts.count == (NSUInteger)segmentCount;
+    }
+
+    if (allReceived)
+    {
+        [self finishSegmentedDownload:obTask];
+        return;
+    }
+
+    OBFileTransferAgent *fileTransferAgent = [OBFileTransferAgentFactory fileTransferAgentInstance:obTask.remoteUrl
+                                                                                        withConfig:self.configParams];
+    for (NSNumber *segmentNumber in segmentsToSend)
+    {
+        long long offset = [obTask offsetOfChunk:segmentNumber.integerValue];
+        NSMutableURLRequest *request = [self downloadRequestForObTask:obTask agent:fileTransferAgent];
+        [request setValue:[NSString stringWithFormat:@"bytes=%lld-%lld", offset, offset + [obTask lengthOfChunk:segmentNumber.integerValue] - 1]
+       forHTTPHeaderField:@"Range"];
+        // If the file changed the server sends all of it, which we take as a sign to start over
+        if (obTask.downloadValidator != nil)
+            [request setValue:obTask.downloadValidator forHTTPHeaderField:@"If-Range"];
+
+        NSURLSessionTask *task = [[self session] downloadTaskWithRequest:request];
+        [self.transferTaskManager processing:obTask withChunkNsTask:task chunk:segmentNumber.integerValue];
+        [task resume];
+    }
+}
+
+- (NSString *)segmentedDownloadFile:(OBFileTransferTask *)obTask
+{
+    return [[self temporaryFile:obTask.marker] stringByAppendingString:@".download"];
+}
+
+// Called from didFinishDownloadingToURL with a 2xx response.  Only a 206 for exactly the range we asked for counts,
+// anything else means the file changed or the server ignored the range, so the download starts over.
+- (void)segmentNsTask:(NSURLSessionDownloadTask *)task ofObTask:(OBFileTransferTask *)obTask downloadedTo:(NSURL *)location
+{
+    NSNumber *segmentNumber;
+    @synchronized (obTask)
+    {
+        segmentNumber = obTask.activeChunks[@(task.taskIdentifier)];
+    }
+    if (segmentNumber == nil || !obTask.isSegmentedDownload)
+        return;
+
+    long long offset = [obTask offsetOfChunk:segmentNumber.integerValue];
+    long long length = [obTask lengthOfChunk:segmentNumber.integerValue];
+    NSHTTPURLResponse *response = (NSHTTPURLResponse *)task.response;
+    NSString *expectedRange = [NSString stringWithFormat:@"bytes %lld-%lld/%lld", offset, offset + length - 1, obTask.chunkedLength];
+    NSString *contentRange = [OBFileTransferAgent headerNamed:@"Content-Range" ofResponse:response];
+    if (response.statusCode != 206 || ![contentRange isEqualToString:expectedRange])
+    {
+        OB_WARN(@"Segment %@ of %@ came back as %ld %@ instead of %@, starting over", segmentNumber, obTask.marker, (long)response.statusCode, contentRange, expectedRange);
+        [self resetSegmentedDownload:obTask];
+        return;
+    }
+
+    if ([OBFileCloner writeFileAtPath:location.path intoFile:[self segmentedDownloadFile:obTask] atOffset:offset error:nil])
+        [self.transferTaskManager update:obTask withReceipt:@"" forChunk:segmentNumber.integerValue];
+}
+
+- (void)segmentNsTask:(NSURLSessionTask *)task
+             ofObTask:(OBFileTransferTask *)obTask
+completedWithClientError:(NSError *)clientError
+          serverError:(NSError *)serverError
+{
+    NSNumber *segmentNumber;
+    BOOL received;
+    @synchronized (obTask)
+    {
+        segmentNumber = obTask.activeChunks[@(task.taskIdentifier)];
+        received = segmentNumber != nil && obTask.chunkReceipts[segmentNumber] != nil;
+    }
+    [self.transferTaskManager finishedChunkNsTask:task.taskIdentifier ofTask:obTask];
+
+    if (received)
+    {
+        OB_DEBUG(@"Segment %@ of %@ done", segmentNumber, obTask.marker);
+        dispatch_async(self.segmentedDownloadQueue, ^{
+            [self sendSegments:obTask];
+        });
+        return;
+    }
+
+    // The segment arrived but could not be used
+    if (clientError == nil && serverError == nil)
+        clientError = [NSError errorWithDomain:NSURLErrorDomain code:NSURLErrorCannotWriteToFile userInfo:nil];
+    OB_WARN(@"Segment %@ of %@ failed", segmentNumber, obTask.marker);
+    [self chunkNsTask:task failedForObTask:obTask clientError:clientError serverError:serverError];
+}
+
+// Only call on segmentedDownloadQueue
+- (void)finishSegmentedDownload:(OBFileTransferTask *)obTask
+{
+    NSString *segmentedFile = [self segmentedDownloadFile:obTask];
+    NSString *localFilePath = obTask.localFilePath;
+    NSError *error;
+    [[NSFileManager defaultManager] createDirectoryAtPath:[localFilePath stringByDeletingLastPathComponent]
+                              withIntermediateDirectories:YES
+                                               attributes:nil
+                                                    error:nil];
+    // rename() replaces the local file atomically, so it never holds a partial download
+    if (rename([segmentedFile fileSystemRepresentation], [localFilePath fileSystemRepresentation]) != 0)
+    {
+        OB_ERROR(@"Unable to move downloaded file to '%@': %s", localFilePath, strerror(errno));
+        error = [self createNSErrorForCode:OBFTMTmpDownloadFileCopyError];
+    }
+    else
+    {
+        [self.transferTaskManager update:obTask withStatus:FileTransferDownloadFileReady];
+        // The validator we kept is whichever of the two the server sent
+        NSString *validator = obTask.downloadValidator;
+        BOOL isETag = [validator hasPrefix:@"\""] || [validator hasPrefix:@"W/"];
+        [self.downloadCache storeFile:localFilePath
+                               forUrl:[self downloadSourceOfObTask:obTask]
+                                 etag:isETag ? validator : nil
+                         lastModified:isETag ? nil : validator
+                            expiresOn:nil];
+    }
+    [self transferCompleted:obTask error:error];
+}
+
+#pragma mark - Delegates
+
 // ------
 // Upload & Download Completion Handling
 // ------
@@ -671,19 +2282,18 @@ static NSString *const OBFileTransferSessionIdentifier = @"com.onebeat.fileTrans
 // NOTE: Server errors are not reported through the error parameter. The only errors your delegate receives through the error parameter are client-side errors, such as being unable to resolve the hostname or connect to the host. Server errors need to be discerned from the response.
 - (void)URLSession:(NSURLSession *)session task:(NSURLSessionTask *)task didCompleteWithError:(NSError *)clientError
 {
-    NSMutableData *data = self.XMLResponses[task];
+    NSMutableData *data = self.responseBodies[task];
 
     if (data)
     {
         [self.S3ExceptionHandler addResponse:data forTask:task];
     }
 
-    [self.XMLResponses removeObjectForKey:task];
-
     OBFileTransferTask *obtask = [[self transferTaskManager] transferTaskForNSTask:task];
 
     if (obtask == nil)
     {
+        [self forgetResponseOfNsTask:task];
         if (clientError.code == NSURLErrorCancelled)
             OB_INFO(@"Unable to find reference for task Identifier %lu because it had been cancelled", (unsigned long)task
                     .taskIdentifier);
@@ -691,19 +2301,64 @@ static NSString *const OBFileTransferSessionIdentifier = @"com.onebeat.fileTrans
             OB_ERROR(@"Unable to find reference for task Identifier %lu", (unsigned long)task.taskIdentifier);
         return;
     }
+    [self updateHealthOfHostOf:obtask nsTask:task clientError:clientError];
 
 
     NSString *marker = obtask.marker;
     NSHTTPURLResponse *response = (NSHTTPURLResponse *)task.response;
     NSError *serverError = [self createErrorFromHttpResponse:response.statusCode];
 
+    if ([self isChunkNsTask:task ofObTask:obtask])
+    {
+        if (obtask.typeUpload)
+            [self chunkNsTask:task ofObTask:obtask completedWithClientError:clientError serverError:serverError];
+        else
+            [self segmentNsTask:task ofObTask:obtask completedWithClientError:clientError serverError:serverError];
+        [self forgetResponseOfNsTask:task];
+        return;
+    }
+    [self measureCompletionOfNsTask:task clientError:clientError];
+
+    // Failed and cancelled downloads tell us how to resume them
+    NSData *resumeData = clientError.userInfo[NSURLSessionDownloadTaskResumeDataKey];
+    if (!obtask.typeUpload && resumeData != nil)
+    {
+        OB_DEBUG(@"Keeping resume data of download %@", marker);
+        [self.transferTaskManager update:obtask withResumeData:resumeData];
+    }
+
     if (task.state != NSURLSessionTaskStateCompleted)
     {
-        [self.S3ExceptionHandler removeResponseForTask:task];
+        [self forgetResponseOfNsTask:task];
         OB_ERROR(@"Indicated that task completed but state = %d", (int)task.state);
         return;
     }
 
+    if (!obtask.typeUpload && response.statusCode == 304)
+    {
+        [self forgetResponseOfNsTask:task];
+        if ([self downloadFromCache:obtask])
+        {
+            [self handleCompleted:task obtask:obtask error:nil];
+        }
+        else
+        {
+            OB_WARN(@"Download %@ not modified but no longer in the cache, starting over", marker);
+            [self.downloadCache removeUrl:[self downloadSourceOfObTask:obtask]];
+            [self processObTask:obtask];
+        }
+        return;
+    }
+
+    if ([self isRefusedResume:task ofObTask:obtask serverError:serverError])
+    {
+        OB_INFO(@"Server refused to resume download %@ (%@), starting over", marker, serverError);
+        [self forgetResponseOfNsTask:task];
+        [self.transferTaskManager update:obtask withResumeData:nil];
+        [self processObTask:obtask];
+        return;
+    }
+
     NSError *error = nil;
     NSString *transferType = obtask.typeUpload ? @"Upload" : @"Download";
 
@@ -711,7 +2366,7 @@ static NSString *const OBFileTransferSessionIdentifier = @"com.onebeat.fileTrans
     if (serverError == nil && clientError == nil)
     {
 
-        [self.S3ExceptionHandler removeResponseForTask:task];
+        [self forgetResponseOfNsTask:task];
 
         if (obtask.typeUpload)
         {
@@ -742,17 +2397,11 @@ static NSString *const OBFileTransferSessionIdentifier = @"com.onebeat.fileTrans
             error = serverError;
         }
 
-        BOOL isRetryableServerError = [self isRetryableServerError:serverError] || [self.S3ExceptionHandler isRetryableExceptionFromTask:task];
-        BOOL isRetryableClientError = [self isRetryableClientError:clientError];
-        BOOL canAttempt = self.maxAttempts == 0 || obtask.attemptCount < self.maxAttempts;
-
-        BOOL shouldRetry = isRetryableClientError && isRetryableServerError && canAttempt;
-
-        if (shouldRetry)
+        OBRetryDecision *decision = [self retryDecisionFor:obtask nsTask:task clientError:clientError serverError:serverError];
+        if (decision != nil)
         {
-            [[self transferTaskManager] queueForRetry:obtask];
-            [self setupRetryTimer];
-            [self.delegate fileTransferRetrying:marker attemptCount:obtask.attemptCount withError:error];
+            [self queueForRetry:obtask decision:decision];
+            [self transferRetrying:obtask error:error];
         }
         else
         {
@@ -761,104 +2410,71 @@ static NSString *const OBFileTransferSessionIdentifier = @"com.onebeat.fileTrans
         }
     }
 
-    [self.S3ExceptionHandler removeResponseForTask:task];
+    [self forgetResponseOfNsTask:task];
 }
 
-// Note this is correct handling for S3 errors. If we find that various agents are different with respect to determining permanent failures
-// then we probably need to move this method in the agent.
-- (BOOL)isRetryableServerError:(NSError *)error
+// A resumed download asks for the rest of the file with Range and If-Range.  If the file changed in the meantime the
+// server says so with 412 or 416, in which case we start over rather than give up.
+- (BOOL)isRefusedResume:(NSURLSessionTask *)task ofObTask:(OBFileTransferTask *)obtask serverError:(NSError *)serverError
 {
-    if (error == nil)
-        return YES;
-
-    if (error.code / 100 == 4)
-        return NO;
-
-    if (error.code == 501)
+    if (obtask.typeUpload || (serverError.code != 412 && serverError.code != 416))
         return NO;
-
-    if (error.code == 301)
-        return NO;
-
-    return YES;
+    NSURLRequest *request = task.currentRequest != nil ? task.currentRequest : task.originalRequest;
+    return [request valueForHTTPHeaderField:@"Range"] != nil;
 }
 
-- (BOOL)isRetryableClientError:(NSError *)error
-{
-    switch (error.code)
-    {
-        // Retry these
-        case NSURLErrorCannotConnectToHost:
-        case NSURLErrorDataLengthExceedsMaximum:
-        case NSURLErrorNetworkConnectionLost:
-        case NSURLErrorDNSLookupFailed:
-        case NSURLErrorHTTPTooManyRedirects:
-        case NSURLErrorNotConnectedToInternet:
-        case NSURLErrorRedirectToNonExistentLocation:
-        case NSURLErrorBadServerResponse:
-        case NSURLErrorUserCancelledAuthentication:
-        case NSURLErrorUserAuthenticationRequired:
-        case NSURLErrorZeroByteResource:
-        case NSURLErrorCannotDecodeRawData:
-        case NSURLErrorCannotDecodeContentData:
-        case NSURLErrorCannotParseResponse:
-        case NSURLErrorInternationalRoamingOff:
-        case NSURLErrorCallIsActive:
-        case NSURLErrorDataNotAllowed:
-        case NSURLErrorRequestBodyStreamExhausted:
-        case NSURLErrorNoPermissionsToReadFile:
-        case NSURLErrorSecureConnectionFailed:
-        case NSURLErrorServerCertificateHasBadDate:
-        case NSURLErrorServerCertificateUntrusted:
-        case NSURLErrorServerCertificateHasUnknownRoot:
-        case NSURLErrorServerCertificateNotYetValid:
-        case NSURLErrorClientCertificateRejected:
-        case NSURLErrorClientCertificateRequired:
-        case NSURLErrorCannotLoadFromNetwork:
-        case NSURLErrorCannotCreateFile:
-        case NSURLErrorCannotOpenFile:
-        case NSURLErrorCannotCloseFile:
-        case NSURLErrorCannotWriteToFile:
-        case NSURLErrorCannotRemoveFile:
-        case NSURLErrorCannotMoveFile:
-        case NSURLErrorDownloadDecodingFailedMidStream:
-        case NSURLErrorDownloadDecodingFailedToComplete:
-            return YES;
-
-            // Dont Retry these
-        case NSURLErrorResourceUnavailable:
-        case NSURLErrorFileDoesNotExist:
-        case NSURLErrorFileIsDirectory:
-            return NO;
-
-        default:
-            return YES;
+// Nil if the transfer shouldn't be tried again.  What went wrong is up to the agent of the transfer to tell, since the
+// same status code can mean different things from different stores.
+- (OBRetryDecision *)retryDecisionFor:(OBFileTransferTask *)obtask
+                               nsTask:(NSURLSessionTask *)task
+                          clientError:(NSError *)clientError
+                          serverError:(NSError *)serverError
+{
+    OBFileTransferAgent *agent = [OBFileTransferAgentFactory fileTransferAgentInstance:obtask.remoteUrl
+                                                                            withConfig:self.configParams];
+    NSHTTPURLResponse *response = [task.response isKindOfClass:[NSHTTPURLResponse class]] ? (NSHTTPURLResponse *)task.response : nil;
+    NSData *body = task != nil ? self.responseBodies[task] : nil;
+    OBRetryDecision *decision = [agent retryDecisionForResponse:response
+                                                           body:body
+                                                          error:clientError != nil ? clientError : serverError];
+    if (decision.action == OBRetryActionFail)
+    {
+        OB_INFO(@"Not retrying %@: %@", obtask.marker, decision.reason);
+        return nil;
     }
-    return YES;
+    if (self.maxAttempts != 0 && obtask.attemptCount >= self.maxAttempts)
+        return nil;
+    return decision;
+}
+
+- (void)forgetResponseOfNsTask:(NSURLSessionTask *)task
+{
+    [self.responseBodies removeObjectForKey:task];
+    [self.S3ExceptionHandler removeResponseForTask:task];
 }
 
 
 // -------
-// Log any xml data
+// Keep xml data and error bodies
 // -------
 
 - (void)URLSession:(NSURLSession *)session
           dataTask:(NSURLSessionDataTask *)task
     didReceiveData:(nonnull NSData *)receivedData
 {
-    if (![task.response.MIMEType isEqualToString:@"application/xml"])
+    if (![task.response.MIMEType isEqualToString:@"application/xml"] && ((NSHTTPURLResponse *)task.response).statusCode < 400)
     {
         return;
     }
 
     if (task.state == NSURLSessionTaskStateRunning || task.state == NSURLSessionTaskStateCompleted)
     {
-        NSMutableData *data = self.XMLResponses[task];
+        NSMutableData *data = self.responseBodies[task];
 
         if (!data)
         {
             data = [NSMutableData new];
-            self.XMLResponses[task] = data;
+            self.responseBodies[task] = data;
         }
 
         [data appendData:receivedData];
@@ -876,12 +2492,25 @@ static NSString *const OBFileTransferSessionIdentifier = @"com.onebeat.fileTrans
           totalBytesSent:(int64_t)totalBytesSent
 totalBytesExpectedToSend:(int64_t)totalBytesExpectedToSend
 {
-    NSString *marker = [[self transferTaskManager] markerForNSTask:task];
+    [self measureBytesTransferred:bytesSent];
+    OBFileTransferTask *obTask = [[self transferTaskManager] transferTaskForNSTask:task];
+    if ([self isChunkNsTask:task ofObTask:obTask])
+    {
+        // Report the progress of the whole file rather than of the chunk
+        @synchronized (obTask)
+        {
+            NSNumber *chunkNumber = obTask.activeChunks[@(task.taskIdentifier)];
+            if (chunkNumber != nil)
+                obTask.chunkBytesTransferred[chunkNumber] = @(totalBytesSent);
+        }
+        totalBytesSent = [obTask chunkedBytesTransferred];
+        totalBytesExpectedToSend = obTask.chunkedLength;
+    }
+    NSString *marker = obTask.marker;
     double percentDone = 100 * totalBytesSent / totalBytesExpectedToSend;
     OB_DEBUG(@"Upload progress %@: %lu%% [sent:%llu, of:%llu]", marker, (unsigned long)percentDone, totalBytesSent, totalBytesExpectedToSend);
     if ([self.delegate respondsToSelector:@selector(fileTransferProgress:progress:)])
     {
-        NSString *marker = [[self transferTaskManager] markerForNSTask:task];
         OBTransferProgress progress = {
                 .bytesWritten = totalBytesSent,
                 .totalBytes = totalBytesExpectedToSend,
@@ -903,18 +2532,35 @@ totalBytesExpectedToSend:(int64_t)totalBytesExpectedToSend
         totalBytesWritten:(int64_t)totalBytesWritten
 totalBytesExpectedToWrite:(int64_t)totalBytesExpectedToWrite
 {
-    NSString *marker = [[self transferTaskManager] markerForNSTask:task];
+    [self measureBytesTransferred:bytesWritten];
+    OBFileTransferTask *obTask = [[self transferTaskManager] transferTaskForNSTask:task];
+    if ([self isChunkNsTask:task ofObTask:obTask])
+    {
+        // Report the progress of the whole file rather than of the segment
+        @synchronized (obTask)
+        {
+            NSNumber *segmentNumber = obTask.activeChunks[@(task.taskIdentifier)];
+            if (segmentNumber != nil)
+                obTask.chunkBytesTransferred[segmentNumber] = @(totalBytesWritten);
+        }
+        totalBytesWritten = [obTask chunkedBytesTransferred];
+        totalBytesExpectedToWrite = obTask.chunkedLength;
+    }
+    NSString *marker = obTask.marker;
     double percentDone = 100 * totalBytesWritten / totalBytesExpectedToWrite;
     OB_DEBUG(@"Download progress %@: %lu%% [received:%llu, of:%llu]", marker, (unsigned long)percentDone, totalBytesWritten, totalBytesExpectedToWrite);
     if ([self.delegate respondsToSelector:@selector(fileTransferProgress:progress:)])
     {
-        NSString *marker = [[self transferTaskManager] markerForNSTask:task];
         OBTransferProgress progress = {
                 .bytesWritten = totalBytesWritten,
                 .totalBytes = totalBytesExpectedToWrite,
                 .percentDone = percentDone
         };
         [self.delegate fileTransferProgress:marker progress:progress];
+        for (NSString *attachedMarker in [self markersAttachedToDownload:obTask])
+        {
+            [self.delegate fileTransferProgress:attachedMarker progress:progress];
+        }
     }
 }
 
@@ -932,7 +2578,12 @@ didFinishDownloadingToURL:(NSURL *)location
         return;
     }
 
-    if (response.statusCode / 100 == 2)
+    if (response.statusCode / 100 == 2 && [self isChunkNsTask:downloadTask ofObTask:obtask])
+    {
+        // The segment file goes away when we return
+        [self segmentNsTask:downloadTask ofObTask:obtask downloadedTo:location];
+    }
+    else if (response.statusCode / 100 == 2)
     {
         // Now we need to copy the file to our downloads location...
         NSError *error;
@@ -951,12 +2602,21 @@ didFinishDownloadingToURL:(NSURL *)location
         else
         {
             [self.transferTaskManager update:obtask withStatus:FileTransferDownloadFileReady];
+            [self.downloadCache storeFile:localFilePath forUrl:[self downloadSourceOfObTask:obtask] response:response];
         }
     }
+    else if (response.statusCode == 304)
+    {
+        // Served from the download cache once the task completes
+        OB_DEBUG(@"Download %@ not modified", obtask.marker);
+    }
     else
     {
 
-        [self.S3ExceptionHandler addResponse:[NSData dataWithContentsOfURL:location] forTask:downloadTask];
+        // Goes to the exception handler and the agent when the task completes
+        NSData *body = [NSData dataWithContentsOfURL:location];
+        if (body != nil)
+            self.responseBodies[downloadTask] = [body mutableCopy];
 
         OB_ERROR(@"FTM:downloadTaskDidFinishDownloading: got non 200 response for downloadTask: %@ This should never happen. Current_state: %@ reponse: %@", downloadTask, [self currentState], response);
     }
@@ -968,7 +2628,8 @@ didFinishDownloadingToURL:(NSURL *)location
  didResumeAtOffset:(int64_t)fileOffset
 expectedTotalBytes:(int64_t)expectedTotalBytes
 {
-    OB_WARN(@" Got download resume but haven't implemented it yet!");
+    NSString *marker = [[self transferTaskManager] markerForNSTask:downloadTask];
+    OB_INFO(@"Resumed download %@ at %lld of %lld bytes", marker, fileOffset, expectedTotalBytes);
 }
 
 
@@ -989,6 +2650,8 @@ expectedTotalBytes:(int64_t)expectedTotalBytes
         }
         else
         {
+            // We may be suspended as soon as we call the completion handler
+            [self flushTransferState];
             self.backgroundSessionCompletionHandler();
             self.backgroundSessionCompletionHandler = nil;
             OB_INFO(@"Flushing session %@.", [self session].configuration.identifier);
@@ -1031,10 +2694,24 @@ didReceiveChallenge:(NSURLAuthenticationChallenge *)challenge
 {
     NSString *marker = obtask.marker;
     [[self transferTaskManager] removeTransferTaskForNsTask:task];
+    if (obtask.typeUpload && error == nil)
+        [self recordUploadedContent:obtask];
+    [self completeDownloadsAttachedTo:obtask error:error];
+    [self transferLeft:obtask];
     [self updateBackground];
     [self.delegate fileTransferCompleted:marker withError:error];
 }
 
+- (void)transferRetrying:(OBFileTransferTask *)obTask error:(NSError *)error
+{
+    [self transferLeft:obTask];
+    [self.delegate fileTransferRetrying:obTask.marker attemptCount:obTask.attemptCount withError:error];
+    for (NSString *marker in [self markersAttachedToDownload:obTask])
+    {
+        [self.delegate fileTransferRetrying:marker attemptCount:obTask.attemptCount withError:error];
+    }
+}
+
 - (NSError *)uploadCompleted:(OBFileTransferTask *)obTask;
 {
     NSError *error;
@@ -1046,24 +2723,208 @@ didReceiveChallenge:(NSURLAuthenticationChallenge *)challenge
     return error;
 }
 
-- (void)setupRetryTimer
+#pragma mark - Retries
+
+// Each transfer pending retry has its own next attempt time, saved with it, and waits for it on the retry wheel (see
+// OBTimerWheel), which only hands back the transfers that are due.  The delay grows with the attempts of the transfer
+// and is jittered, so transfers that failed together don't all come back together.
+
+// The delay of the decision, e.g. from a Retry-After header, wins over our own
+- (void)queueForRetry:(OBFileTransferTask *)obTask decision:(OBRetryDecision *)decision
 {
-    if (!self.timerEngaged)
+    // If going right away didn't help the last time, it won't this time either
+    BOOL immediate = decision.delay <= 0 && !obTask.retriedImmediately &&
+            (decision.action == OBRetryActionNow || decision.action == OBRetryActionRefreshCredentials);
+    obTask.retriedImmediately = immediate;
+
+    NSTimeInterval delay;
+    if (decision.delay > 0)
+        delay = MIN(decision.delay, MAX_RETRY_DELAY);
+    else if (immediate)
+        delay = 0;
+    else
+        delay = [self retryDelayAfterAttempt:obTask.attemptCount];
+    NSDate *nextAttemptAt = [NSDate dateWithTimeIntervalSinceNow:delay];
+    [[self transferTaskManager] queueForRetry:obTask at:nextAttemptAt];
+    OB_INFO(@"Retrying %@ in %.0f seconds", obTask.marker, delay);
+    dispatch_async(dispatch_get_main_queue(), ^{
+        [self requestBackground];
+    });
+
+    if (decision.action == OBRetryActionRefreshCredentials)
     {
-        self.timerEngaged = YES;
-        [self.transferTaskManager updateRetryTimerCount];
-        NSUInteger retryTimerValue;
-        if ([self.delegate respondsToSelector:@selector(retryTimeoutValue:)])
-            retryTimerValue = [self.delegate retryTimeoutValue:self.transferTaskManager.retryTimerCount];
-        else
-            retryTimerValue = [self retryTimeoutValue:self.transferTaskManager.retryTimerCount];
+        OB_INFO(@"Refreshing credentials before retrying %@: %@", obTask.marker, decision.reason);
+        [self refreshCredentialsOf:[OBFileTransferAgentFactory fileTransferAgentInstance:obTask.remoteUrl withConfig:self.configParams]
+                        thenRetry:obTask.marker
+                               at:nextAttemptAt];
+        return;
+    }
+    [self.retryWheel scheduleKey:obTask.marker at:nextAttemptAt];
+}
 
-        dispatch_async(dispatch_get_main_queue(), ^{
-            OB_INFO(@"Setting up to retry pending tasks in %.2lu seconds", (unsigned long)retryTimerValue);
-            [self requestBackground];
-            [self performSelector:@selector(retryPendingInternal) withObject:nil afterDelay:retryTimerValue];
-        });
+// The refresh is a synchronous call to the server, so it is done on a background queue, once for all the transfers
+// that are refused while it is under way.  They go on the retry wheel when it is done.
+- (void)refreshCredentialsOf:(OBFileTransferAgent *)agent thenRetry:(NSString *)marker at:(NSDate *)nextAttemptAt
+{
+    NSString *agentClass = NSStringFromClass([agent class]);
+    @synchronized (self.credentialRefreshes)
+    {
+        NSMutableDictionary *waiting = self.credentialRefreshes[agentClass];
+        if (waiting != nil)
+        {
+            waiting[marker] = nextAttemptAt;
+            return;
+        }
+        self.credentialRefreshes[agentClass] = [NSMutableDictionary dictionaryWithObject:nextAttemptAt forKey:marker];
+    }
+
+    dispatch_async(dispatch_get_global_queue(DISPATCH_QUEUE_PRIORITY_DEFAULT, 0), ^{
+        [agent refreshCredentials];
+        NSDictionary *waiting;
+        @synchronized (self.credentialRefreshes)
+        {
+            waiting = self.credentialRefreshes[agentClass];
+            [self.credentialRefreshes removeObjectForKey:agentClass];
+        }
+        for (NSString *waitingMarker in waiting)
+        {
+            [self.retryWheel scheduleKey:waitingMarker at:waiting[waitingMarker]];
+        }
+    });
+}
+
+// Somewhere between half and all of the delay for the attempt
+- (NSTimeInterval)retryDelayAfterAttempt:(NSInteger)attemptCount
+{
+    NSTimeInterval delay;
+    if ([self.delegate respondsToSelector:@selector(retryTimeoutValue:)])
+        delay = [self.delegate retryTimeoutValue:attemptCount];
+    else
+        delay = [self retryTimeoutValue:attemptCount];
+    return delay / 2 + delay / 2 * arc4random_uniform(1001) / 1000.0;
+}
+
+// On the retry wheel's queue
+- (void)retryDueTransfers:(NSArray *)markers
+{
+    for (NSString *marker in markers)
+    {
+        OBFileTransferTask *obTask = [self.transferTaskManager transferTaskWithMarker:marker];
+        // It may have been cancelled or restarted in the meantime
+        if (obTask.status == FileTransferPendingRetry)
+            [self processObTask:obTask];
+    }
+}
+
+// The ready queue and the turns only live in memory, so they are rebuilt from the transfers we were left with: those
+// that were waiting go back in the ready queue, oldest first, and those in progress keep their turn, so that they
+// count against the limit until they are done, unless nothing of them is in flight any more (see
+// reconcileInProgressTransfers:).  Attached downloads (see restoreAttachedDownloads) have no turn.
+- (void)restoreScheduling
+{
+    NSArray *queued = [[self.transferTaskManager tasksWithStatus:FileTransferQueued] sortedArrayUsingComparator:^NSComparisonResult(OBFileTransferTask *a, OBFileTransferTask *b) {
+        return [a.createdOn compare:b.createdOn];
+    }];
+    NSArray *inProgress = [self.transferTaskManager processingTasks];
+    @synchronized (self.readyTransfers)
+    {
+        for (OBFileTransferTask *obTask in inProgress)
+        {
+            if (obTask.leaderMarker == nil)
+                self.runningTransfers[obTask.marker] = obTask;
+        }
+        for (OBFileTransferTask *obTask in queued)
+        {
+            [self.readyTransfers addMarker:obTask.marker priority:obTask.priority];
+        }
+    }
+    if (queued.count + inProgress.count > 0)
+        OB_INFO(@"%lu transfers queued, %lu in progress", (unsigned long)queued.count, (unsigned long)inProgress.count);
+    [self reconcileInProgressTransfers:inProgress];
+    [self scheduleTransfers];
+}
+
+// A transfer in progress when we were last running may have nothing in flight any more: its session tasks didn't
+// survive, e.g. if the user killed the app, or it had none yet (a download being probed, an upload being hashed or a
+// chunked upload being set up).  Such a transfer gives up its turn and is queued again, as it would otherwise hold it
+// forever.  The chunks and segments in flight are persisted, those that are gone are forgotten, so a chunked or
+// segmented transfer started again only sends what is missing.  Takes the transfers restored in progress, before
+// anything new starts.
+- (void)reconcileInProgressTransfers:(NSArray *)inProgress
+{
+    // Attached downloads go with the download they wait for
+    NSMutableArray *restored = [NSMutableArray new];
+    NSMutableDictionary *attempts = [NSMutableDictionary new];
+    for (OBFileTransferTask *obTask in inProgress)
+    {
+        if (obTask.leaderMarker != nil)
+            continue;
+        [restored addObject:obTask];
+        attempts[obTask.marker] = @(obTask.attemptCount);
+    }
+    if (restored.count == 0)
+        return;
+
+    [[self session] getTasksWithCompletionHandler:^(NSArray *dataTasks, NSArray *uploadTasks, NSArray *downloadTasks) {
+        NSMutableSet *liveIdentifiers = [NSMutableSet new];
+        for (NSURLSessionTask *task in [[dataTasks arrayByAddingObjectsFromArray:uploadTasks] arrayByAddingObjectsFromArray:downloadTasks])
+        {
+            [liveIdentifiers addObject:@(task.taskIdentifier)];
+        }
+
+        NSMutableArray *stalled = [NSMutableArray new];
+        for (OBFileTransferTask *obTask in restored)
+        {
+            // Done, cancelled or started again since
+            if ([self.transferTaskManager transferTaskWithMarker:obTask.marker] != obTask ||
+                    obTask.status != FileTransferInProgress || obTask.attemptCount != [attempts[obTask.marker] integerValue])
+                continue;
+
+            BOOL live = obTask.nsTaskIdentifier != 0 && [liveIdentifiers containsObject:@(obTask.nsTaskIdentifier)];
+            NSArray *chunkNsTaskIdentifiers;
+            @synchronized (obTask)
+            {
+                chunkNsTaskIdentifiers = [obTask.activeChunks allKeys];
+            }
+            for (NSNumber *identifier in chunkNsTaskIdentifiers)
+            {
+                if ([liveIdentifiers containsObject:identifier])
+                    live = YES;
+                else
+                    [self.transferTaskManager finishedChunkNsTask:identifier.unsignedIntegerValue ofTask:obTask];
+            }
+            if (!live)
+            {
+                OB_INFO(@"Nothing of %@ in flight, queueing it again", obTask.marker);
+                [stalled addObject:obTask];
+            }
+        }
+        if (stalled.count == 0)
+            return;
+
+        @synchronized (self.readyTransfers)
+        {
+            for (OBFileTransferTask *obTask in stalled)
+            {
+                if (self.runningTransfers[obTask.marker] == obTask)
+                    [self.runningTransfers removeObjectForKey:obTask.marker];
+            }
+        }
+        [self processObTasks:stalled];
+    }];
+}
+
+// Put the transfers that were pending retry when we were last running back on the wheel.  Those saved before
+// retry times were kept with each transfer go right away.
+- (void)scheduleRestoredRetries
+{
+    NSArray *pendingRetries = [self.transferTaskManager tasksWithStatus:FileTransferPendingRetry];
+    for (OBFileTransferTask *obTask in pendingRetries)
+    {
+        [self.retryWheel scheduleKey:obTask.marker at:obTask.nextAttemptAt != nil ? obTask.nextAttemptAt : [NSDate date]];
     }
+    if (pendingRetries.count > 0)
+        OB_INFO(@"%lu transfers pending retry", (unsigned long)pendingRetries.count);
 }
 
 
@@ -1087,13 +2948,17 @@ didReceiveChallenge:(NSURLAuthenticationChallenge *)challenge
     }
 }
 
+- (void)flushTransferState
+{
+    [self.transferTaskManager flush];
+}
+
 - (void)updateBackground
 {
     if (self.backgroundTaskIdentifier != UIBackgroundTaskInvalid)
     {
-        if ([self.transferTaskManager pendingTasks].count == 0)
+        if ([self.transferTaskManager pendingTaskCount] == 0)
         {
-            [[self transferTaskManager] resetRetryTimerCount];
             [[UIApplication sharedApplication] endBackgroundTask:self.backgroundTaskIdentifier];
 
             self.backgroundTaskIdentifier = UIBackgroundTaskInvalid;
@@ -1111,6 +2976,9 @@ didReceiveChallenge:(NSURLAuthenticationChallenge *)challenge
 - (void)setupTransferTaskManager
 {
     [self transferTaskManager];
+    [self restoreAttachedDownloads];
+    [self restoreScheduling];
+    [self scheduleRestoredRetries];
 }
 
 
@@ -1210,7 +3078,7 @@ didReceiveChallenge:(NSURLAuthenticationChallenge *)challenge
 - (NSTimeInterval)retryTimeoutValue:(NSUInteger)retryAttempt
 {
     //    return (NSTimeInterval)10.0;
-    return (NSTimeInterval)10 * (1 << (retryAttempt - 1));
+    return MIN((NSTimeInterval)10 * (1 << MIN(MAX(retryAttempt, 1) - 1, 20)), MAX_RETRY_DELAY);
 }
 
 @end
\ No newline at end of file
@@ -1,7 +1,10 @@
 var express = require('express'),
     app = express(),
     multer = require('multer'),
-    img = require('easyimage');
+    img = require('easyimage'),
+    fs = require('fs'),
+    crypto = require('crypto'),
+    path = require('path');
 
 var imgs = ['png', 'jpg', 'jpeg', 'gif', 'bmp']; // only make thumbnail for these
 
@@ -24,6 +27,137 @@ app.use(multer({
 }));
 app.use(express.static(__dirname + '/static'));
 
+// Chunked uploads, shared by the GCS resumable stub and our own chunked upload protocol (see OBServerFileTransferAgent.h).
+// Each session appends the chunks to its file in static/files as they come in, so the file is complete once the
+// last chunk is in.
+var chunkedSessions = {};
+var nextSessionId = 1;
+
+function startChunkedSession(name, total) {
+    var id = String(nextSessionId++);
+    name = (name || 'upload-' + id).replace(/[^\w.-]+/g, '-');
+    chunkedSessions[id] = {
+        file: path.join(__dirname, 'static', 'files', name),
+        name: name,
+        total: parseInt(total, 10),
+        received: 0
+    };
+    fs.writeFileSync(chunkedSessions[id].file, new Buffer(0));
+    console.log("Started chunked upload %s of %s, %d bytes", id, name, chunkedSessions[id].total);
+    return id;
+}
+
+// Calls back with an error message if the chunk can't be taken, otherwise with the session after taking it.
+// Content-Range is "bytes first-last/total", or "bytes */total" to just ask how much we have.
+function receiveChunk(id, req, callback) {
+    var session = chunkedSessions[id];
+    var chunks = [];
+    req.on('data', function (chunk) { chunks.push(chunk); });
+    req.on('end', function () {
+        var range = /bytes (\d+)-(\d+)\/(\d+)/.exec(req.get('Content-Range') || '');
+        if (range) {
+            var first = parseInt(range[1], 10);
+            if (first > session.received)
+                return callback('Chunk starts after the received offset');
+            // Skip the bytes we already have
+            var fresh = Buffer.concat(chunks).slice(session.received - first);
+            fs.appendFileSync(session.file, fresh);
+            session.received += fresh.length;
+            console.log("Chunked upload %s has %d of %d bytes", id, session.received, session.total);
+        }
+        callback(null, session);
+    });
+}
+
+function cancelChunkedSession(id) {
+    fs.unlink(chunkedSessions[id].file, function () {});
+    delete chunkedSessions[id];
+}
+
+// Our chunked upload protocol
+app.post('/upload', function (req, res, next) {
+    if (req.query.uploadType !== 'chunked')
+        return next();
+    express.urlencoded()(req, res, function () {
+        var id = startChunkedSession(req.body.filename, req.get('X-Upload-Content-Length'));
+        res.set('Location', '/upload/chunked/' + id);
+        res.send(201);
+    });
+});
+
+app.put('/upload/chunked/:id', function (req, res) {
+    if (!chunkedSessions[req.params.id])
+        return res.send(404);
+    receiveChunk(req.params.id, req, function (err, session) {
+        if (err)
+            return res.send(400, err);
+        res.set('X-Upload-Offset', String(session.received));
+        if (session.received < session.total)
+            return res.send(200);
+        res.send({image: false, file: session.name, savedAs: session.name});
+    });
+});
+
+app.delete('/upload/chunked/:id', function (req, res) {
+    if (!chunkedSessions[req.params.id])
+        return res.send(404);
+    cancelChunkedSession(req.params.id);
+    res.send(204);
+});
+
+// Upload deduplication: 200 if we have the file with the X-Content-SHA256 content.  Multipart uploads are stored
+// under the multer rename below, chunked ones under startChunkedSession's.
+app.head('/upload', function (req, res) {
+    var filename = req.query.filename || '';
+    var ext = path.extname(filename);
+    var candidates = [
+        path.basename(filename, ext).replace(/\W+/g, '-').toLowerCase() + ext,
+        filename.replace(/[^\w.-]+/g, '-')
+    ];
+    for (var i = 0; i < candidates.length; i++) {
+        var file = path.join(__dirname, 'static', 'files', candidates[i]);
+        if (!fs.existsSync(file))
+            continue;
+        var hash = crypto.createHash('sha256').update(fs.readFileSync(file)).digest('hex');
+        if (hash === req.get('X-Content-SHA256'))
+            return res.send(200);
+    }
+    res.send(404);
+});
+
+// Stub of the Google Cloud Storage resumable upload endpoints, for testing with OBGoogleCloudStorageBaseUrlParam
+// set to http://<this host>:3000.
+app.post('/upload/storage/v1/b/:bucket/o', function (req, res) {
+    if (req.query.uploadType !== 'resumable')
+        return res.send(400, 'Only resumable uploads are stubbed');
+    var id = startChunkedSession(req.query.name, req.get('X-Upload-Content-Length'));
+    res.set('Location', req.protocol + '://' + req.get('host') + req.path + '?uploadType=resumable&upload_id=' + id);
+    res.send(200);
+});
+
+app.put('/upload/storage/v1/b/:bucket/o', function (req, res) {
+    if (!chunkedSessions[req.query.upload_id])
+        return res.send(404);
+    receiveChunk(req.query.upload_id, req, function (err, session) {
+        if (err)
+            return res.send(400, err);
+        if (session.received < session.total) {
+            // 308 Resume Incomplete, with the range we have if any
+            if (session.received > 0)
+                res.set('Range', 'bytes=0-' + (session.received - 1));
+            return res.send(308);
+        }
+        res.send(200, {name: session.name, size: String(session.total)});
+    });
+});
+
+app.delete('/upload/storage/v1/b/:bucket/o', function (req, res) {
+    if (!chunkedSessions[req.query.upload_id])
+        return res.send(404);
+    cancelChunkedSession(req.query.upload_id);
+    res.send(499);
+});
+
 app.post('/upload', function (req, res) {
     console.log("Req params = %j",req.params);
     if ( req.files && req.files.file)